@@ -0,0 +1,176 @@
+#include "BakedBoneAnimation.hpp"
+#include "Skeleton.hpp"
+#include <cmath>
+
+const float BakedBoneAnimation::maxFrameRate = 240;
+
+BakedBoneAnimation::BakedBoneAnimation(ptr<Skeleton> skeleton, float frameRate, float startTime, int framesCount)
+: BoneAnimationClip(skeleton), frameRate(frameRate), startTime(startTime), framesCount(framesCount),
+	frameSize(skeleton->GetPaddedSlotsCount() * 4),
+	frames(framesCount * frameSize), rootBoneOffsets(framesCount), maxAngularError(0) {}
+
+float BakedBoneAnimation::GetFrameRate() const
+{
+	return frameRate;
+}
+
+int BakedBoneAnimation::GetFramesCount() const
+{
+	return framesCount;
+}
+
+float BakedBoneAnimation::GetMaxAngularError() const
+{
+	return maxAngularError;
+}
+
+void BakedBoneAnimation::Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const
+{
+	// номер кадра слева и коэффициент до следующего
+	float position = (time - startTime) * frameRate;
+	int frameA, frameB;
+	float factor;
+	if(position <= 0)
+	{
+		frameA = frameB = 0;
+		factor = 0;
+	}
+	else if(position >= (float)(framesCount - 1))
+	{
+		frameA = frameB = framesCount - 1;
+		factor = 0;
+	}
+	else
+	{
+		frameA = (int)position;
+		frameB = frameA + 1;
+		factor = position - (float)frameA;
+	}
+
+	int paddedSlotsCount = frameSize / 4;
+	const float* rowA = &frames[frameA * frameSize];
+	const float* rowB = &frames[frameB * frameSize];
+	for(int i = 0; i < 4; ++i)
+	{
+		pairs.keysA[i] = rowA + i * paddedSlotsCount;
+		pairs.keysB[i] = rowB + i * paddedSlotsCount;
+	}
+	std::fill(cursor.factors.begin(), cursor.factors.end(), factor);
+	pairs.factors = &cursor.factors[0];
+	pairs.rootBoneOffset = lerp(rootBoneOffsets[frameA], rootBoneOffsets[frameB], factor);
+}
+
+ptr<BakedBoneAnimation> BakedBoneAnimation::Resample(ptr<BoneAnimation> animation, float frameRate)
+{
+	ptr<Skeleton> skeleton = animation->GetSkeleton();
+	int bonesCount = (int)skeleton->GetBones().size();
+	int paddedSlotsCount = skeleton->GetPaddedSlotsCount();
+
+	float startTime = animation->GetStartTime();
+	float endTime = animation->GetEndTime();
+	int framesCount = (int)ceil((endTime - startTime) * frameRate) + 1;
+
+	ptr<BakedBoneAnimation> baked = NEW(BakedBoneAnimation(skeleton, frameRate, startTime, framesCount));
+
+	// проиграть исходную анимацию по кадрам (монотонно, курсоры работают за O(1))
+	BoneAnimationCursor cursor;
+	cursor.Resize(bonesCount, paddedSlotsCount);
+	SoaQuats orientations;
+	orientations.Resize(paddedSlotsCount);
+	for(int i = 0; i < framesCount; ++i)
+	{
+		BoneKeyPairs pairs;
+		animation->Sample(startTime + (float)i / frameRate, cursor, pairs);
+		BoneAnimationClip::Interpolate(pairs, paddedSlotsCount, orientations);
+
+		float* row = &baked->frames[i * baked->frameSize];
+		std::copy(orientations.x.begin(), orientations.x.end(), row);
+		std::copy(orientations.y.begin(), orientations.y.end(), row + paddedSlotsCount);
+		std::copy(orientations.z.begin(), orientations.z.end(), row + paddedSlotsCount * 2);
+		std::copy(orientations.w.begin(), orientations.w.end(), row + paddedSlotsCount * 3);
+		baked->rootBoneOffsets[i] = pairs.rootBoneOffset;
+	}
+
+	return baked;
+}
+
+float BakedBoneAnimation::MeasureError(ptr<BoneAnimation> animation) const
+{
+	int bonesCount = (int)skeleton->GetBones().size();
+	int paddedSlotsCount = frameSize / 4;
+
+	// ошибка максимальна либо в ключах исходной анимации (изломах),
+	// либо посередине между запечёнными кадрами
+	std::vector<float> times;
+	const std::vector<std::vector<BoneAnimation::Key> >& keys = animation->GetKeys();
+	for(size_t i = 0; i < keys.size(); ++i)
+		for(size_t j = 0; j < keys[i].size(); ++j)
+			times.push_back(keys[i][j].time);
+	for(int i = 0; i + 1 < framesCount; ++i)
+		times.push_back(startTime + ((float)i + 0.5f) / frameRate);
+	std::sort(times.begin(), times.end());
+	times.erase(std::unique(times.begin(), times.end()), times.end());
+
+	BoneAnimationCursor rawCursor, bakedCursor;
+	rawCursor.Resize(bonesCount, paddedSlotsCount);
+	bakedCursor.Resize(bonesCount, paddedSlotsCount);
+	SoaQuats rawOrientations, bakedOrientations;
+	rawOrientations.Resize(paddedSlotsCount);
+	bakedOrientations.Resize(paddedSlotsCount);
+
+	double maxError = 0;
+	for(size_t i = 0; i < times.size(); ++i)
+	{
+		BoneKeyPairs rawPairs, bakedPairs;
+		animation->Sample(times[i], rawCursor, rawPairs);
+		BoneAnimationClip::Interpolate(rawPairs, paddedSlotsCount, rawOrientations);
+		Sample(times[i], bakedCursor, bakedPairs);
+		BoneAnimationClip::Interpolate(bakedPairs, paddedSlotsCount, bakedOrientations);
+
+		for(int j = 0; j < bonesCount; ++j)
+		{
+			// угол поворота a^-1 * b
+			Eigen::Quaterniond a = toEigenQuat(rawOrientations.Get(j)).cast<double>();
+			Eigen::Quaterniond b = toEigenQuat(bakedOrientations.Get(j)).cast<double>();
+			Eigen::Quaterniond d = a.conjugate() * b;
+			double error = 2 * atan2(d.vec().norm(), fabs(d.w()));
+			if(error > maxError)
+				maxError = error;
+		}
+	}
+
+	return (float)maxError;
+}
+
+ptr<BakedBoneAnimation> BakedBoneAnimation::Bake(ptr<BoneAnimation> animation, float frameRate, float maxAngularError)
+{
+	try
+	{
+		if(!(frameRate > 0))
+			THROW("Frame rate should be positive");
+		if(animation->GetStartTime() > animation->GetEndTime())
+			THROW("Animation has no keys");
+
+		// если точность так и не достигнута, вернуть наиболее точный вариант
+		ptr<BakedBoneAnimation> best;
+		for(;;)
+		{
+			ptr<BakedBoneAnimation> baked = Resample(animation, frameRate);
+			baked->maxAngularError = baked->MeasureError(animation);
+			if(!best || baked->maxAngularError < best->maxAngularError)
+				best = baked;
+			if(best->maxAngularError <= maxAngularError || frameRate * 2 > maxFrameRate)
+				return best;
+			frameRate *= 2;
+		}
+	}
+	catch(Exception* exception)
+	{
+		THROW_SECONDARY("Can't bake bone animation", exception);
+	}
+}
+
+ptr<BakedBoneAnimation> BakedBoneAnimation::Deserialize(ptr<InputStream> inputStream, ptr<Skeleton> skeleton, float frameRate, float maxAngularError)
+{
+	return Bake(BoneAnimation::Deserialize(inputStream, skeleton), frameRate, maxAngularError);
+}
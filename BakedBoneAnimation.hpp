@@ -0,0 +1,60 @@
+#ifndef ___FARSH_BAKED_BONE_ANIMATION_HPP___
+#define ___FARSH_BAKED_BONE_ANIMATION_HPP___
+
+#include "BoneAnimation.hpp"
+
+/// Запечённая анимация костей.
+/** Все кости пересэмплированы с постоянной частотой кадров в один
+непрерывный массив. Кадры идут подряд, внутри кадра - SoA-раскладка
+по слотам скелета (x, y, z, w). Сэмплирование - индексная арифметика
+и одна интерполяция, без поиска ключей. */
+class BakedBoneAnimation : public BoneAnimationClip
+{
+private:
+	/// Частота кадров.
+	float frameRate;
+	/// Время первого кадра.
+	float startTime;
+	/// Количество кадров.
+	int framesCount;
+	/// Размер кадра в float'ах (4 * количество слотов с запасом).
+	int frameSize;
+	/// Относительные ориентации по кадрам.
+	std::vector<float> frames;
+	/// Смещения корневой кости по кадрам.
+	std::vector<vec3> rootBoneOffsets;
+	/// Максимальная угловая ошибка относительно исходной анимации (радианы).
+	float maxAngularError;
+
+	/// Максимальная частота кадров, до которой поднимается частота при запекании.
+	static const float maxFrameRate;
+
+	BakedBoneAnimation(ptr<Skeleton> skeleton, float frameRate, float startTime, int framesCount);
+
+	/// Пересэмплировать анимацию с заданной частотой.
+	static ptr<BakedBoneAnimation> Resample(ptr<BoneAnimation> animation, float frameRate);
+	/// Измерить максимальную угловую ошибку относительно исходной анимации.
+	float MeasureError(ptr<BoneAnimation> animation) const;
+
+public:
+	float GetFrameRate() const;
+	int GetFramesCount() const;
+	float GetMaxAngularError() const;
+
+	void Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const;
+
+	/// Запечь анимацию.
+	/** Начинает с заданной частоты кадров и удваивает её, пока угловая
+	ошибка не станет меньше допустимой (или частота не достигнет предела).
+	Достигнутая ошибка доступна через GetMaxAngularError.
+	Ключи .ba-файлов идут с частотой 30 кадров в секунду, поэтому частота,
+	кратная 30, даёт минимальную ошибку в изломах между ключами. */
+	static ptr<BakedBoneAnimation> Bake(ptr<BoneAnimation> animation, float frameRate, float maxAngularError);
+
+	/// Загрузить анимацию из .ba-файла и запечь её.
+	static ptr<BakedBoneAnimation> Deserialize(ptr<InputStream> inputStream, ptr<Skeleton> skeleton, float frameRate, float maxAngularError);
+
+	META_DECLARE_CLASS(BakedBoneAnimation);
+};
+
+#endif
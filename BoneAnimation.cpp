@@ -1,6 +1,7 @@
 #include "BoneAnimation.hpp"
 #include "Skeleton.hpp"
 #include <iostream>
+#include <limits>
 
 /*
 Формат файла костной анимации:
@@ -17,10 +18,178 @@
 }
 */
 
+//*** BoneAnimationCursor
+
+BoneAnimationCursor::BoneAnimationCursor()
+: time(-std::numeric_limits<float>::infinity()), skipLeafBones(false) {}
+
+void BoneAnimationCursor::Resize(int bonesCount, int paddedSlotsCount)
+{
+	keys.assign(bonesCount, 0);
+	time = -std::numeric_limits<float>::infinity();
+	keysA.Resize(paddedSlotsCount);
+	keysB.Resize(paddedSlotsCount);
+	factors.assign(paddedSlotsCount, 0);
+}
+
+//*** BoneAnimationClip
+
+const float BoneAnimationClip::slerpThreshold = 0.99f;
+
+BoneAnimationClip::BoneAnimationClip(ptr<Skeleton> skeleton)
+: skeleton(skeleton) {}
+
+ptr<Skeleton> BoneAnimationClip::GetSkeleton() const
+{
+	return skeleton;
+}
+
+void BoneAnimationClip::Interpolate(const BoneKeyPairs& pairs, int paddedSlotsCount, SoaQuats& orientations)
+{
+	const float4 one(1.0f);
+	const float4 threshold(slerpThreshold);
+
+	for(int i = 0; i < paddedSlotsCount; i += 4)
+	{
+		float4 ax = float4::Load(pairs.keysA[0] + i);
+		float4 ay = float4::Load(pairs.keysA[1] + i);
+		float4 az = float4::Load(pairs.keysA[2] + i);
+		float4 aw = float4::Load(pairs.keysA[3] + i);
+		float4 bx = float4::Load(pairs.keysB[0] + i);
+		float4 by = float4::Load(pairs.keysB[1] + i);
+		float4 bz = float4::Load(pairs.keysB[2] + i);
+		float4 bw = float4::Load(pairs.keysB[3] + i);
+		float4 t = float4::Load(pairs.factors + i);
+
+		// интерполировать по кратчайшему пути
+		float4 d = ax * bx + ay * by + az * bz + aw * bw;
+		bx = mulsign(bx, d);
+		by = mulsign(by, d);
+		bz = mulsign(bz, d);
+		bw = mulsign(bw, d);
+
+		// nlerp
+		float4 u = one - t;
+		float4 rx = ax * u + bx * t;
+		float4 ry = ay * u + by * t;
+		float4 rz = az * u + bz * t;
+		float4 rw = aw * u + bw * t;
+		float4 l = sqrt(rx * rx + ry * ry + rz * rz + rw * rw);
+		(rx / l).Store(&orientations.x[i]);
+		(ry / l).Store(&orientations.y[i]);
+		(rz / l).Store(&orientations.z[i]);
+		(rw / l).Store(&orientations.w[i]);
+
+		// для далёких друг от друга ключей nlerp неточен, делаем slerp
+		int farMask = lessmask(abs(d), threshold);
+		if(farMask)
+			for(int j = 0; j < 4; ++j)
+				if(farMask & (1 << j))
+				{
+					int k = i + j;
+					quat a(pairs.keysA[0][k], pairs.keysA[1][k], pairs.keysA[2][k], pairs.keysA[3][k]);
+					quat b(pairs.keysB[0][k], pairs.keysB[1][k], pairs.keysB[2][k], pairs.keysB[3][k]);
+					orientations.Set(k, fromEigen(toEigenQuat(a).slerp(pairs.factors[k], toEigenQuat(b))));
+				}
+	}
+}
+
 //*** BoneAnimation
 
 BoneAnimation::BoneAnimation(ptr<Skeleton> skeleton, const std::vector<std::vector<Key> >& keys, const std::vector<vec3>& rootBoneOffsets)
-: skeleton(skeleton), keys(keys), rootBoneOffsets(rootBoneOffsets) {}
+: BoneAnimationClip(skeleton), keys(keys), rootBoneOffsets(rootBoneOffsets) {}
+
+const std::vector<std::vector<BoneAnimation::Key> >& BoneAnimation::GetKeys() const
+{
+	return keys;
+}
+
+const std::vector<vec3>& BoneAnimation::GetRootBoneOffsets() const
+{
+	return rootBoneOffsets;
+}
+
+float BoneAnimation::GetStartTime() const
+{
+	float startTime = std::numeric_limits<float>::infinity();
+	for(size_t i = 0; i < keys.size(); ++i)
+		if(!keys[i].empty())
+			startTime = std::min(startTime, keys[i].front().time);
+	return startTime;
+}
+
+float BoneAnimation::GetEndTime() const
+{
+	float endTime = -std::numeric_limits<float>::infinity();
+	for(size_t i = 0; i < keys.size(); ++i)
+		if(!keys[i].empty())
+			endTime = std::max(endTime, keys[i].back().time);
+	return endTime;
+}
+
+void BoneAnimation::Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const
+{
+	const std::vector<int>& boneSlots = skeleton->GetBoneSlots();
+
+	// кости для сэмплирования, в топологическом порядке
+	const std::vector<int>& bones = cursor.skipLeafBones ? skeleton->GetLodBones() : skeleton->GetSortedBones();
+	int bonesCount = (int)bones.size();
+
+	// при движении назад (зацикливание или перемотка) курсоры недействительны
+	bool forward = time >= cursor.time;
+	cursor.time = time;
+
+	// для каждой кости получить пару ключей и коэффициент между ними
+	// а для корневой кости получить ещё и позицию
+	for(int j = 0; j < bonesCount; ++j)
+	{
+		int i = bones[j];
+		const std::vector<Key>& boneKeys = keys[i];
+		int boneKeysCount = (int)boneKeys.size();
+
+		// найти следующий за временем ключ
+		int frame = AdvanceCursor(boneKeys.data(), boneKeysCount, cursor.keys[i], forward, time);
+		cursor.keys[i] = frame;
+
+		int frameA, frameB;
+		float interframeTime;
+		if(frame <= 0)
+		{
+			frameA = frameB = 0;
+			interframeTime = 0;
+		}
+		else if(frame >= boneKeysCount)
+		{
+			frameA = frameB = boneKeysCount - 1;
+			interframeTime = 0;
+		}
+		else
+		{
+			frameA = frame - 1;
+			frameB = frame;
+			interframeTime = (time - boneKeys[frameA].time) / (boneKeys[frameB].time - boneKeys[frameA].time);
+		}
+
+		int slot = boneSlots[i];
+		cursor.keysA.Set(slot, boneKeys[frameA].orientation);
+		cursor.keysB.Set(slot, boneKeys[frameB].orientation);
+		cursor.factors[slot] = interframeTime;
+
+		// для корневой кости
+		if(i == 0)
+			pairs.rootBoneOffset = lerp(rootBoneOffsets[frameA], rootBoneOffsets[frameB], interframeTime);
+	}
+
+	pairs.keysA[0] = &cursor.keysA.x[0];
+	pairs.keysA[1] = &cursor.keysA.y[0];
+	pairs.keysA[2] = &cursor.keysA.z[0];
+	pairs.keysA[3] = &cursor.keysA.w[0];
+	pairs.keysB[0] = &cursor.keysB.x[0];
+	pairs.keysB[1] = &cursor.keysB.y[0];
+	pairs.keysB[2] = &cursor.keysB.z[0];
+	pairs.keysB[3] = &cursor.keysB.w[0];
+	pairs.factors = &cursor.factors[0];
+}
 
 ptr<BoneAnimation> BoneAnimation::Deserialize(ptr<InputStream> inputStream, ptr<Skeleton> skeleton)
 {
@@ -103,108 +272,401 @@ ptr<BoneAnimation> BoneAnimation::Deserialize(ptr<InputStream> inputStream, ptr<
 
 //*** BoneAnimationFrame
 
-BoneAnimationFrame::BoneAnimationFrame(ptr<BoneAnimation> animation)
-: animation(animation),
-	animationRelativeOrientations(animation->keys.size()),
-	animationWorldOrientations(animationRelativeOrientations.size()),
-	animationWorldPositions(animationRelativeOrientations.size()),
-	orientations(animationRelativeOrientations.size()),
-	offsets(animationRelativeOrientations.size())
-{}
+/// Начальное значение счётчика обновлений для следующего кадра анимации.
+/** Раздаётся по порядку, чтобы кадры с редким обновлением
+обновлялись в разные тики, а не все разом. */
+static int nextUpdateCounter = 0;
 
-void BoneAnimationFrame::Setup(const vec3& originOffset, const quat& originOrientation, float time)
+/// Произведение кватернионов a * b для четвёрки костей.
+static inline void MulQuats(
+	const float4& ax, const float4& ay, const float4& az, const float4& aw,
+	const float4& bx, const float4& by, const float4& bz, const float4& bw,
+	float4& rx, float4& ry, float4& rz, float4& rw)
+{
+	rx = aw * bx + ax * bw + ay * bz - az * by;
+	ry = aw * by + ay * bw + az * bx - ax * bz;
+	rz = aw * bz + az * bw + ax * by - ay * bx;
+	rw = aw * bw - ax * bx - ay * by - az * bz;
+}
+
+/// Поворот вектора v кватернионом q для четвёрки костей.
+static inline void RotateVecs(
+	const float4& qx, const float4& qy, const float4& qz, const float4& qw,
+	const float4& vx, const float4& vy, const float4& vz,
+	float4& rx, float4& ry, float4& rz)
+{
+	// t = cross(q.xyz, v) + v * q.w
+	float4 tx = qy * vz - qz * vy + vx * qw;
+	float4 ty = qz * vx - qx * vz + vy * qw;
+	float4 tz = qx * vy - qy * vx + vz * qw;
+	// r = v + cross(q.xyz, t) * 2
+	const float4 two(2.0f);
+	rx = vx + (qy * tz - qz * ty) * two;
+	ry = vy + (qz * tx - qx * tz) * two;
+	rz = vz + (qx * ty - qy * tx) * two;
+}
+
+BoneAnimationFrame::Layer::Layer()
+: time(0), loopStart(0), loopEnd(0), weight(1) {}
+
+BoneAnimationFrame::BoneAnimationFrame(ptr<BoneAnimationClip> animation)
+: skeleton(animation->GetSkeleton()), updatePeriod(1), updateCounter(nextUpdateCounter++), skipLeafBones(false), poseReady(false)
+{
+	int bonesCount = (int)skeleton->GetBones().size();
+	int paddedSlotsCount = skeleton->GetPaddedSlotsCount();
+
+	slotLayerOrientations.Resize(paddedSlotsCount);
+	slotRelativeOrientations.Resize(paddedSlotsCount);
+	slotWorldOrientations.Resize(paddedSlotsCount);
+	slotWorldPositions.Resize(paddedSlotsCount);
+	slotOrientations.Resize(paddedSlotsCount);
+	slotOffsets.Resize(paddedSlotsCount);
+
+	animationWorldOrientations.resize(bonesCount);
+	animationWorldPositions.resize(bonesCount);
+	orientations.resize(bonesCount);
+	offsets.resize(bonesCount);
+
+	AddLayer(animation);
+}
+
+BoneAnimationFrame::Layer& BoneAnimationFrame::GetLayer(int layer)
+{
+	if(layer < 0 || layer >= (int)layers.size())
+		THROW("Invalid animation layer");
+	return layers[layer];
+}
+
+int BoneAnimationFrame::AddLayer(ptr<BoneAnimationClip> clip)
+{
+	layers.push_back(Layer());
+	layers.back().slotWeights.assign(skeleton->GetPaddedSlotsCount(), 1.0f);
+	int layer = (int)layers.size() - 1;
+	try
+	{
+		SetLayerClip(layer, clip);
+	}
+	catch(Exception* exception)
+	{
+		layers.pop_back();
+		THROW_SECONDARY("Can't add animation layer", exception);
+	}
+	return layer;
+}
+
+int BoneAnimationFrame::GetLayersCount() const
 {
-	// получить ключи и смещения
-	const std::vector<std::vector<BoneAnimation::Key> >& keys = animation->keys;
-	const std::vector<vec3>& rootBoneOffsets = animation->rootBoneOffsets;
+	return (int)layers.size();
+}
+
+void BoneAnimationFrame::SetLayerClip(int layer, ptr<BoneAnimationClip> clip)
+{
+	Layer& l = GetLayer(layer);
+	// клипы слоёв должны быть для одной иерархии костей
+	ptr<Skeleton> clipSkeleton = clip->GetSkeleton();
+	if(clipSkeleton != skeleton && clipSkeleton->GetSlotBones() != skeleton->GetSlotBones())
+		THROW("Animation clip skeleton doesn't match frame skeleton");
+	l.clip = clip;
+	l.cursor.Resize((int)skeleton->GetBones().size(), skeleton->GetPaddedSlotsCount());
+	poseReady = false;
+}
+
+void BoneAnimationFrame::SetLayerTime(int layer, float time)
+{
+	GetLayer(layer).time = time;
+}
+
+float BoneAnimationFrame::GetLayerTime(int layer) const
+{
+	if(layer < 0 || layer >= (int)layers.size())
+		THROW("Invalid animation layer");
+	return layers[layer].time;
+}
+
+void BoneAnimationFrame::SetLayerLoop(int layer, float start, float end)
+{
+	Layer& l = GetLayer(layer);
+	l.loopStart = start;
+	l.loopEnd = end;
+}
+
+void BoneAnimationFrame::SetLayerWeight(int layer, float weight)
+{
+	GetLayer(layer).weight = weight;
+}
+
+void BoneAnimationFrame::SetLayerBoneWeight(int layer, int bone, float weight)
+{
+	Layer& l = GetLayer(layer);
+	if(bone < 0 || bone >= (int)skeleton->GetBones().size())
+		THROW("Invalid bone number");
+	l.slotWeights[skeleton->GetBoneSlots()[bone]] = weight;
+}
+
+void BoneAnimationFrame::SetLayerBranchWeight(int layer, int bone, float weight)
+{
+	Layer& l = GetLayer(layer);
+	if(bone < 0 || bone >= (int)skeleton->GetBones().size())
+		THROW("Invalid bone number");
 
-	struct Sorter
+	// слоты упорядочены по уровням, поэтому родитель всегда раньше потомка
+	const std::vector<int>& slotParents = skeleton->GetSlotParents();
+	int bonesCount = (int)slotParents.size();
+	int branchSlot = skeleton->GetBoneSlots()[bone];
+	std::vector<bool> inBranch(bonesCount, false);
+	inBranch[branchSlot] = true;
+	l.slotWeights[branchSlot] = weight;
+	for(int i = branchSlot + 1; i < bonesCount; ++i)
+		if(inBranch[slotParents[i]])
+		{
+			inBranch[i] = true;
+			l.slotWeights[i] = weight;
+		}
+}
+
+void BoneAnimationFrame::Advance(float deltaTime)
+{
+	for(size_t i = 0; i < layers.size(); ++i)
 	{
-		bool operator()(const BoneAnimation::Key& a, const BoneAnimation::Key& b) const
+		Layer& l = layers[i];
+		l.time += deltaTime;
+		if(l.loopEnd > l.loopStart)
 		{
-			return a.time < b.time;
+			float loopLength = l.loopEnd - l.loopStart;
+			if(l.time >= l.loopEnd || l.time < l.loopStart)
+				l.time -= (float)floor((l.time - l.loopStart) / loopLength) * loopLength;
 		}
-	} sorter;
+	}
+}
 
-	int bonesCount = (int)animationRelativeOrientations.size();
+void BoneAnimationFrame::SetScreenSize(float screenSize)
+{
+	float reducedRateScreenSize = skeleton->GetReducedRateScreenSize();
+	// период удваивается при каждом уменьшении размера вдвое
+	updatePeriod = 1;
+	for(float size = screenSize * 2; size < reducedRateScreenSize && updatePeriod < maxUpdatePeriod; size *= 2)
+		updatePeriod *= 2;
 
-	//std::cout << "Time: " << time << '\n';
+	skipLeafBones = screenSize < skeleton->GetLeafBonesScreenSize();
+}
 
-	// для каждой кости получить анимационную относительную ориентацию
-	// а для корневой кости получить ещё и позицию
-	vec3 rootBoneOffset;
-	for(int i = 0; i < bonesCount; ++i)
+int BoneAnimationFrame::GetUpdatePeriod() const
+{
+	return updatePeriod;
+}
+
+vec3 BoneAnimationFrame::Blend()
+{
+	int paddedSlotsCount = skeleton->GetPaddedSlotsCount();
+
+	// пропущенные листовые кости сдвигались не вместе со временем,
+	// поэтому при их включении курсоры сбрасываются
+	for(size_t i = 0; i < layers.size(); ++i)
 	{
-		const std::vector<BoneAnimation::Key>& boneKeys = keys[i];
-		quat& animationRelativeOrientation = animationRelativeOrientations[i];
-
-		// найти бинарным поиском следующий за временем ключ
-		BoneAnimation::Key timeKey;
-		timeKey.time = time;
-		ptrdiff_t frame = std::upper_bound(boneKeys.begin(), boneKeys.end(), timeKey, sorter) - boneKeys.begin();
-		float interframeTime = 0; // initialize to suppress warning only
-		if(frame <= 0)
-			animationRelativeOrientation = boneKeys.front().orientation;
-		else if(frame >= (int)boneKeys.size())
-			animationRelativeOrientation = boneKeys.back().orientation;
-		else
+		BoneAnimationCursor& cursor = layers[i].cursor;
+		if(cursor.skipLeafBones && !skipLeafBones)
+			cursor.Resize((int)skeleton->GetBones().size(), paddedSlotsCount);
+		cursor.skipLeafBones = skipLeafBones;
+	}
+
+	// базовый слой
+	Layer& baseLayer = layers[0];
+	BoneKeyPairs pairs;
+	baseLayer.clip->Sample(baseLayer.time, baseLayer.cursor, pairs);
+	BoneAnimationClip::Interpolate(pairs, paddedSlotsCount, slotRelativeOrientations);
+	vec3 rootBoneOffset = pairs.rootBoneOffset;
+
+	// остальные слои по очереди подмешиваются к результату
+	for(size_t i = 1; i < layers.size(); ++i)
+	{
+		Layer& l = layers[i];
+		if(l.weight <= 0)
+			continue;
+
+		l.clip->Sample(l.time, l.cursor, pairs);
+		BoneAnimationClip::Interpolate(pairs, paddedSlotsCount, slotLayerOrientations);
+
+		const float4 one(1.0f);
+		const float4 weight(l.weight);
+		for(int j = 0; j < paddedSlotsCount; j += 4)
 		{
-			interframeTime = (time - boneKeys[frame - 1].time) / (boneKeys[frame].time - boneKeys[frame - 1].time);
-			animationRelativeOrientation = fromEigen(toEigenQuat(boneKeys[frame - 1].orientation).slerp(interframeTime, toEigenQuat(boneKeys[frame].orientation)));
+			float4 ax = float4::Load(&slotRelativeOrientations.x[j]);
+			float4 ay = float4::Load(&slotRelativeOrientations.y[j]);
+			float4 az = float4::Load(&slotRelativeOrientations.z[j]);
+			float4 aw = float4::Load(&slotRelativeOrientations.w[j]);
+			float4 bx = float4::Load(&slotLayerOrientations.x[j]);
+			float4 by = float4::Load(&slotLayerOrientations.y[j]);
+			float4 bz = float4::Load(&slotLayerOrientations.z[j]);
+			float4 bw = float4::Load(&slotLayerOrientations.w[j]);
+			float4 t = float4::Load(&l.slotWeights[j]) * weight;
+
+			// nlerp по кратчайшему пути
+			float4 d = ax * bx + ay * by + az * bz + aw * bw;
+			float4 u = one - t;
+			t = mulsign(t, d);
+			float4 rx = ax * u + bx * t;
+			float4 ry = ay * u + by * t;
+			float4 rz = az * u + bz * t;
+			float4 rw = aw * u + bw * t;
+			float4 len = sqrt(rx * rx + ry * ry + rz * rz + rw * rw);
+			(rx / len).Store(&slotRelativeOrientations.x[j]);
+			(ry / len).Store(&slotRelativeOrientations.y[j]);
+			(rz / len).Store(&slotRelativeOrientations.z[j]);
+			(rw / len).Store(&slotRelativeOrientations.w[j]);
 		}
 
-		//std::cout << "ARO " << i << ": " << animationRelativeOrientation << '\n';
+		// корневая кость всегда в нулевом слоте
+		rootBoneOffset = lerp(rootBoneOffset, pairs.rootBoneOffset, l.weight * l.slotWeights[0]);
+	}
 
-		// для корневой кости
-		if(i == 0)
+	// листовые кости в исходной относительной ориентации,
+	// то есть с той же трансформацией, что и у родителя
+	if(skipLeafBones)
+	{
+		const std::vector<int>& leafSlots = skeleton->GetLeafSlots();
+		const std::vector<quat>& leafRelativeOrientations = skeleton->GetLeafRelativeOrientations();
+		for(size_t i = 0; i < leafSlots.size(); ++i)
+			slotRelativeOrientations.Set(leafSlots[i], leafRelativeOrientations[i]);
+	}
+
+	return rootBoneOffset;
+}
+
+void BoneAnimationFrame::Compose(const vec3& originOffset, const quat& originOrientation, const vec3& rootBoneOffset)
+{
+	const Skeleton& skeleton = *this->skeleton;
+	const std::vector<int>& slotBones = skeleton.GetSlotBones();
+	const std::vector<int>& slotParents = skeleton.GetSlotParents();
+	const std::vector<int>& levelOffsets = skeleton.GetLevelOffsets();
+	const SoaVecs& relativePositions = skeleton.GetSlotRelativePositions();
+	const SoaQuats& invWorldOrientations = skeleton.GetSlotInvWorldOrientations();
+	const SoaVecs& originalWorldPositions = skeleton.GetSlotWorldPositions();
+	int bonesCount = (int)slotBones.size();
+	int paddedSlotsCount = skeleton.GetPaddedSlotsCount();
+
+	// корневая кость (всегда в нулевом слоте)
+	slotWorldOrientations.Set(0, fromEigen(toEigenQuat(originOrientation) * toEigenQuat(slotRelativeOrientations.Get(0))));
+	slotWorldPositions.Set(0, fromEigen((toEigen(originOffset) + toEigenQuat(originOrientation) * toEigen(rootBoneOffset)).eval()));
+
+	// вычислить анимационные мировые ориентации и позиции по уровням
+	// пачка может залезть в следующий уровень - эти слоты перевычислятся позже
+	int levelsCount = (int)levelOffsets.size() - 1;
+	for(int level = 1; level < levelsCount; ++level)
+		for(int i = levelOffsets[level]; i < levelOffsets[level + 1]; i += 4)
 		{
-			if(frame <= 0)
-				rootBoneOffset = rootBoneOffsets.front();
-			else if(frame >= (int)boneKeys.size())
-				rootBoneOffset = rootBoneOffsets.back();
-			else
-				rootBoneOffset = lerp(rootBoneOffsets[frame - 1], rootBoneOffsets[frame], interframeTime);
+			const int* parents = &slotParents[i];
+#define GATHER(a) float4(a[parents[0]], a[parents[1]], a[parents[2]], a[parents[3]])
+			float4 px = GATHER(slotWorldOrientations.x);
+			float4 py = GATHER(slotWorldOrientations.y);
+			float4 pz = GATHER(slotWorldOrientations.z);
+			float4 pw = GATHER(slotWorldOrientations.w);
+			float4 ppx = GATHER(slotWorldPositions.x);
+			float4 ppy = GATHER(slotWorldPositions.y);
+			float4 ppz = GATHER(slotWorldPositions.z);
+#undef GATHER
+
+			float4 wx, wy, wz, ww;
+			MulQuats(px, py, pz, pw,
+				float4::Load(&slotRelativeOrientations.x[i]),
+				float4::Load(&slotRelativeOrientations.y[i]),
+				float4::Load(&slotRelativeOrientations.z[i]),
+				float4::Load(&slotRelativeOrientations.w[i]),
+				wx, wy, wz, ww);
+			wx.Store(&slotWorldOrientations.x[i]);
+			wy.Store(&slotWorldOrientations.y[i]);
+			wz.Store(&slotWorldOrientations.z[i]);
+			ww.Store(&slotWorldOrientations.w[i]);
+
+			float4 rx, ry, rz;
+			RotateVecs(px, py, pz, pw,
+				float4::Load(&relativePositions.x[i]),
+				float4::Load(&relativePositions.y[i]),
+				float4::Load(&relativePositions.z[i]),
+				rx, ry, rz);
+			(ppx + rx).Store(&slotWorldPositions.x[i]);
+			(ppy + ry).Store(&slotWorldPositions.y[i]);
+			(ppz + rz).Store(&slotWorldPositions.z[i]);
 		}
+
+	// вычислить результирующие ориентации и смещения для костей
+	for(int i = 0; i < paddedSlotsCount; i += 4)
+	{
+		float4 ox, oy, oz, ow;
+		MulQuats(
+			float4::Load(&slotWorldOrientations.x[i]),
+			float4::Load(&slotWorldOrientations.y[i]),
+			float4::Load(&slotWorldOrientations.z[i]),
+			float4::Load(&slotWorldOrientations.w[i]),
+			float4::Load(&invWorldOrientations.x[i]),
+			float4::Load(&invWorldOrientations.y[i]),
+			float4::Load(&invWorldOrientations.z[i]),
+			float4::Load(&invWorldOrientations.w[i]),
+			ox, oy, oz, ow);
+		ox.Store(&slotOrientations.x[i]);
+		oy.Store(&slotOrientations.y[i]);
+		oz.Store(&slotOrientations.z[i]);
+		ow.Store(&slotOrientations.w[i]);
+
+		float4 rx, ry, rz;
+		RotateVecs(ox, oy, oz, ow,
+			float4::Load(&originalWorldPositions.x[i]),
+			float4::Load(&originalWorldPositions.y[i]),
+			float4::Load(&originalWorldPositions.z[i]),
+			rx, ry, rz);
+		(float4::Load(&slotWorldPositions.x[i]) - rx).Store(&slotOffsets.x[i]);
+		(float4::Load(&slotWorldPositions.y[i]) - ry).Store(&slotOffsets.y[i]);
+		(float4::Load(&slotWorldPositions.z[i]) - rz).Store(&slotOffsets.z[i]);
 	}
 
-	// вычислить анимационные мировые ориентации и позиции
-	const std::vector<Skeleton::Bone>& bones = animation->skeleton->GetBones();
-	const std::vector<int>& sortedBones = animation->skeleton->GetSortedBones();
-#ifdef _DEBUG
-	static std::vector<bool> f(bonesCount);
-	f.assign(bonesCount, false);
-#endif
+	// разложить результаты по номерам костей
 	for(int i = 0; i < bonesCount; ++i)
 	{
-		int boneNumber = sortedBones[i];
-		const Skeleton::Bone& bone = bones[boneNumber];
-		if(boneNumber)
-		{
-			int parent = bone.parent;
-#ifdef _DEBUG
-			if(!f[parent])
-				THROW("Parent is not calculated");
-#endif
-			animationWorldOrientations[boneNumber] = fromEigen(toEigenQuat(animationWorldOrientations[parent]) * toEigenQuat(animationRelativeOrientations[boneNumber]));
-			animationWorldPositions[boneNumber] = fromEigen((toEigen(animationWorldPositions[parent]) + toEigenQuat(animationWorldOrientations[parent]) * toEigen(bone.originalRelativePosition)).eval());
-		}
-		else
-		{
-			animationWorldOrientations[boneNumber] = fromEigen(toEigenQuat(originOrientation) * toEigenQuat(animationRelativeOrientations[boneNumber]));
-			animationWorldPositions[boneNumber] = fromEigen((toEigen(originOffset) + toEigenQuat(originOrientation) * toEigen(rootBoneOffset)).eval());
-		}
-#ifdef _DEBUG
-		f[boneNumber] = true;
-#endif
-		//std::cout << "Bone " << boneNumber << ", AWO=" << animationWorldOrientations[boneNumber] << ", AWP=" << animationWorldPositions[boneNumber] << '\n';
+		int boneNumber = slotBones[i];
+		animationWorldOrientations[boneNumber] = slotWorldOrientations.Get(i);
+		animationWorldPositions[boneNumber] = slotWorldPositions.Get(i);
+		orientations[boneNumber] = slotOrientations.Get(i);
+		offsets[boneNumber] = slotOffsets.Get(i);
 	}
+}
 
-	// вычислить результирующие ориентации для костей
+void BoneAnimationFrame::Repose(const vec3& originOffset, const quat& originOrientation)
+{
+	// поворот и перенос из старого положения в новое
+	Eigen::Quaternionf rotation = toEigenQuat(originOrientation) * toEigenQuat(poseOriginOrientation).conjugate();
+	Eigen::Vector3f oldOrigin = toEigen(poseOriginOffset);
+	Eigen::Vector3f newOrigin = toEigen(originOffset);
+
+	int bonesCount = (int)orientations.size();
 	for(int i = 0; i < bonesCount; ++i)
 	{
-		orientations[i] = fromEigen(toEigenQuat(animationWorldOrientations[i]) * toEigenQuat(bones[i].originalWorldOrientation).conjugate());
-		offsets[i] = fromEigen((toEigen(animationWorldPositions[i]) - toEigenQuat(orientations[i]) * toEigen(bones[i].originalWorldPosition)).eval());
-		//std::cout << "Result " << i << " O=" << orientations[i] << ", P=" << offsets[i] << '\n';
+		animationWorldOrientations[i] = fromEigen(rotation * toEigenQuat(animationWorldOrientations[i]));
+		animationWorldPositions[i] = fromEigen((rotation * (toEigen(animationWorldPositions[i]) - oldOrigin) + newOrigin).eval());
+		orientations[i] = fromEigen(rotation * toEigenQuat(orientations[i]));
+		offsets[i] = fromEigen((rotation * (toEigen(offsets[i]) - oldOrigin) + newOrigin).eval());
+	}
+
+	poseOriginOffset = originOffset;
+	poseOriginOrientation = originOrientation;
+}
+
+void BoneAnimationFrame::Setup(const vec3& originOffset, const quat& originOrientation)
+{
+	// при пониженной частоте обновления анимация пересчитывается
+	// раз в несколько кадров, а в остальных поза переносится целиком
+	if(poseReady && updatePeriod > 1 && ++updateCounter % updatePeriod)
+	{
+		Repose(originOffset, originOrientation);
+		return;
 	}
-	//std::cout << '\n';
+
+	Compose(originOffset, originOrientation, Blend());
+	poseReady = true;
+	poseOriginOffset = originOffset;
+	poseOriginOrientation = originOrientation;
+}
+
+void BoneAnimationFrame::Setup(const vec3& originOffset, const quat& originOrientation, float time)
+{
+	layers[0].time = time;
+	Setup(originOffset, originOrientation);
 }
@@ -2,14 +2,111 @@
 #define ___FARSH_BONE_ANIMATION_HPP___
 
 #include "general.hpp"
+#include "Soa.hpp"
+#include <algorithm>
 
 class Skeleton;
 class BoneAnimationFrame;
 
+/// Пары ключей по слотам скелета, между которыми интерполируются ориентации.
+/** Указывает на SoA-массивы длиной в количество слотов скелета с запасом. */
+struct BoneKeyPairs
+{
+	/// Ключи слева от времени (x, y, z, w).
+	const float* keysA[4];
+	/// Ключи справа от времени (x, y, z, w).
+	const float* keysB[4];
+	/// Коэффициенты интерполяции между ключами.
+	const float* factors;
+	/// Смещение корневой кости.
+	vec3 rootBoneOffset;
+};
+
+/// Состояние проигрывания клипа.
+/** Хранит курсоры ключей и промежуточные буферы. У каждого проигрывания
+своё состояние, поэтому клип можно проигрывать из разных потоков. */
+struct BoneAnimationCursor
+{
+	/// Курсоры ключей по костям.
+	/** Номер первого ключа кости, время которого больше времени последнего
+	кадра. При монотонном проигрывании сдвигаются вперёд за O(1). */
+	std::vector<int> keys;
+	/// Время последнего кадра.
+	float time;
+	/// Ключи слева и справа от текущего времени.
+	SoaQuats keysA, keysB;
+	/// Коэффициенты интерполяции между ключами.
+	std::vector<float> factors;
+	/// Не сэмплировать листовые кости.
+	/** Их ключи и курсоры остаются с прошлых кадров. */
+	bool skipLeafBones;
+
+	BoneAnimationCursor();
+
+	void Resize(int bonesCount, int paddedSlotsCount);
+};
+
+/// Абстрактный клип костной анимации.
+class BoneAnimationClip : public Object
+{
+protected:
+	ptr<Skeleton> skeleton;
+
+	/// Порог скалярного произведения ключей, выше которого достаточно nlerp.
+	/** Для более далёких ключей делается честный slerp. */
+	static const float slerpThreshold;
+
+	/// Максимальное количество шагов курсора вперёд до перехода на бинарный поиск.
+	static const int maxCursorSteps = 4;
+	/// Найти первый ключ, время которого больше time.
+	/** При движении вперёд курсор сдвигается на несколько ключей, а если
+	не хватило - досчитывается бинарным поиском; иначе ищется с начала.
+	У ключа должно быть поле time, сравнимое с float. */
+	template <typename Key>
+	static int AdvanceCursor(const Key* keys, int keysCount, int cursor, bool forward, float time);
+
+public:
+	BoneAnimationClip(ptr<Skeleton> skeleton);
+
+	ptr<Skeleton> GetSkeleton() const;
+
+	/// Получить пары ключей для всех костей в момент времени.
+	virtual void Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const = 0;
+
+	/// Проинтерполировать ключи, получив относительные ориентации по слотам.
+	static void Interpolate(const BoneKeyPairs& pairs, int paddedSlotsCount, SoaQuats& orientations);
+
+	META_DECLARE_CLASS(BoneAnimationClip);
+};
+
+template <typename Key>
+int BoneAnimationClip::AdvanceCursor(const Key* keys, int keysCount, int cursor, bool forward, float time)
+{
+	struct Sorter
+	{
+		bool operator()(float a, const Key& b) const
+		{
+			return a < (float)b.time;
+		}
+	} sorter;
+
+	if(!forward)
+		return (int)(std::upper_bound(keys, keys + keysCount, time, sorter) - keys);
+
+	// сдвинуть курсор вперёд на несколько ключей
+	int steps;
+	for(steps = 0; steps < maxCursorSteps && cursor < keysCount && (float)keys[cursor].time <= time; ++steps)
+		++cursor;
+	// если не хватило, досчитать бинарным поиском
+	if(steps >= maxCursorSteps)
+		cursor = (int)(std::upper_bound(keys + cursor, keys + keysCount, time, sorter) - keys);
+	return cursor;
+}
+
 /// Класс анимации костей.
-class BoneAnimation : public Object
+/** Ключи с переменным шагом по времени, как в файле .ba. */
+class BoneAnimation : public BoneAnimationClip
 {
-	friend class BoneAnimationFrame;
 public:
 	/// Структура ключа анимации.
 	struct Key
@@ -21,8 +118,6 @@ public:
 	};
 
 private:
-	ptr<Skeleton> skeleton;
-
 	/// Ключи анимации по костям, отсортированные по времени.
 	std::vector<std::vector<Key> > keys;
 
@@ -32,20 +127,95 @@ private:
 public:
 	BoneAnimation(ptr<Skeleton> skeleton, const std::vector<std::vector<Key> >& keys, const std::vector<vec3>& rootBoneOffsets);
 
+	const std::vector<std::vector<Key> >& GetKeys() const;
+	const std::vector<vec3>& GetRootBoneOffsets() const;
+	/// Получить время первого ключа.
+	float GetStartTime() const;
+	/// Получить время последнего ключа.
+	float GetEndTime() const;
+
+	void Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const;
+
 	static ptr<BoneAnimation> Deserialize(ptr<InputStream> inputStream, ptr<Skeleton> skeleton);
 
 	META_DECLARE_CLASS(BoneAnimation);
 };
 
 /// Класс кадра анимации костей.
-/** Позволяет выставлять нужный кадр анимации и получать трансформации. */
+/** Позволяет выставлять нужный кадр анимации и получать трансформации.
+Кадр состоит из слоёв: каждый слой проигрывает свой клип, и слои
+смешиваются в локальном пространстве костей по очереди, с весом слоя
+и весами костей (маской). Мировые трансформации затем считаются один раз.
+Внутри расчёт ведётся в SoA-раскладке по слотам скелета, пачками по 4 кости.
+Для далёких персонажей (см. SetScreenSize и Skeleton::SetLod) анимация
+обновляется не каждый кадр, а в пропущенных кадрах прошлая поза жёстко
+переносится в новое положение; листовые кости могут не анимироваться. */
 class BoneAnimationFrame : public Object
 {
-public:
-	ptr<BoneAnimation> animation;
+private:
+	/// Слой анимации.
+	struct Layer
+	{
+		/// Клип слоя.
+		ptr<BoneAnimationClip> clip;
+		/// Состояние проигрывания клипа.
+		BoneAnimationCursor cursor;
+		/// Текущее время клипа.
+		float time;
+		/// Отрезок зацикливания времени (если loopEnd > loopStart).
+		float loopStart, loopEnd;
+		/// Вес слоя.
+		float weight;
+		/// Веса костей по слотам.
+		std::vector<float> slotWeights;
+
+		Layer();
+	};
+
+	ptr<Skeleton> skeleton;
+	std::vector<Layer> layers;
+
+	//*** Уровень детализации.
+	/// Период обновления анимации в кадрах.
+	int updatePeriod;
+	/// Счётчик кадров для выбора обновляемых кадров.
+	/** Начальные значения у кадров разные, чтобы обновления
+	разных персонажей распределялись по кадрам равномерно. */
+	int updateCounter;
+	/// Не анимировать листовые кости.
+	bool skipLeafBones;
+	/// Рассчитана ли поза.
+	bool poseReady;
+	/// Положение, для которого рассчитана поза.
+	vec3 poseOriginOffset;
+	quat poseOriginOrientation;
+
+	/// Максимальный период обновления анимации.
+	static const int maxUpdatePeriod = 8;
 
+	//*** Промежуточные данные по слотам.
+	/// Относительные ориентации текущего слоя.
+	SoaQuats slotLayerOrientations;
 	/// Анимационные относительные ориентации.
-	std::vector<quat> animationRelativeOrientations;
+	SoaQuats slotRelativeOrientations;
+	/// Анимационные мировые ориентации.
+	SoaQuats slotWorldOrientations;
+	/// Анимационные мировые позиции.
+	SoaVecs slotWorldPositions;
+	/// Результирующие ориентации.
+	SoaQuats slotOrientations;
+	/// Результирующие смещения.
+	SoaVecs slotOffsets;
+
+	Layer& GetLayer(int layer);
+	/// Смешать относительные ориентации слоёв и получить смещение корневой кости.
+	vec3 Blend();
+	/// Вычислить мировые и результирующие трансформации.
+	void Compose(const vec3& originOffset, const quat& originOrientation, const vec3& rootBoneOffset);
+	/// Перенести рассчитанную позу в новое положение без пересчёта анимации.
+	void Repose(const vec3& originOffset, const quat& originOrientation);
+
+public:
 	/// Анимационные мировые ориентации.
 	std::vector<quat> animationWorldOrientations;
 	/// Анимационные мировые позиции.
@@ -58,10 +228,44 @@ public:
 	std::vector<vec3> offsets;
 
 public:
-	BoneAnimationFrame(ptr<BoneAnimation> animation);
+	/// Создать кадр с одним (базовым) слоем.
+	BoneAnimationFrame(ptr<BoneAnimationClip> animation);
+
+	/// Добавить слой, вернуть его номер.
+	/** Слой добавляется поверх существующих с весом 1 и без маски. */
+	int AddLayer(ptr<BoneAnimationClip> clip);
+	int GetLayersCount() const;
+	void SetLayerClip(int layer, ptr<BoneAnimationClip> clip);
+	void SetLayerTime(int layer, float time);
+	float GetLayerTime(int layer) const;
+	/// Зациклить время слоя на отрезке [start, end).
+	void SetLayerLoop(int layer, float start, float end);
+	/// Установить вес слоя.
+	/** Вес базового (нулевого) слоя не учитывается. */
+	void SetLayerWeight(int layer, float weight);
+	/// Установить вес одной кости в слое.
+	void SetLayerBoneWeight(int layer, int bone, float weight);
+	/// Установить вес кости и всех её потомков в слое.
+	void SetLayerBranchWeight(int layer, int bone, float weight);
 
-	/// Установить параметры и рассчитать положение.
+	/// Продвинуть время всех слоёв.
+	void Advance(float deltaTime);
+
+	/// Установить размер персонажа на экране для выбора уровня детализации.
+	/** Размер - отношение радиуса персонажа к половине высоты экрана.
+	Пороги задаются в скелете. */
+	void SetScreenSize(float screenSize);
+	/// Получить период обновления анимации в кадрах.
+	int GetUpdatePeriod() const;
+
+	/// Рассчитать положение по текущим временам слоёв.
+	/** При пониженной частоте обновления в пропускаемых кадрах
+	поза только переносится в новое положение. */
+	void Setup(const vec3& originOffset, const quat& originOrientation);
+	/// Установить время базового слоя и рассчитать положение.
 	void Setup(const vec3& originOffset, const quat& originOrientation, float time);
+
+	META_DECLARE_CLASS(BoneAnimationFrame);
 };
 
 #endif
@@ -0,0 +1,106 @@
+#include "BoneAnimationTexture.hpp"
+#include "BoneAnimation.hpp"
+#include "Skeleton.hpp"
+#include <cmath>
+
+BoneAnimationTexture::BoneAnimationTexture(int bonesCount, int framesCount, float startTime, float frameRate)
+: bonesCount(bonesCount), framesCount(framesCount), startTime(startTime), frameRate(frameRate),
+	texels((framesCount + 1) * bonesCount * 2) {}
+
+int BoneAnimationTexture::GetBonesCount() const
+{
+	return bonesCount;
+}
+
+int BoneAnimationTexture::GetFramesCount() const
+{
+	return framesCount;
+}
+
+float BoneAnimationTexture::GetFrameRate() const
+{
+	return frameRate;
+}
+
+int BoneAnimationTexture::GetWidth() const
+{
+	return bonesCount * 2;
+}
+
+int BoneAnimationTexture::GetHeight() const
+{
+	return framesCount + 1;
+}
+
+float BoneAnimationTexture::GetFrame(float time) const
+{
+	// номер кадра в пределах цикла
+	float frame = (time - startTime) * frameRate;
+	frame -= (float)floor(frame / framesCount) * framesCount;
+	return std::min(std::max(frame, 0.0f), (float)framesCount);
+}
+
+ptr<Texture> BoneAnimationTexture::GetTexture(ptr<Device> device)
+{
+	if(!texture)
+	{
+		// текстура читается точно в центрах текселей, кадры интерполируются в шейдере:
+		// линейная фильтрация float-текстур на ES/WebGL необязательна
+		SamplerSettings samplerSettings;
+		samplerSettings.minFilter = samplerSettings.magFilter = SamplerSettings::filterPoint;
+		samplerSettings.mipFilter = SamplerSettings::filterPoint;
+		samplerSettings.mipMapping = false;
+		samplerSettings.wrapU = samplerSettings.wrapV = samplerSettings.wrapW = SamplerSettings::wrapClamp;
+
+		texture = device->CreateStaticTexture(
+			NEW(RawTextureData(
+				MemoryFile::CreateViaCopy(&texels[0], texels.size() * sizeof(vec4)),
+				PixelFormats::floatRGBA128, GetWidth(), GetHeight(), 0, 1, 0)),
+			samplerSettings);
+	}
+	return texture;
+}
+
+ptr<BoneAnimationTexture> BoneAnimationTexture::Bake(ptr<BoneAnimationClip> clip, float startTime, float endTime, float frameRate)
+{
+	try
+	{
+		if(endTime <= startTime || frameRate <= 0)
+			THROW("Invalid bake range");
+
+		int bonesCount = (int)clip->GetSkeleton()->GetBones().size();
+		int framesCount = std::max(1, (int)floor((endTime - startTime) * frameRate + 0.5f));
+
+		ptr<BoneAnimationTexture> animationTexture = NEW(BoneAnimationTexture(bonesCount, framesCount, startTime, framesCount / (endTime - startTime)));
+
+		// проиграть клип по кадрам в начале координат, включая конец цикла
+		ptr<BoneAnimationFrame> frame = NEW(BoneAnimationFrame(clip));
+		vec4* texels = &animationTexture->texels[0];
+		for(int i = 0; i <= framesCount; ++i)
+		{
+			frame->Setup(vec3(0, 0, 0), quat(0, 0, 0, 1), startTime + i / animationTexture->frameRate);
+
+			vec4* row = texels + i * bonesCount * 2;
+			for(int j = 0; j < bonesCount; ++j)
+			{
+				quat q = frame->orientations[j];
+				// соседние кадры в одной полусфере, чтобы интерполяция шла коротким путём
+				if(i > 0)
+				{
+					const vec4& prev = row[j * 2 - bonesCount * 2];
+					if(q.x * prev.x + q.y * prev.y + q.z * prev.z + q.w * prev.w < 0)
+						q = quat(-q.x, -q.y, -q.z, -q.w);
+				}
+				const vec3& offset = frame->offsets[j];
+				row[j * 2] = vec4(q.x, q.y, q.z, q.w);
+				row[j * 2 + 1] = vec4(offset.x, offset.y, offset.z, 0);
+			}
+		}
+
+		return animationTexture;
+	}
+	catch(Exception* exception)
+	{
+		THROW_SECONDARY("Can't bake bone animation texture", exception);
+	}
+}
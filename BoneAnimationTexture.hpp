@@ -0,0 +1,53 @@
+#ifndef ___FARSH_BONE_ANIMATION_TEXTURE_HPP___
+#define ___FARSH_BONE_ANIMATION_TEXTURE_HPP___
+
+#include "general.hpp"
+
+class BoneAnimationClip;
+
+/// Текстура анимации костей.
+/** Результирующие преобразования костей, запечённые по кадрам в
+float-текстуру, чтобы проигрывать анимацию целиком на GPU.
+Строка текстуры - кадр, в строке по два текселя на кость:
+кватернион ориентации и смещение. Шейдер читает два соседних кадра
+без фильтрации и интерполирует между ними. Последняя строка - конец цикла, чтобы
+последний кадр интерполировался к нему, как на CPU, а не к первому. */
+class BoneAnimationTexture : public Object
+{
+private:
+	/// Количество костей.
+	int bonesCount;
+	/// Количество кадров в цикле (строк в текстуре на одну больше).
+	int framesCount;
+	/// Время первого кадра.
+	float startTime;
+	/// Частота кадров.
+	float frameRate;
+	/// Тексели по кадрам.
+	std::vector<vec4> texels;
+	/// Текстура; создаётся при первом рисовании.
+	ptr<Texture> texture;
+
+	BoneAnimationTexture(int bonesCount, int framesCount, float startTime, float frameRate);
+
+public:
+	int GetBonesCount() const;
+	int GetFramesCount() const;
+	float GetFrameRate() const;
+	/// Получить ширину текстуры в текселях.
+	int GetWidth() const;
+	/// Получить высоту текстуры в текселях.
+	int GetHeight() const;
+	/// Получить номер кадра (с дробной частью) для времени.
+	/** Время зацикливается на запечённом отрезке; результат в [0, framesCount]. */
+	float GetFrame(float time) const;
+
+	/// Получить текстуру, создав её при необходимости.
+	ptr<Texture> GetTexture(ptr<Device> device);
+
+	/// Запечь зацикленный отрезок клипа [startTime, endTime).
+	/** Частота кадров подгоняется, чтобы в отрезок укладывалось целое число кадров. */
+	static ptr<BoneAnimationTexture> Bake(ptr<BoneAnimationClip> clip, float startTime, float endTime, float frameRate);
+};
+
+#endif
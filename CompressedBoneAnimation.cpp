@@ -0,0 +1,342 @@
+#include "CompressedBoneAnimation.hpp"
+#include "Skeleton.hpp"
+#include <cmath>
+#include <limits>
+
+/*
+Упаковка ориентации (48 бит, старший бит не используется):
+	номер наибольшей по модулю компоненты (2 бита)
+	три остальные компоненты по возрастанию номера (по 15 бит)
+Наибольшая компонента делается положительной и восстанавливается из
+нормировки, остальные по модулю не больше 1/sqrt(2).
+*/
+
+static const float componentRange = 0.70710678f;
+static const int componentMax = (1 << 15) - 1;
+/// Модуль скалярного произведения, ниже которого соседние ключи считаются противоположными.
+static const float oppositeThreshold = 0.1f;
+
+/// Угол поворота между двумя ориентациями (радианы).
+static float AngleBetween(const quat& a, const quat& b)
+{
+	Eigen::Quaterniond d = toEigenQuat(a).cast<double>().conjugate() * toEigenQuat(b).cast<double>();
+	return (float)(2 * atan2(d.vec().norm(), fabs(d.w())));
+}
+
+/// Квантовать компоненту смещения в 16 бит.
+static unsigned short QuantizeOffset(float value, float min, float step)
+{
+	if(step <= 0)
+		return 0;
+	return (unsigned short)std::max(0.0f, std::min(65535.0f, (float)floor((value - min) / step + 0.5f)));
+}
+
+CompressedBoneAnimation::CompressedBoneAnimation(ptr<Skeleton> skeleton)
+: BoneAnimationClip(skeleton), startTime(0), timeScale(0), offsetMin(0, 0, 0), offsetStep(0, 0, 0) {}
+
+void CompressedBoneAnimation::PackOrientation(const quat& q, unsigned short packed[3])
+{
+	float c[4] = { q.x, q.y, q.z, q.w };
+	int largest = 0;
+	for(int i = 1; i < 4; ++i)
+		if(fabs(c[i]) > fabs(c[largest]))
+			largest = i;
+	float sign = c[largest] < 0 ? -1.0f : 1.0f;
+
+	unsigned long long bits = largest;
+	for(int i = 0; i < 4; ++i)
+		if(i != largest)
+		{
+			int v = (int)floor((c[i] * sign / componentRange + 1) * 0.5f * componentMax + 0.5f);
+			bits = (bits << 15) | (unsigned long long)std::max(0, std::min(componentMax, v));
+		}
+
+	packed[0] = (unsigned short)(bits >> 32);
+	packed[1] = (unsigned short)(bits >> 16);
+	packed[2] = (unsigned short)bits;
+}
+
+quat CompressedBoneAnimation::UnpackOrientation(const unsigned short packed[3])
+{
+	unsigned long long bits = ((unsigned long long)packed[0] << 32) | ((unsigned long long)packed[1] << 16) | packed[2];
+	int largest = (int)(bits >> 45) & 3;
+
+	float c[4];
+	float sum = 0;
+	for(int i = 3; i >= 0; --i)
+		if(i != largest)
+		{
+			c[i] = ((float)(bits & componentMax) * (2.0f / componentMax) - 1) * componentRange;
+			sum += c[i] * c[i];
+			bits >>= 15;
+		}
+	c[largest] = sqrt(std::max(0.0f, 1 - sum));
+
+	return quat(c[0], c[1], c[2], c[3]);
+}
+
+vec3 CompressedBoneAnimation::UnpackOffset(int rootKey) const
+{
+	const unsigned short* offset = &rootBoneOffsets[rootKey * 3];
+	return vec3(
+		offsetMin.x + offsetStep.x * offset[0],
+		offsetMin.y + offsetStep.y * offset[1],
+		offsetMin.z + offsetStep.z * offset[2]);
+}
+
+int CompressedBoneAnimation::GetKeysCount() const
+{
+	return (int)keys.size();
+}
+
+int CompressedBoneAnimation::GetDataSize() const
+{
+	return (int)(keys.size() * sizeof(Key) + boneKeysOffsets.size() * sizeof(int) + rootBoneOffsets.size() * sizeof(unsigned short));
+}
+
+void CompressedBoneAnimation::Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const
+{
+	const std::vector<int>& boneSlots = skeleton->GetBoneSlots();
+
+	// кости для сэмплирования, в топологическом порядке
+	const std::vector<int>& bones = cursor.skipLeafBones ? skeleton->GetLodBones() : skeleton->GetSortedBones();
+	int bonesCount = (int)bones.size();
+
+	// при движении назад (зацикливание или перемотка) курсоры недействительны
+	// в свежем курсоре ключи ещё не распакованы
+	bool fresh = cursor.time == -std::numeric_limits<float>::infinity();
+	bool forward = time >= cursor.time;
+	cursor.time = time;
+
+	// время в единицах квантования
+	float keyTime = (time - startTime) * timeScale;
+
+	for(int j = 0; j < bonesCount; ++j)
+	{
+		int i = bones[j];
+		const Key* boneKeys = &keys[boneKeysOffsets[i]];
+		int boneKeysCount = boneKeysOffsets[i + 1] - boneKeysOffsets[i];
+
+		// найти следующий за временем ключ
+		int frame = AdvanceCursor(boneKeys, boneKeysCount, cursor.keys[i], forward, keyTime);
+		// пара ключей зависит только от курсора; если он не сдвинулся,
+		// распакованные ключи остались с прошлого кадра
+		bool moved = fresh || frame != cursor.keys[i];
+		cursor.keys[i] = frame;
+
+		int frameA, frameB;
+		float interframeTime;
+		if(frame <= 0)
+		{
+			frameA = frameB = 0;
+			interframeTime = 0;
+		}
+		else if(frame >= boneKeysCount)
+		{
+			frameA = frameB = boneKeysCount - 1;
+			interframeTime = 0;
+		}
+		else
+		{
+			frameA = frame - 1;
+			frameB = frame;
+			int timeRange = boneKeys[frameB].time - boneKeys[frameA].time;
+			interframeTime = timeRange > 0 ? (keyTime - (float)boneKeys[frameA].time) / (float)timeRange : 0;
+		}
+
+		int slot = boneSlots[i];
+		if(moved)
+		{
+			cursor.keysA.Set(slot, UnpackOrientation(boneKeys[frameA].orientation));
+			cursor.keysB.Set(slot, UnpackOrientation(boneKeys[frameB].orientation));
+		}
+		cursor.factors[slot] = interframeTime;
+
+		// для корневой кости
+		if(i == 0)
+			pairs.rootBoneOffset = lerp(UnpackOffset(frameA), UnpackOffset(frameB), interframeTime);
+	}
+
+	pairs.keysA[0] = &cursor.keysA.x[0];
+	pairs.keysA[1] = &cursor.keysA.y[0];
+	pairs.keysA[2] = &cursor.keysA.z[0];
+	pairs.keysA[3] = &cursor.keysA.w[0];
+	pairs.keysB[0] = &cursor.keysB.x[0];
+	pairs.keysB[1] = &cursor.keysB.y[0];
+	pairs.keysB[2] = &cursor.keysB.z[0];
+	pairs.keysB[3] = &cursor.keysB.w[0];
+	pairs.factors = &cursor.factors[0];
+}
+
+ptr<CompressedBoneAnimation> CompressedBoneAnimation::Compress(ptr<BoneAnimation> animation, float maxAngularError, float maxOffsetError)
+{
+	try
+	{
+		const std::vector<std::vector<BoneAnimation::Key> >& sourceKeys = animation->GetKeys();
+		const std::vector<vec3>& allSourceOffsets = animation->GetRootBoneOffsets();
+		int bonesCount = (int)sourceKeys.size();
+
+		float startTime = animation->GetStartTime();
+		float endTime = animation->GetEndTime();
+		if(startTime > endTime)
+			THROW("Animation has no keys");
+		for(int i = 0; i < bonesCount; ++i)
+			if(sourceKeys[i].empty())
+				THROW("Bone has no keys");
+
+		ptr<CompressedBoneAnimation> compressed = NEW(CompressedBoneAnimation(animation->GetSkeleton()));
+		compressed->startTime = startTime;
+		compressed->timeScale = endTime > startTime ? 65535 / (endTime - startTime) : 0;
+
+		// если ключи лежат на сетке кадров, выбрать шаг квантования кратным
+		// половине кадра, чтобы время ключей (и промежуточных тоже) было точным
+		float minTimeStep = std::numeric_limits<float>::infinity();
+		for(int i = 0; i < bonesCount; ++i)
+			for(size_t j = 1; j < sourceKeys[i].size(); ++j)
+			{
+				float timeStep = sourceKeys[i][j].time - sourceKeys[i][j - 1].time;
+				if(timeStep > 1e-4f)
+					minTimeStep = std::min(minTimeStep, timeStep);
+			}
+		if(minTimeStep < std::numeric_limits<float>::infinity())
+		{
+			// частота кадров считается целой
+			float halfFrameRate = (float)floor(1 / minTimeStep + 0.5f) * 2;
+			bool onGrid = true;
+			for(int i = 0; onGrid && i < bonesCount; ++i)
+				for(size_t j = 0; onGrid && j < sourceKeys[i].size(); ++j)
+				{
+					float frame = (sourceKeys[i][j].time - startTime) * halfFrameRate;
+					onGrid = fabs(frame - floor(frame + 0.5f)) < 1e-2f;
+				}
+			float unitsPerHalfFrame = (float)floor(compressed->timeScale / halfFrameRate);
+			if(onGrid && halfFrameRate > 0 && unitsPerHalfFrame >= 1)
+				compressed->timeScale = halfFrameRate * unitsPerHalfFrame;
+		}
+
+		// диапазон смещений корневой кости
+		vec3 offsetMin = allSourceOffsets[0], offsetMax = allSourceOffsets[0];
+		for(size_t i = 1; i < allSourceOffsets.size(); ++i)
+		{
+			const vec3& offset = allSourceOffsets[i];
+			offsetMin = vec3(std::min(offsetMin.x, offset.x), std::min(offsetMin.y, offset.y), std::min(offsetMin.z, offset.z));
+			offsetMax = vec3(std::max(offsetMax.x, offset.x), std::max(offsetMax.y, offset.y), std::max(offsetMax.z, offset.z));
+		}
+		compressed->offsetMin = offsetMin;
+		compressed->offsetStep = (offsetMax - offsetMin) * (1.0f / 65535);
+
+		compressed->boneKeysOffsets.resize(bonesCount + 1);
+		for(int i = 0; i < bonesCount; ++i)
+		{
+			compressed->boneKeysOffsets[i] = (int)compressed->keys.size();
+
+			bool root = i == 0;
+
+			// для почти противоположных соседних ключей направление интерполяции
+			// неоднозначно и может смениться после квантования,
+			// поэтому между ними вставляется промежуточный ключ
+			std::vector<BoneAnimation::Key> boneKeys;
+			std::vector<vec3> sourceOffsets;
+			for(size_t j = 0; j < sourceKeys[i].size(); ++j)
+			{
+				const BoneAnimation::Key& key = sourceKeys[i][j];
+				if(j > 0)
+				{
+					const BoneAnimation::Key& prevKey = sourceKeys[i][j - 1];
+					if(fabs(toEigenQuat(prevKey.orientation).dot(toEigenQuat(key.orientation))) < oppositeThreshold)
+					{
+						BoneAnimation::Key middleKey;
+						middleKey.time = (prevKey.time + key.time) * 0.5f;
+						middleKey.orientation = fromEigen(toEigenQuat(prevKey.orientation).slerp(0.5f, toEigenQuat(key.orientation)));
+						boneKeys.push_back(middleKey);
+						if(root)
+							sourceOffsets.push_back(lerp(allSourceOffsets[j - 1], allSourceOffsets[j], 0.5f));
+					}
+				}
+				boneKeys.push_back(key);
+				if(root)
+					sourceOffsets.push_back(allSourceOffsets[j]);
+			}
+			int boneKeysCount = (int)boneKeys.size();
+
+			// квантовать все ключи и запомнить, во что они восстанавливаются
+			std::vector<Key> quantizedKeys(boneKeysCount);
+			std::vector<quat> orientations(boneKeysCount);
+			std::vector<unsigned short> offsets(root ? boneKeysCount * 3 : 0);
+			std::vector<vec3> restoredOffsets(root ? boneKeysCount : 0);
+			for(int j = 0; j < boneKeysCount; ++j)
+			{
+				Key& key = quantizedKeys[j];
+				key.time = (unsigned short)std::min(65535.0f, (float)floor((boneKeys[j].time - startTime) * compressed->timeScale + 0.5f));
+				PackOrientation(boneKeys[j].orientation, key.orientation);
+				orientations[j] = UnpackOrientation(key.orientation);
+				if(root)
+				{
+					const vec3& offset = sourceOffsets[j];
+					const vec3& step = compressed->offsetStep;
+					offsets[j * 3 + 0] = QuantizeOffset(offset.x, offsetMin.x, step.x);
+					offsets[j * 3 + 1] = QuantizeOffset(offset.y, offsetMin.y, step.y);
+					offsets[j * 3 + 2] = QuantizeOffset(offset.z, offsetMin.z, step.z);
+					restoredOffsets[j] = vec3(
+						offsetMin.x + step.x * offsets[j * 3 + 0],
+						offsetMin.y + step.y * offsets[j * 3 + 1],
+						offsetMin.z + step.z * offsets[j * 3 + 2]);
+				}
+			}
+
+			// жадно прореживать ключи: от последнего оставленного ключа
+			// продвигаться как можно дальше, пока все пропущенные ключи
+			// восстанавливаются интерполяцией с нужной точностью
+			struct Fitter
+			{
+				const std::vector<BoneAnimation::Key>& boneKeys;
+				const std::vector<Key>& quantizedKeys;
+				const std::vector<quat>& orientations;
+				const std::vector<vec3>& sourceOffsets;
+				const std::vector<vec3>& restoredOffsets;
+				bool root;
+				float maxAngularError, maxOffsetError;
+
+				bool Fits(int a, int b) const
+				{
+					int timeRange = quantizedKeys[b].time - quantizedKeys[a].time;
+					for(int k = a + 1; k < b; ++k)
+					{
+						float t = timeRange > 0 ? (float)(quantizedKeys[k].time - quantizedKeys[a].time) / (float)timeRange : 0;
+						Eigen::Quaternionf r = toEigenQuat(orientations[a]).slerp(t, toEigenQuat(orientations[b]));
+						if(AngleBetween(fromEigen(r), boneKeys[k].orientation) > maxAngularError)
+							return false;
+						if(root && length(lerp(restoredOffsets[a], restoredOffsets[b], t) - sourceOffsets[k]) > maxOffsetError)
+							return false;
+					}
+					return true;
+				}
+			} fitter = { boneKeys, quantizedKeys, orientations, sourceOffsets, restoredOffsets, root, maxAngularError, maxOffsetError };
+
+			for(int a = 0; ; )
+			{
+				compressed->keys.push_back(quantizedKeys[a]);
+				if(root)
+					compressed->rootBoneOffsets.insert(compressed->rootBoneOffsets.end(), &offsets[a * 3], &offsets[a * 3] + 3);
+				if(a >= boneKeysCount - 1)
+					break;
+				int b = a + 1;
+				while(b + 1 < boneKeysCount && fitter.Fits(a, b + 1))
+					++b;
+				a = b;
+			}
+		}
+		compressed->boneKeysOffsets[bonesCount] = (int)compressed->keys.size();
+
+		return compressed;
+	}
+	catch(Exception* exception)
+	{
+		THROW_SECONDARY("Can't compress bone animation", exception);
+	}
+}
+
+ptr<CompressedBoneAnimation> CompressedBoneAnimation::Deserialize(ptr<InputStream> inputStream, ptr<Skeleton> skeleton, float maxAngularError, float maxOffsetError)
+{
+	return Compress(BoneAnimation::Deserialize(inputStream, skeleton), maxAngularError, maxOffsetError);
+}
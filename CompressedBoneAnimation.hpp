@@ -0,0 +1,64 @@
+#ifndef ___FARSH_COMPRESSED_BONE_ANIMATION_HPP___
+#define ___FARSH_COMPRESSED_BONE_ANIMATION_HPP___
+
+#include "BoneAnimation.hpp"
+
+/// Сжатая анимация костей.
+/** Ключи прорежены с заданной точностью, время и смещения корневой
+кости квантованы в 16 бит, ориентации - в 48 бит (три наименьшие
+компоненты по 15 бит и номер наибольшей). Ключ занимает 8 байт вместо 20,
+ключи всех костей лежат в одном массиве. */
+class CompressedBoneAnimation : public BoneAnimationClip
+{
+public:
+	/// Сжатый ключ.
+	struct Key
+	{
+		/// Квантованное время.
+		unsigned short time;
+		/// Упакованная ориентация.
+		unsigned short orientation[3];
+	};
+
+private:
+	/// Ключи всех костей подряд.
+	std::vector<Key> keys;
+	/// Начала ключей костей в общем массиве; последний элемент - количество ключей.
+	std::vector<int> boneKeysOffsets;
+	/// Квантованные смещения корневой кости (по 3 на ключ корневой кости).
+	std::vector<unsigned short> rootBoneOffsets;
+
+	/// Время, соответствующее нулю квантованного времени.
+	float startTime;
+	/// Количество единиц квантованного времени в секунде.
+	float timeScale;
+	/// Минимум и шаг квантования смещений корневой кости.
+	vec3 offsetMin, offsetStep;
+
+	CompressedBoneAnimation(ptr<Skeleton> skeleton);
+
+	static void PackOrientation(const quat& q, unsigned short packed[3]);
+	static quat UnpackOrientation(const unsigned short packed[3]);
+	vec3 UnpackOffset(int rootKey) const;
+
+public:
+	/// Получить общее количество ключей.
+	int GetKeysCount() const;
+	/// Получить размер сжатых данных в байтах.
+	int GetDataSize() const;
+
+	void Sample(float time, BoneAnimationCursor& cursor, BoneKeyPairs& pairs) const;
+
+	/// Сжать анимацию.
+	/** Выбрасывает ключи, которые восстанавливаются интерполяцией соседних
+	с ошибкой не больше maxAngularError (радианы) для ориентаций
+	и maxOffsetError для смещений корневой кости. */
+	static ptr<CompressedBoneAnimation> Compress(ptr<BoneAnimation> animation, float maxAngularError, float maxOffsetError);
+
+	/// Загрузить анимацию из .ba-файла и сжать её.
+	static ptr<CompressedBoneAnimation> Deserialize(ptr<InputStream> inputStream, ptr<Skeleton> skeleton, float maxAngularError, float maxOffsetError);
+
+	META_DECLARE_CLASS(CompressedBoneAnimation);
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include "Frustum.hpp"
+
+Frustum::Frustum(const mat4x4& viewProj)
+{
+	// точка видна, если -w <= x, y, z <= w (в пространстве отсечения)
+	for(int i = 0; i < 3; ++i)
+		for(int j = 0; j < 2; ++j)
+		{
+			float sign = j ? -1.0f : 1.0f;
+			vec4& plane = planes[i * 2 + j];
+			plane.x = viewProj(3, 0) + viewProj(i, 0) * sign;
+			plane.y = viewProj(3, 1) + viewProj(i, 1) * sign;
+			plane.z = viewProj(3, 2) + viewProj(i, 2) * sign;
+			plane.w = viewProj(3, 3) + viewProj(i, 3) * sign;
+			float l = sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+			if(l > 0)
+			{
+				plane.x /= l;
+				plane.y /= l;
+				plane.z /= l;
+				plane.w /= l;
+			}
+		}
+}
+
+bool Frustum::Intersects(const vec3& center, float radius) const
+{
+	if(radius < 0)
+		return true;
+	for(int i = 0; i < 6; ++i)
+	{
+		const vec4& plane = planes[i];
+		if(plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w < -radius)
+			return false;
+	}
+	return true;
+}
+
+bool Frustum::Contains(const vec3& center, float radius) const
+{
+	if(radius < 0)
+		return false;
+	for(int i = 0; i < 6; ++i)
+	{
+		const vec4& plane = planes[i];
+		if(plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w < radius)
+			return false;
+	}
+	return true;
+}
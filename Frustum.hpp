@@ -0,0 +1,26 @@
+#ifndef ___FARSH_FRUSTUM_HPP___
+#define ___FARSH_FRUSTUM_HPP___
+
+#include "general.hpp"
+
+/// Пирамида видимости.
+/** Плоскости извлекаются из матрицы вид-проекция. Ближняя плоскость
+берётся для глубины в [-1, 1], так что для глубины в [0, 1]
+проверка получается консервативной. */
+class Frustum
+{
+private:
+	/// Плоскости (нормаль внутрь и расстояние), нормированные.
+	vec4 planes[6];
+
+public:
+	Frustum(const mat4x4& viewProj);
+
+	/// Пересекает ли сфера пирамиду.
+	/** Сфера с отрицательным радиусом (границы неизвестны) видна всегда. */
+	bool Intersects(const vec3& center, float radius) const;
+	/// Лежит ли сфера целиком внутри пирамиды.
+	bool Contains(const vec3& center, float radius) const;
+};
+
+#endif
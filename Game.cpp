@@ -5,6 +5,9 @@
 #include "Material.hpp"
 #include "Skeleton.hpp"
 #include "BoneAnimation.hpp"
+#include "BakedBoneAnimation.hpp"
+#include "CompressedBoneAnimation.hpp"
+#include "BoneAnimationTexture.hpp"
 #include "../inanity/script/lua/State.hpp"
 #ifndef ___INANITY_PLATFORM_EMSCRIPTEN
 #include "../inanity/inanity-sqlitefs.hpp"
@@ -18,57 +21,25 @@ const float Game::hzAFRun2 = 66.0f / 30;
 const float Game::hzAFBattle1 = 400.0f / 30;
 const float Game::hzAFBattle2 = 450.0f / 30;
 
-Game::Game() :
-	heroAnimationTime(hzAFBattle1),
+const float Game::cameraFov = 3.1415926535897932f / 4;
+const float Game::characterRadius = 1.0f;
+
+Game::FrameStats::FrameStats() :
+	input(0), physics(0), animation(0), registration(0), draw(0) {}
+
+Game::Game(bool headless) :
+	headless(headless), fixedFrameTime(0), jobWorkersCount(-1),
+	heroAnimationTime(hzAFBattle1), heroRunLayer(0), heroRunWeight(0),
+	sun(false),
 	bloomLimit(10.0f), toneLuminanceKey(0.12f), toneMaxLuminance(3.1f)
 {
 	singleGame = this;
 }
 
-void Game::Run()
+void Game::Initialize()
 {
 	try
 	{
-		ptr<Graphics::System> system = Inanity::Platform::Game::CreateDefaultGraphicsSystem();
-
-		ptr<Graphics::Adapter> adapter = system->GetAdapters()[0];
-		device = system->CreateDevice(adapter);
-		ptr<Graphics::Monitor> monitor = adapter->GetMonitors()[0];
-
-		int screenWidth = 800;
-		int screenHeight = 600;
-		bool fullscreen = false;
-
-		ptr<Platform::Window> window = monitor->CreateDefaultWindow(
-			"F.A.R.S.H.", screenWidth, screenHeight);
-		this->window = window;
-
-		inputManager = Inanity::Platform::Game::CreateInputManager(window);
-
-		ptr<Graphics::MonitorMode> monitorMode;
-		if(fullscreen)
-			monitorMode = monitor->TryCreateMode(screenWidth, screenHeight);
-		presenter = device->CreateWindowPresenter(window, monitorMode);
-
-		context = system->CreateContext(device);
-
-#ifdef ___INANITY_PLATFORM_EMSCRIPTEN
-		ptr<FileSystem> shaderCacheFileSystem = NEW(Data::TempFileSystem());
-#else
-		const char* shadersCacheFileName =
-#ifdef _DEBUG
-			"shaders_debug"
-#else
-			"shaders"
-#endif
-			;
-		ptr<FileSystem> shaderCacheFileSystem = NEW(Data::SQLiteFileSystem(shadersCacheFileName));
-#endif
-			;
-
-		ptr<ShaderCache> shaderCache = NEW(ShaderCache(shaderCacheFileSystem, device,
-			device->CreateShaderCompiler(), device->CreateShaderGenerator(), NEW(Crypto::WhirlpoolStream())));
-
 		fileSystem =
 #ifdef PRODUCTION
 			NEW(Data::BlobFileSystem(Platform::FileSystem::GetNativeFileSystem()->LoadFile("data")))
@@ -77,27 +48,10 @@ void Game::Run()
 #endif
 		;
 
-		geometryFormats = NEW(GeometryFormats());
-
-		painter = NEW(Painter(device, context, presenter, shaderCache, geometryFormats));
-
-		{
-			SamplerSettings samplerSettings;
-			samplerSettings.SetFilter(SamplerSettings::filterLinear);
-			samplerSettings.SetWrap(SamplerSettings::wrapRepeat);
-			textureManager = NEW(TextureManager(fileSystem, device, samplerSettings));
-		}
+		if(!headless)
+			InitializeGraphics();
 
-		// GUI canvas and fonts
-		canvas = Gui::GrCanvas::Create(device, shaderCache);
-		{
-			ptr<Gui::FontEngine> fontEngine = NEW(Gui::FtEngine());
-			ptr<Gui::FontFace> fontFace = fontEngine->LoadFontFace(fileSystem->LoadFile("/DejaVuSans.ttf"));
-			const int fontSize = 13;
-			ptr<Gui::FontShape> fontShape = fontFace->CreateShape(fontSize);
-			ptr<Gui::FontGlyphs> fontGlyphs = fontFace->CreateGlyphs(canvas, fontSize, Gui::FontFace::CreateGlyphsConfig());
-			font = NEW(Gui::Font(fontShape, fontGlyphs));
-		}
+		jobSystem = NEW(JobSystem(jobWorkersCount));
 
 		physicsWorld = NEW(Physics::BtWorld());
 
@@ -105,6 +59,7 @@ void Game::Run()
 		ptr<Script::Lua::State> luaState = NEW(Script::Lua::State());
 		luaState->Register<Game>();
 		luaState->Register<Material>();
+		luaState->Register<BoneAnimationFrame>();
 		scriptState = luaState;
 
 		ptr<Script::Function> mainScript = scriptState->LoadScript(fileSystem->LoadFile(
@@ -115,6 +70,83 @@ void Game::Run()
 #endif
 		));
 		mainScript->Run();
+	}
+	catch(Exception* exception)
+	{
+		THROW_SECONDARY("Can't initialize game", exception);
+	}
+}
+
+void Game::InitializeGraphics()
+{
+	ptr<Graphics::System> system = Inanity::Platform::Game::CreateDefaultGraphicsSystem();
+
+	ptr<Graphics::Adapter> adapter = system->GetAdapters()[0];
+	device = system->CreateDevice(adapter);
+	ptr<Graphics::Monitor> monitor = adapter->GetMonitors()[0];
+
+	int screenWidth = 800;
+	int screenHeight = 600;
+	bool fullscreen = false;
+
+	ptr<Platform::Window> window = monitor->CreateDefaultWindow(
+		"F.A.R.S.H.", screenWidth, screenHeight);
+	this->window = window;
+
+	inputManager = Inanity::Platform::Game::CreateInputManager(window);
+
+	ptr<Graphics::MonitorMode> monitorMode;
+	if(fullscreen)
+		monitorMode = monitor->TryCreateMode(screenWidth, screenHeight);
+	presenter = device->CreateWindowPresenter(window, monitorMode);
+
+	context = system->CreateContext(device);
+
+#ifdef ___INANITY_PLATFORM_EMSCRIPTEN
+	ptr<FileSystem> shaderCacheFileSystem = NEW(Data::TempFileSystem());
+#else
+	const char* shadersCacheFileName =
+#ifdef _DEBUG
+		"shaders_debug"
+#else
+		"shaders"
+#endif
+		;
+	ptr<FileSystem> shaderCacheFileSystem = NEW(Data::SQLiteFileSystem(shadersCacheFileName));
+#endif
+		;
+
+	ptr<ShaderCache> shaderCache = NEW(ShaderCache(shaderCacheFileSystem, device,
+		device->CreateShaderCompiler(), device->CreateShaderGenerator(), NEW(Crypto::WhirlpoolStream())));
+
+	geometryFormats = NEW(GeometryFormats());
+
+	painter = NEW(Painter(device, context, presenter, shaderCache, geometryFormats));
+
+	{
+		SamplerSettings samplerSettings;
+		samplerSettings.SetFilter(SamplerSettings::filterLinear);
+		samplerSettings.SetWrap(SamplerSettings::wrapRepeat);
+		textureManager = NEW(TextureManager(fileSystem, device, samplerSettings));
+	}
+
+	// GUI canvas and fonts
+	canvas = Gui::GrCanvas::Create(device, shaderCache);
+	{
+		ptr<Gui::FontEngine> fontEngine = NEW(Gui::FtEngine());
+		ptr<Gui::FontFace> fontFace = fontEngine->LoadFontFace(fileSystem->LoadFile("/DejaVuSans.ttf"));
+		const int fontSize = 13;
+		ptr<Gui::FontShape> fontShape = fontFace->CreateShape(fontSize);
+		ptr<Gui::FontGlyphs> fontGlyphs = fontFace->CreateGlyphs(canvas, fontSize, Gui::FontFace::CreateGlyphsConfig());
+		font = NEW(Gui::Font(fontShape, fontGlyphs));
+	}
+}
+
+void Game::Run()
+{
+	try
+	{
+		Initialize();
 
 		window->SetMouseLock(true);
 		window->SetCursorVisible(false);
@@ -133,13 +165,42 @@ void Game::Run()
 	}
 	catch(Exception* exception)
 	{
-		THROW_SECONDARY("Can't initialize game", exception);
+		THROW_SECONDARY("Can't run game", exception);
 	}
 }
 
+vec3 Game::GetCameraMove(const Input::State& inputState) const
+{
+	/*
+	left up right down Q E
+	37 38 39 40
+	65 87 68 83 81 69
+	*/
+	float cameraStep = 5;
+	vec3 cameraMove(0, 0, 0);
+	vec3 cameraMoveDirectionFront(cos(cameraAlpha), sin(cameraAlpha), 0);
+	vec3 cameraMoveDirectionUp(0, 0, 1);
+	vec3 cameraMoveDirectionRight = cross(cameraMoveDirectionFront, cameraMoveDirectionUp);
+	if(inputState.keyboard[37] || inputState.keyboard[65])
+		cameraMove -= cameraMoveDirectionRight * cameraStep;
+	if(inputState.keyboard[38] || inputState.keyboard[87])
+		cameraMove += cameraMoveDirectionFront * cameraStep;
+	if(inputState.keyboard[39] || inputState.keyboard[68])
+		cameraMove += cameraMoveDirectionRight * cameraStep;
+	if(inputState.keyboard[40] || inputState.keyboard[83])
+		cameraMove -= cameraMoveDirectionFront * cameraStep;
+	if(inputState.keyboard[81])
+		cameraMove -= cameraMoveDirectionUp * cameraStep;
+	if(inputState.keyboard[69])
+		cameraMove += cameraMoveDirectionUp * cameraStep;
+
+	return cameraMove;
+}
+
 void Game::Tick()
 {
-	float frameTime = ticker.Tick();
+	float frameTime = fixedFrameTime > 0 ? fixedFrameTime : ticker.Tick();
+	phaseTicker.Tick();
 
 	static bool theTimePaused = false;
 
@@ -147,8 +208,9 @@ void Game::Tick()
 
 	bool shoot = false;
 
-	ptr<Input::Frame> inputFrame = inputManager->GetCurrentFrame();
-	while(inputFrame->NextEvent())
+	// без устройств ввода (headless) событий нет
+	ptr<Input::Frame> inputFrame = inputManager ? inputManager->GetCurrentFrame() : 0;
+	while(inputFrame && inputFrame->NextEvent())
 	{
 		const Input::Event& inputEvent = inputFrame->GetCurrentEvent();
 
@@ -214,25 +276,53 @@ void Game::Tick()
 					break;
 
 				case '7':
-					zombieMaterial->specular.x -= 0.01f;
-					zombieMaterial->specular.y = zombieMaterial->specular.x;
-					zombieMaterial->specular.z = zombieMaterial->specular.x;
+					{
+						vec4 specular = zombieMaterial->specular;
+						specular.x -= 0.01f;
+						specular.y = specular.x;
+						specular.z = specular.x;
+						zombieMaterial->SetSpecular(specular);
+					}
 					printf("specular: %f\n", zombieMaterial->specular.x);
 					break;
 				case '8':
-					zombieMaterial->specular.x += 0.01f;
-					zombieMaterial->specular.y = zombieMaterial->specular.x;
-					zombieMaterial->specular.z = zombieMaterial->specular.x;
+					{
+						vec4 specular = zombieMaterial->specular;
+						specular.x += 0.01f;
+						specular.y = specular.x;
+						specular.z = specular.x;
+						zombieMaterial->SetSpecular(specular);
+					}
 					printf("specular: %f\n", zombieMaterial->specular.x);
 					break;
 				case '9':
-					zombieMaterial->specular.w -= 0.01f;
+					zombieMaterial->SetSpecular(zombieMaterial->specular + vec4(0, 0, 0, -0.01f));
 					printf("glossiness: %f\n", zombieMaterial->specular.w);
 					break;
 				case '0':
-					zombieMaterial->specular.w += 0.01f;
+					zombieMaterial->SetSpecular(zombieMaterial->specular + vec4(0, 0, 0, 0.01f));
 					printf("glossiness: %f\n", zombieMaterial->specular.w);
 					break;
+				case 'F':
+					{
+						static bool fastShadowFilter = false;
+						fastShadowFilter = !fastShadowFilter;
+						if(painter)
+							painter->SetFastShadowFilter(fastShadowFilter);
+						printf("fastShadowFilter: %d\n", (int)fastShadowFilter);
+					}
+					break;
+				case 'B':
+					{
+						static bool pyramidBloom = false;
+						pyramidBloom = !pyramidBloom;
+						if(painter)
+						{
+							painter->SetPyramidBloom(pyramidBloom);
+							printf("pyramidBloom: %d, texture fetches: %d\n", (int)pyramidBloom, painter->GetBloomFetchesCount());
+						}
+					}
+					break;
 				case 'L':
 					{
 						static bool mouseLock = true;
@@ -277,29 +367,9 @@ void Game::Tick()
 	//vec3 cameraRightDirection = normalize(cross(cameraDirection, vec3(0, 0, 1)));
 	//vec3 cameraUpDirection = cross(cameraRightDirection, cameraDirection);
 
-	const Input::State& inputState = inputFrame->GetCurrentState();
-	/*
-	left up right down Q E
-	37 38 39 40
-	65 87 68 83 81 69
-	*/
-	float cameraStep = 5;
-	vec3 cameraMove(0, 0, 0);
-	vec3 cameraMoveDirectionFront(cos(cameraAlpha), sin(cameraAlpha), 0);
-	vec3 cameraMoveDirectionUp(0, 0, 1);
-	vec3 cameraMoveDirectionRight = cross(cameraMoveDirectionFront, cameraMoveDirectionUp);
-	if(inputState.keyboard[37] || inputState.keyboard[65])
-		cameraMove -= cameraMoveDirectionRight * cameraStep;
-	if(inputState.keyboard[38] || inputState.keyboard[87])
-		cameraMove += cameraMoveDirectionFront * cameraStep;
-	if(inputState.keyboard[39] || inputState.keyboard[68])
-		cameraMove += cameraMoveDirectionRight * cameraStep;
-	if(inputState.keyboard[40] || inputState.keyboard[83])
-		cameraMove -= cameraMoveDirectionFront * cameraStep;
-	if(inputState.keyboard[81])
-		cameraMove -= cameraMoveDirectionUp * cameraStep;
-	if(inputState.keyboard[69])
-		cameraMove += cameraMoveDirectionUp * cameraStep;
+	vec3 cameraMove = inputFrame ? GetCameraMove(inputFrame->GetCurrentState()) : vec3(0, 0, 0);
+
+	frameStats.input = phaseTicker.Tick();
 
 	//heroCharacter->Walk(cameraMove);
 
@@ -334,28 +404,98 @@ void Game::Tick()
 
 	alpha += frameTime;
 
+	frameStats.physics = phaseTicker.Tick();
+
+	if(!theTimePaused)
+		heroAnimationTime += frameTime;
+	while(heroAnimationTime >= hzAFBattle2)
+		heroAnimationTime += hzAFBattle1 - hzAFBattle2;
+
+	// TEST: set time to zero
+	//heroAnimationTime = 0;
+
+	// TEST: rotate hero constantly
+#if 1
+	static float heroTime = 0;
+	heroTime += frameTime;
+	heroOrientation = axis_rotation(vec3(0, 0, 1), heroTime);
+#endif
+
+	// герой смешивает бой и бег; бег плавно включается при движении
+	{
+		float heroRunTarget = length(cameraMove * vec3(1, 1, 0)) > 0 ? 1.0f : 0.0f;
+		float heroRunStep = frameTime * 4;
+		if(heroRunWeight < heroRunTarget)
+			heroRunWeight = std::min(heroRunWeight + heroRunStep, heroRunTarget);
+		else
+			heroRunWeight = std::max(heroRunWeight - heroRunStep, heroRunTarget);
+		heroAnimationFrame->SetLayerWeight(heroRunLayer, heroRunWeight);
+		if(!theTimePaused)
+			heroAnimationFrame->Advance(frameTime);
+	}
+
+	zombieAnimationFrame->SetLayerTime(0, heroAnimationTime);
+	circularAnimationFrame->SetLayerTime(0, heroAnimationTime);
+	axeAnimationFrame->SetLayerTime(0, heroAnimationTime);
+
+	// рассчитать кадры анимации параллельно
+	animationJobs.clear();
+	// уровень детализации анимации по размеру на экране
+	float heroScreenSize = GetCharacterScreenSize(heroPosition);
+	heroAnimationFrame->SetScreenSize(heroScreenSize);
+	zombieAnimationFrame->SetScreenSize(heroScreenSize);
+	circularAnimationFrame->SetScreenSize(heroScreenSize);
+	axeAnimationFrame->SetScreenSize(heroScreenSize);
+	animationJobs.push_back(AnimationJob(heroAnimationFrame, heroPosition, heroOrientation));
+	//vec3 shouldBeHeroPosition = heroPosition - (heroAnimationFrame->animationWorldPositions[0] - heroPosition) * vec3(1, 1, 0);
+	//heroAnimationFrame->Setup(shouldBeHeroPosition, heroOrientation);
+	animationJobs.push_back(AnimationJob(zombieAnimationFrame, heroPosition, heroOrientation));
+	animationJobs.push_back(AnimationJob(circularAnimationFrame, heroPosition, heroOrientation));
+	animationJobs.push_back(AnimationJob(axeAnimationFrame, heroPosition, heroOrientation));
+	for(size_t i = 0; i < zombies.size(); ++i)
+	{
+		const Zombie& zombie = zombies[i];
+		mat4x4 zombieTransform = zombie.character->GetTransform();
+		vec3 zombiePosition(zombieTransform(0, 3), zombieTransform(1, 3), zombieTransform(2, 3));
+		if(!theTimePaused)
+			zombie.animationFrame->Advance(frameTime);
+		zombie.animationFrame->SetScreenSize(GetCharacterScreenSize(zombiePosition));
+		animationJobs.push_back(AnimationJob(zombie.animationFrame, zombiePosition, quat(0, 0, 0, 1)));
+	}
+	// задачи ставятся после заполнения массива, чтобы адреса не менялись
+	for(size_t i = 0; i < animationJobs.size(); ++i)
+		jobSystem->Submit(&animationJobs[i]);
+	// главный поток тоже считает; дальше кадры читаются при регистрации и рисовании
+	jobSystem->Wait();
+
+	frameStats.animation = phaseTicker.Tick();
+
+	// без графики рисовать нечего
+	if(!painter)
+	{
+		frameStats.registration = 0;
+		frameStats.draw = 0;
+		return;
+	}
+
 	int screenWidth = presenter->GetWidth();
 	int screenHeight = presenter->GetHeight();
 	painter->Resize(screenWidth, screenHeight);
 
 	mat4x4 viewMatrix = CreateLookAtMatrix(cameraPosition, cameraPosition + cameraDirection, vec3(0, 0, 1));
-	mat4x4 projMatrix = CreateProjectionPerspectiveFovMatrix(3.1415926535897932f / 4, float(screenWidth) / float(screenHeight), 0.1f, 100.0f);
+	mat4x4 projMatrix = CreateProjectionPerspectiveFovMatrix(cameraFov, float(screenWidth) / float(screenHeight), 0.1f, 100.0f);
 
 	// зарегистрировать все объекты
 	painter->BeginFrame(frameTime);
 	painter->SetCamera(projMatrix * viewMatrix, cameraPosition);
 	painter->SetAmbientColor(ambientColor);
-
-	for(size_t i = 0; i < staticModels.size(); ++i)
-	{
-		const StaticModel& model = staticModels[i];
-		painter->AddModel(model.material, model.geometry, model.transform);
-	}
+	if(sun)
+		painter->SetSunLight(sunDirection, sunColor);
 
 	for(size_t i = 0; i < rigidModels.size(); ++i)
 	{
 		const RigidModel& model = rigidModels[i];
-		painter->AddModel(model.material, model.geometry, model.rigidBody->GetTransform());
+		painter->SetPersistentModelTransform(model.painterHandle, model.rigidBody->GetTransform());
 	}
 
 	for(size_t i = 0; i < staticLights.size(); ++i)
@@ -364,30 +504,21 @@ void Game::Tick()
 		if(light->shadow)
 			painter->AddShadowLight(light->position, light->color, light->transform);
 		else
-			painter->AddBasicLight(light->position, light->color);
+			painter->AddBasicLight(light->position, light->color, light->range);
 	}
 
-	if(!theTimePaused)
-		heroAnimationTime += frameTime;
-	while(heroAnimationTime >= hzAFBattle2)
-		heroAnimationTime += hzAFBattle1 - hzAFBattle2;
-
-	// TEST: set time to zero
-	//heroAnimationTime = 0;
-
-	// TEST: rotate hero constantly
-#if 1
-	static float heroTime = 0;
-	heroTime += frameTime;
-	heroOrientation = axis_rotation(vec3(0, 0, 1), heroTime);
-#endif
-
-	heroAnimationFrame->Setup(heroPosition, heroOrientation, heroAnimationTime);
-	//vec3 shouldBeHeroPosition = heroPosition - (heroAnimationFrame->animationWorldPositions[0] - heroPosition) * vec3(1, 1, 0);
-	//heroAnimationFrame->Setup(shouldBeHeroPosition, heroOrientation, heroAnimationTime);
 	painter->AddSkinnedModel(heroMaterial, heroGeometry, heroAnimationFrame);
-	zombieAnimationFrame->Setup(heroPosition, heroOrientation, heroAnimationTime);
 	painter->AddSkinnedModel(zombieMaterial, zombieGeometry, zombieAnimationFrame);
+	for(size_t i = 0; i < zombies.size(); ++i)
+		painter->AddSkinnedModel(zombieMaterial, zombieGeometry, zombies[i].animationFrame);
+	for(size_t i = 0; i < backgroundZombies.size(); ++i)
+	{
+		const BackgroundZombie& zombie = backgroundZombies[i];
+		mat4x4 zombieTransform = zombie.character->GetTransform();
+		painter->AddBakedSkinnedModel(zombieMaterial, zombieGeometry, zombieAnimationTexture,
+			vec3(zombieTransform(0, 3), zombieTransform(1, 3), zombieTransform(2, 3)), quat(0, 0, 0, 1),
+			heroAnimationTime + zombie.timeOffset);
+	}
 	if(0)
 	for(size_t i = 0; i < heroAnimationFrame->animationWorldPositions.size(); ++i)
 		painter->AddModel(
@@ -399,14 +530,12 @@ void Game::Tick()
 				Eigen::Scaling(Eigen::Vector3f(0.1f, 0.1f, 0.1f))
 			).matrix().eval())
 		);
-	circularAnimationFrame->Setup(heroPosition, heroOrientation, heroAnimationTime);
 	painter->AddModel(circularMaterial, circularGeometry,
 		fromEigen((
 			Eigen::Translation3f(toEigen(circularAnimationFrame->animationWorldPositions[0])) *
 			toEigenQuat(circularAnimationFrame->animationWorldOrientations[0])
 		).matrix().eval())
 	);
-	axeAnimationFrame->Setup(heroPosition, heroOrientation, heroAnimationTime);
 	painter->AddModel(axeMaterial, axeGeometry,
 		fromEigen((
 			Eigen::Translation3f(toEigen(axeAnimationFrame->animationWorldPositions[0])) *
@@ -416,8 +545,12 @@ void Game::Tick()
 
 	painter->SetupPostprocess(bloomLimit, toneLuminanceKey, toneMaxLuminance);
 
+	frameStats.registration = phaseTicker.Tick();
+
 	painter->Draw();
 
+	frameStats.draw = phaseTicker.Tick();
+
 	canvas->SetContext(context);
 
 	// fps
@@ -446,6 +579,21 @@ void Game::Tick()
 	presenter->Present();
 }
 
+void Game::SetFixedFrameTime(float fixedFrameTime)
+{
+	this->fixedFrameTime = fixedFrameTime;
+}
+
+void Game::SetJobWorkersCount(int jobWorkersCount)
+{
+	this->jobWorkersCount = jobWorkersCount;
+}
+
+const Game::FrameStats& Game::GetFrameStats() const
+{
+	return frameStats;
+}
+
 ptr<Game> Game::Get()
 {
 	return singleGame;
@@ -453,22 +601,38 @@ ptr<Game> Game::Get()
 
 ptr<Texture> Game::LoadTexture(const String& fileName)
 {
+	if(headless)
+		return 0;
 	return textureManager->Get(fileName);
 }
 
 ptr<Geometry> Game::LoadGeometry(const String& fileName)
 {
+	if(headless)
+		return NEW(Geometry(0, 0));
+	ptr<File> vertices = fileSystem->LoadFile(fileName + ".vertices");
+	vec3 boundCenter;
+	float boundRadius;
+	Geometry::CalculateBoundingSphere(vertices, geometryFormats->vl->GetStride(), boundCenter, boundRadius);
 	return NEW(Geometry(
-		device->CreateStaticVertexBuffer(fileSystem->LoadFile(fileName + ".vertices"), geometryFormats->vl),
-		device->CreateStaticIndexBuffer(fileSystem->LoadFile(fileName + ".indices"), sizeof(short))
+		device->CreateStaticVertexBuffer(vertices, geometryFormats->vl),
+		device->CreateStaticIndexBuffer(fileSystem->LoadFile(fileName + ".indices"), sizeof(short)),
+		boundCenter, boundRadius
 	));
 }
 
 ptr<Geometry> Game::LoadSkinnedGeometry(const String& fileName)
 {
+	if(headless)
+		return NEW(Geometry(0, 0));
+	ptr<File> vertices = fileSystem->LoadFile(fileName + ".vertices");
+	vec3 boundCenter;
+	float boundRadius;
+	Geometry::CalculateBoundingSphere(vertices, geometryFormats->vlSkinned->GetStride(), boundCenter, boundRadius);
 	return NEW(Geometry(
-		device->CreateStaticVertexBuffer(fileSystem->LoadFile(fileName + ".vertices"), geometryFormats->vlSkinned),
-		device->CreateStaticIndexBuffer(fileSystem->LoadFile(fileName + ".indices"), sizeof(short))
+		device->CreateStaticVertexBuffer(vertices, geometryFormats->vlSkinned),
+		device->CreateStaticIndexBuffer(fileSystem->LoadFile(fileName + ".indices"), sizeof(short)),
+		boundCenter, boundRadius
 	));
 }
 
@@ -490,6 +654,16 @@ ptr<BoneAnimation> Game::LoadBoneAnimation(const String& fileName, ptr<Skeleton>
 	return BoneAnimation::Deserialize(fileSystem->LoadStream(fileName), skeleton);
 }
 
+ptr<BakedBoneAnimation> Game::LoadBakedBoneAnimation(const String& fileName, ptr<Skeleton> skeleton, float frameRate, float maxAngularError)
+{
+	return BakedBoneAnimation::Bake(LoadBoneAnimation(fileName, skeleton), frameRate, maxAngularError);
+}
+
+ptr<CompressedBoneAnimation> Game::LoadCompressedBoneAnimation(const String& fileName, ptr<Skeleton> skeleton, float maxAngularError, float maxOffsetError)
+{
+	return CompressedBoneAnimation::Compress(LoadBoneAnimation(fileName, skeleton), maxAngularError, maxOffsetError);
+}
+
 ptr<Physics::Shape> Game::CreatePhysicsBoxShape(const vec3& halfSize)
 {
 	return physicsWorld->CreateBoxShape(halfSize);
@@ -511,6 +685,10 @@ void Game::AddStaticModel(ptr<Geometry> geometry, ptr<Material> material, const
 	transform.translate(toEigen(position));
 	model.transform = fromEigen(transform.matrix());
 	staticModels.push_back(model);
+
+	// статические модели регистрируются в рисовальщике один раз
+	if(painter)
+		painter->AddPersistentModel(material, geometry, model.transform, false);
 }
 
 void Game::AddRigidModel(ptr<Geometry> geometry, ptr<Material> material, ptr<Physics::RigidBody> physicsRigidBody)
@@ -519,6 +697,7 @@ void Game::AddRigidModel(ptr<Geometry> geometry, ptr<Material> material, ptr<Phy
 	model.geometry = geometry;
 	model.material = material;
 	model.rigidBody = physicsRigidBody;
+	model.painterHandle = painter ? painter->AddPersistentModel(material, geometry, physicsRigidBody->GetTransform(), true) : -1;
 	rigidModels.push_back(model);
 }
 
@@ -544,7 +723,38 @@ void Game::SetAmbient(float r, float g, float b)
 	this->ambientColor = vec3(r, g, b);
 }
 
-void Game::SetZombieParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimation> animation)
+void Game::SetSun(const vec3& direction, const vec3& color)
+{
+	sun = true;
+	sunDirection = direction;
+	sunColor = color;
+}
+
+void Game::SetDepthPrepass(bool depthPrepass)
+{
+	if(painter)
+		painter->SetDepthPrepass(depthPrepass);
+}
+
+void Game::SetClusteredLighting(bool clusteredLighting)
+{
+	if(painter)
+		painter->SetClusteredLighting(clusteredLighting);
+}
+
+void Game::SetDeferredShading(bool deferredShading)
+{
+	if(painter)
+		painter->SetDeferredShading(deferredShading);
+}
+
+void Game::SetPyramidBloom(bool pyramidBloom)
+{
+	if(painter)
+		painter->SetPyramidBloom(pyramidBloom);
+}
+
+void Game::SetZombieParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimationClip> animation)
 {
 	this->zombieMaterial = material;
 	this->zombieGeometry = geometry;
@@ -552,7 +762,7 @@ void Game::SetZombieParams(ptr<Material> material, ptr<Geometry> geometry, ptr<S
 	this->zombieAnimation = animation;
 }
 
-void Game::SetHeroParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimation> animation)
+void Game::SetHeroParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimationClip> animation)
 {
 	this->heroMaterial = material;
 	this->heroGeometry = geometry;
@@ -560,14 +770,14 @@ void Game::SetHeroParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Ske
 	this->heroAnimation = animation;
 }
 
-void Game::SetAxeParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimation> animation)
+void Game::SetAxeParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationClip> animation)
 {
 	this->axeMaterial = material;
 	this->axeGeometry = geometry;
 	this->axeAnimation = animation;
 }
 
-void Game::SetCircularParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimation> animation)
+void Game::SetCircularParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationClip> animation)
 {
 	this->circularMaterial = material;
 	this->circularGeometry = geometry;
@@ -581,11 +791,61 @@ void Game::PlaceHero(float x, float y, float z)
 	mat4x4 initialTransform = fromEigen(startTransform.matrix());
 	heroCharacter = physicsWorld->CreateCharacter(physicsWorld->CreateCapsuleShape(0.2f, 1.4f), initialTransform);
 	heroAnimationFrame = NEW(BoneAnimationFrame(heroAnimation));
+	heroAnimationFrame->SetLayerLoop(0, hzAFBattle1, hzAFBattle2);
+	heroAnimationFrame->SetLayerTime(0, hzAFBattle1);
+	heroRunLayer = heroAnimationFrame->AddLayer(heroAnimation);
+	heroAnimationFrame->SetLayerLoop(heroRunLayer, hzAFRun1, hzAFRun2);
+	heroAnimationFrame->SetLayerTime(heroRunLayer, hzAFRun1);
+	heroAnimationFrame->SetLayerWeight(heroRunLayer, heroRunWeight);
 	circularAnimationFrame = NEW(BoneAnimationFrame(circularAnimation));
 	zombieAnimationFrame = NEW(BoneAnimationFrame(zombieAnimation));
 	axeAnimationFrame = NEW(BoneAnimationFrame(axeAnimation));
 }
 
+void Game::PlaceZombie(float x, float y, float z)
+{
+	Eigen::Affine3f startTransform = Eigen::Affine3f::Identity();
+	startTransform.translate(Eigen::Vector3f(x, y, z));
+	mat4x4 initialTransform = fromEigen(startTransform.matrix());
+	Zombie zombie;
+	zombie.character = physicsWorld->CreateCharacter(physicsWorld->CreateCapsuleShape(0.2f, 1.4f), initialTransform);
+	zombie.animationFrame = NEW(BoneAnimationFrame(zombieAnimation));
+	// у каждого зомби своя фаза анимации
+	zombie.animationFrame->SetLayerLoop(0, hzAFBattle1, hzAFBattle2);
+	zombie.animationFrame->SetLayerTime(0, hzAFBattle1 + (hzAFBattle2 - hzAFBattle1) * (float)(zombies.size() % 7) / 7);
+	zombies.push_back(zombie);
+}
+
+void Game::PlaceBackgroundZombie(float x, float y, float z)
+{
+	// цикл анимации запекается один раз для всех фоновых зомби;
+	// между кадрами GPU интерполирует итоговые преобразования линейно,
+	// поэтому частота вдвое выше частоты ключей
+	if(!zombieAnimationTexture)
+		zombieAnimationTexture = BoneAnimationTexture::Bake(zombieAnimation, hzAFBattle1, hzAFBattle2, 60);
+
+	Eigen::Affine3f startTransform = Eigen::Affine3f::Identity();
+	startTransform.translate(Eigen::Vector3f(x, y, z));
+	mat4x4 initialTransform = fromEigen(startTransform.matrix());
+	BackgroundZombie zombie;
+	zombie.character = physicsWorld->CreateCharacter(physicsWorld->CreateCapsuleShape(0.2f, 1.4f), initialTransform);
+	zombie.timeOffset = (hzAFBattle2 - hzAFBattle1) * (float)(backgroundZombies.size() % 7) / 7;
+	backgroundZombies.push_back(zombie);
+}
+
+ptr<BoneAnimationFrame> Game::GetHeroAnimationFrame() const
+{
+	return heroAnimationFrame;
+}
+
+float Game::GetCharacterScreenSize(const vec3& position) const
+{
+	// отношение радиуса к половине высоты экрана на этом расстоянии
+	float distance = length(position - cameraPosition);
+	float halfHeight = distance * tan(cameraFov / 2);
+	return halfHeight > characterRadius ? characterRadius / halfHeight : 1.0f;
+}
+
 void Game::PlaceCamera(const vec3& position, float alpha, float beta)
 {
 	this->cameraPosition = position;
@@ -593,10 +853,20 @@ void Game::PlaceCamera(const vec3& position, float alpha, float beta)
 	this->cameraBeta = beta;
 }
 
+//******* Game::AnimationJob
+
+Game::AnimationJob::AnimationJob(ptr<BoneAnimationFrame> frame, const vec3& originOffset, const quat& originOrientation)
+: frame(frame), originOffset(originOffset), originOrientation(originOrientation) {}
+
+void Game::AnimationJob::Execute()
+{
+	frame->Setup(originOffset, originOrientation);
+}
+
 //******* Game::StaticLight
 
 StaticLight::StaticLight() :
-	position(-1, 0, 0), target(0, 0, 0), angle(3.1415926535897932f / 4), nearPlane(0.1f), farPlane(100.0f), color(1, 1, 1), shadow(false)
+	position(-1, 0, 0), target(0, 0, 0), angle(3.1415926535897932f / 4), nearPlane(0.1f), farPlane(100.0f), color(1, 1, 1), shadow(false), range(-1)
 {
 	UpdateTransform();
 }
@@ -637,3 +907,8 @@ void StaticLight::SetShadow(bool shadow)
 {
 	this->shadow = shadow;
 }
+
+void StaticLight::SetRange(float range)
+{
+	this->range = range;
+}
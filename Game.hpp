@@ -2,13 +2,18 @@
 #define ___FARSH_GAME_HPP___
 
 #include "general.hpp"
+#include "JobSystem.hpp"
 
 class Geometry;
 class GeometryFormats;
 struct Material;
 class Skeleton;
+class BoneAnimationClip;
 class BoneAnimation;
+class BakedBoneAnimation;
+class CompressedBoneAnimation;
 class BoneAnimationFrame;
+class BoneAnimationTexture;
 class Painter;
 
 struct StaticLight : public Object
@@ -19,6 +24,8 @@ struct StaticLight : public Object
 	float nearPlane, farPlane;
 	vec3 color;
 	bool shadow;
+	/// Радиус действия (для кластерного освещения); отрицательный - неограниченный.
+	float range;
 	mat4x4 transform;
 
 	StaticLight();
@@ -31,6 +38,7 @@ struct StaticLight : public Object
 	void SetProjection(float angle, float nearPlane, float farPlane);
 	void SetColor(const vec3& color);
 	void SetShadow(bool shadow);
+	void SetRange(float range);
 
 	META_DECLARE_CLASS(StaticLight);
 };
@@ -38,7 +46,55 @@ struct StaticLight : public Object
 /// Класс игры.
 class Game : public Object
 {
+public:
+	/// Времена фаз кадра, в секундах.
+	struct FrameStats
+	{
+		/// Обработка ввода.
+		float input;
+		/// Симуляция физики.
+		float physics;
+		/// Расчёт кадров анимации.
+		float animation;
+		/// Регистрация объектов в Painter.
+		float registration;
+		/// Рисование.
+		float draw;
+
+		FrameStats();
+	};
+
 private:
+	/// Работать без окна и графики.
+	/** Используется бенчмарком: считаются только физика и анимация. */
+	bool headless;
+	/// Фиксированный шаг времени, или 0, если время реальное.
+	float fixedFrameTime;
+	/// Таймер для замера фаз кадра.
+	Ticker phaseTicker;
+	/// Времена фаз последнего кадра.
+	FrameStats frameStats;
+
+	/// Количество рабочих потоков (отрицательное - по числу ядер).
+	int jobWorkersCount;
+	/// Планировщик задач.
+	ptr<JobSystem> jobSystem;
+	/// Задача расчёта кадра анимации.
+	/** Промежуточные данные у каждого кадра свои, поэтому кадры
+	можно считать параллельно. */
+	struct AnimationJob : public JobSystem::Job
+	{
+		ptr<BoneAnimationFrame> frame;
+		vec3 originOffset;
+		quat originOrientation;
+
+		AnimationJob(ptr<BoneAnimationFrame> frame, const vec3& originOffset, const quat& originOrientation);
+
+		void Execute();
+	};
+	/// Задачи анимации текущего кадра.
+	std::vector<AnimationJob> animationJobs;
+
 	ptr<Platform::Window> window;
 	ptr<Device> device;
 	ptr<Context> context;
@@ -59,28 +115,50 @@ private:
 	vec3 cameraPosition;
 	float alpha;
 
+	/// Вертикальный угол обзора камеры.
+	static const float cameraFov;
+	/// Радиус персонажа для оценки размера на экране.
+	static const float characterRadius;
+	/// Оценить размер персонажа на экране (для уровня детализации анимации).
+	float GetCharacterScreenSize(const vec3& position) const;
+
 	ptr<Material> decalMaterial;
 
 	ptr<Material> zombieMaterial;
 	ptr<Geometry> zombieGeometry;
 	ptr<Skeleton> zombieSkeleton;
-	ptr<BoneAnimation> zombieAnimation;
+	ptr<BoneAnimationClip> zombieAnimation;
 	struct Zombie
 	{
 		ptr<Physics::Character> character;
 		ptr<BoneAnimationFrame> animationFrame;
 	};
 	std::vector<Zombie> zombies;
+	/// Фоновый зомби.
+	/** Анимируется на GPU по текстуре анимации, без расчёта кадра на CPU. */
+	struct BackgroundZombie
+	{
+		ptr<Physics::Character> character;
+		/// Сдвиг фазы анимации.
+		float timeOffset;
+	};
+	std::vector<BackgroundZombie> backgroundZombies;
+	/// Запечённый цикл анимации зомби для фоновых зомби.
+	ptr<BoneAnimationTexture> zombieAnimationTexture;
 
 	ptr<Material> heroMaterial;
 	ptr<Geometry> heroGeometry;
 	ptr<Skeleton> heroSkeleton;
-	ptr<BoneAnimation> heroAnimation;
+	ptr<BoneAnimationClip> heroAnimation;
 	// экземпляр героя
 	ptr<Physics::Character> heroCharacter;
 	ptr<BoneAnimationFrame> heroAnimationFrame;
 	ptr<BoneAnimationFrame> circularAnimationFrame;
 	float heroAnimationTime;
+	/// Слой бега в анимации героя (поверх базового слоя боя).
+	int heroRunLayer;
+	/// Текущий вес слоя бега.
+	float heroRunWeight;
 	// тестовый экземпляр зомби
 	ptr<BoneAnimationFrame> zombieAnimationFrame;
 	ptr<BoneAnimationFrame> axeAnimationFrame;
@@ -89,11 +167,11 @@ private:
 
 	ptr<Material> axeMaterial;
 	ptr<Geometry> axeGeometry;
-	ptr<BoneAnimation> axeAnimation;
+	ptr<BoneAnimationClip> axeAnimation;
 
 	ptr<Material> circularMaterial;
 	ptr<Geometry> circularGeometry;
-	ptr<BoneAnimation> circularAnimation;
+	ptr<BoneAnimationClip> circularAnimation;
 
 	struct StaticModel
 	{
@@ -108,6 +186,8 @@ private:
 		ptr<Geometry> geometry;
 		ptr<Material> material;
 		ptr<Physics::RigidBody> rigidBody;
+		/// Хендл постоянной модели в рисовальщике.
+		int painterHandle;
 	};
 	std::vector<RigidModel> rigidModels;
 
@@ -130,20 +210,36 @@ private:
 	std::vector<Cube> cubes;
 
 	vec3 ambientColor;
+	/// Направленный источник света (солнце).
+	bool sun;
+	vec3 sunDirection, sunColor;
 
 	float bloomLimit, toneLuminanceKey, toneMaxLuminance;
 
 	/// Скрипт.
 	ptr<Script::State> scriptState;
+	/// Создать окно, устройство и всё для рисования.
+	void InitializeGraphics();
+	/// Получить скорость камеры по нажатым клавишам.
+	vec3 GetCameraMove(const Input::State& inputState) const;
 	/// Единственный экземпляр для игры.
 	static Game* singleGame;
 
 public:
-	Game();
+	Game(bool headless = false);
 
+	/// Создать окно и ресурсы, выполнить стартовый скрипт.
+	void Initialize();
 	void Run();
 	void Tick();
 
+	/// Установить фиксированный шаг времени (0 - реальное время).
+	void SetFixedFrameTime(float fixedFrameTime);
+	/// Получить времена фаз последнего кадра.
+	const FrameStats& GetFrameStats() const;
+	/// Установить количество рабочих потоков (до Initialize).
+	void SetJobWorkersCount(int jobWorkersCount);
+
 	//******* Методы, доступные из скрипта.
 
 	static ptr<Game> Get();
@@ -153,6 +249,8 @@ public:
 	ptr<Geometry> LoadSkinnedGeometry(const String& fileName);
 	ptr<Skeleton> LoadSkeleton(const String& fileName);
 	ptr<BoneAnimation> LoadBoneAnimation(const String& fileName, ptr<Skeleton> skeleton);
+	ptr<BakedBoneAnimation> LoadBakedBoneAnimation(const String& fileName, ptr<Skeleton> skeleton, float frameRate, float maxAngularError);
+	ptr<CompressedBoneAnimation> LoadCompressedBoneAnimation(const String& fileName, ptr<Skeleton> skeleton, float maxAngularError, float maxOffsetError);
 	ptr<Physics::Shape> CreatePhysicsBoxShape(const vec3& halfSize);
 	ptr<Physics::RigidBody> CreatePhysicsRigidBody(ptr<Physics::Shape> physicsShape, float mass, const vec3& position);
 	void AddStaticModel(ptr<Geometry> geometry, ptr<Material> material, const vec3& position);
@@ -162,12 +260,30 @@ public:
 	void SetDecalMaterial(ptr<Material> decalMaterial);
 
 	void SetAmbient(float r, float g, float b);
-	void SetZombieParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimation> animation);
-	void SetHeroParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimation> animation);
-	void SetAxeParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimation> animation);
-	void SetCircularParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimation> animation);
+	/// Установить направленный источник света с каскадными тенями.
+	/** direction - направление распространения света. */
+	void SetSun(const vec3& direction, const vec3& color);
+	/// Включить или выключить предварительный проход глубины.
+	void SetDepthPrepass(bool depthPrepass);
+	/// Включить или выключить кластерное освещение.
+	void SetClusteredLighting(bool clusteredLighting);
+	/// Включить или выключить отложенное освещение.
+	void SetDeferredShading(bool deferredShading);
+	/// Включить или выключить bloom пирамидой.
+	void SetPyramidBloom(bool pyramidBloom);
+	void SetZombieParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimationClip> animation);
+	void SetHeroParams(ptr<Material> material, ptr<Geometry> geometry, ptr<Skeleton> skeleton, ptr<BoneAnimationClip> animation);
+	void SetAxeParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationClip> animation);
+	void SetCircularParams(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationClip> animation);
 
 	void PlaceHero(float x, float y, float z);
+	/// Поставить зомби из толпы.
+	/** Зомби толпы рисуются инстансингом. */
+	void PlaceZombie(float x, float y, float z);
+	/// Поставить фонового зомби.
+	/** Фоновые зомби только проигрывают цикл анимации, целиком на GPU. */
+	void PlaceBackgroundZombie(float x, float y, float z);
+	ptr<BoneAnimationFrame> GetHeroAnimationFrame() const;
 	void PlaceCamera(const vec3& position, float alpha, float beta);
 
 	META_DECLARE_CLASS(Game);
@@ -1,7 +1,12 @@
 #include "Geometry.hpp"
 
+static int nextGeometryId = 0;
+
 Geometry::Geometry(ptr<VertexBuffer> vertexBuffer, ptr<IndexBuffer> indexBuffer)
-: vertexBuffer(vertexBuffer), indexBuffer(indexBuffer) {}
+: vertexBuffer(vertexBuffer), indexBuffer(indexBuffer), boundCenter(0, 0, 0), boundRadius(-1), id(nextGeometryId++) {}
+
+Geometry::Geometry(ptr<VertexBuffer> vertexBuffer, ptr<IndexBuffer> indexBuffer, const vec3& boundCenter, float boundRadius)
+: vertexBuffer(vertexBuffer), indexBuffer(indexBuffer), boundCenter(boundCenter), boundRadius(boundRadius), id(nextGeometryId++) {}
 
 ptr<VertexBuffer> Geometry::GetVertexBuffer() const
 {
@@ -12,3 +17,46 @@ ptr<IndexBuffer> Geometry::GetIndexBuffer() const
 {
 	return indexBuffer;
 }
+
+const vec3& Geometry::GetBoundCenter() const
+{
+	return boundCenter;
+}
+
+float Geometry::GetBoundRadius() const
+{
+	return boundRadius;
+}
+
+int Geometry::GetId() const
+{
+	return id;
+}
+
+void Geometry::CalculateBoundingSphere(ptr<File> vertices, int vertexStride, vec3& center, float& radius)
+{
+	const char* data = (const char*)vertices->GetData();
+	int verticesCount = (int)(vertices->GetSize() / vertexStride);
+	if(!verticesCount)
+	{
+		center = vec3(0, 0, 0);
+		radius = -1;
+		return;
+	}
+
+	// центр - центр ограничивающего параллелепипеда
+	vec3 minPosition = *(const vec3*)data;
+	vec3 maxPosition = minPosition;
+	for(int i = 1; i < verticesCount; ++i)
+	{
+		const vec3& position = *(const vec3*)(data + i * vertexStride);
+		minPosition = vec3(std::min(minPosition.x, position.x), std::min(minPosition.y, position.y), std::min(minPosition.z, position.z));
+		maxPosition = vec3(std::max(maxPosition.x, position.x), std::max(maxPosition.y, position.y), std::max(maxPosition.z, position.z));
+	}
+	center = (minPosition + maxPosition) * 0.5f;
+
+	// радиус - до самой дальней вершины
+	radius = 0;
+	for(int i = 0; i < verticesCount; ++i)
+		radius = std::max(radius, length(*(const vec3*)(data + i * vertexStride) - center));
+}
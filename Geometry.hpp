@@ -8,12 +8,26 @@ class Geometry : public Object
 private:
 	ptr<VertexBuffer> vertexBuffer;
 	ptr<IndexBuffer> indexBuffer;
+	/// Ограничивающая сфера в пространстве модели.
+	/** Отрицательный радиус - границы неизвестны. */
+	vec3 boundCenter;
+	float boundRadius;
+	/// Номер геометрии в порядке создания.
+	int id;
 
 public:
 	Geometry(ptr<VertexBuffer> vertexBuffer, ptr<IndexBuffer> indexBuffer);
+	Geometry(ptr<VertexBuffer> vertexBuffer, ptr<IndexBuffer> indexBuffer, const vec3& boundCenter, float boundRadius);
 
 	ptr<VertexBuffer> GetVertexBuffer() const;
 	ptr<IndexBuffer> GetIndexBuffer() const;
+	const vec3& GetBoundCenter() const;
+	float GetBoundRadius() const;
+	int GetId() const;
+
+	/// Вычислить ограничивающую сферу по вершинам.
+	/** Положение вершины - первые три float'а. */
+	static void CalculateBoundingSphere(ptr<File> vertices, int vertexStride, vec3& center, float& radius);
 
 	META_DECLARE_CLASS(Geometry);
 };
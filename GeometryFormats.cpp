@@ -3,11 +3,25 @@
 GeometryFormats::GeometryFormats() :
 
 	vl(NEW(VertexLayout(32))),
+	vlePosition(vl->AddElement(DataTypes::_vec3, 0)),
+	vleNormal(vl->AddElement(DataTypes::_vec3, 12)),
+	vleTexcoord(vl->AddElement(DataTypes::_vec2, 24)),
 	al(NEW(AttributeLayout())),
 	als(al->AddSlot()),
-	alePosition(al->AddElement(als, vl->AddElement(DataTypes::_vec3, 0))),
-	aleNormal(al->AddElement(als, vl->AddElement(DataTypes::_vec3, 12))),
-	aleTexcoord(al->AddElement(als, vl->AddElement(DataTypes::_vec2, 24))),
+	alePosition(al->AddElement(als, vlePosition)),
+	aleNormal(al->AddElement(als, vleNormal)),
+	aleTexcoord(al->AddElement(als, vleTexcoord)),
+
+	alInstanced(NEW(AttributeLayout())),
+	alsInstanced(alInstanced->AddSlot()),
+	aleInstancedPosition(alInstanced->AddElement(alsInstanced, vlePosition)),
+	aleInstancedNormal(alInstanced->AddElement(alsInstanced, vleNormal)),
+	aleInstancedTexcoord(alInstanced->AddElement(alsInstanced, vleTexcoord)),
+	vlInstance(NEW(VertexLayout(48))),
+	alsInstance(alInstanced->AddSlot(1)),
+	aleInstanceWorld0(alInstanced->AddElement(alsInstance, vlInstance->AddElement(DataTypes::_vec4, 0))),
+	aleInstanceWorld1(alInstanced->AddElement(alsInstance, vlInstance->AddElement(DataTypes::_vec4, 16))),
+	aleInstanceWorld2(alInstanced->AddElement(alsInstance, vlInstance->AddElement(DataTypes::_vec4, 32))),
 
 	vlSkinned(NEW(VertexLayout(52))),
 	alSkinned(NEW(AttributeLayout())),
@@ -8,11 +8,26 @@ class GeometryFormats : public Object
 public:
 	//*** Обычные модели.
 	ptr<VertexLayout> vl;
+	ptr<VertexLayoutElement> vlePosition;
+	ptr<VertexLayoutElement> vleNormal;
+	ptr<VertexLayoutElement> vleTexcoord;
 	ptr<AttributeLayout> al;
 	ptr<AttributeLayoutSlot> als;
 	ptr<AttributeLayoutElement> alePosition;
 	ptr<AttributeLayoutElement> aleNormal;
 	ptr<AttributeLayoutElement> aleTexcoord;
+	//*** Обычные модели с трансформациями экземпляров в вершинном буфере.
+	ptr<AttributeLayout> alInstanced;
+	ptr<AttributeLayoutSlot> alsInstanced;
+	ptr<AttributeLayoutElement> aleInstancedPosition;
+	ptr<AttributeLayoutElement> aleInstancedNormal;
+	ptr<AttributeLayoutElement> aleInstancedTexcoord;
+	/// Экземпляр - три строки матрицы мира 3x4.
+	ptr<VertexLayout> vlInstance;
+	ptr<AttributeLayoutSlot> alsInstance;
+	ptr<AttributeLayoutElement> aleInstanceWorld0;
+	ptr<AttributeLayoutElement> aleInstanceWorld1;
+	ptr<AttributeLayoutElement> aleInstanceWorld2;
 	//*** Skinned-модели.
 	ptr<VertexLayout> vlSkinned;
 	ptr<AttributeLayout> alSkinned;
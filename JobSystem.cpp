@@ -0,0 +1,166 @@
+#include "JobSystem.hpp"
+
+#ifdef ___FARSH_JOB_THREADS
+
+JobSystem::JobSystem(int workersCount)
+: stopping(false), queuedJobsCount(0), pendingJobsCount(0), nextQueue(0)
+{
+	if(workersCount < 0)
+		workersCount = std::max((int)std::thread::hardware_concurrency() - 1, 0);
+
+	queues.resize(workersCount + 1);
+	for(size_t i = 0; i < queues.size(); ++i)
+		queues[i] = new Queue();
+
+	threads.reserve(workersCount);
+	for(int i = 0; i < workersCount; ++i)
+		threads.push_back(std::thread(&JobSystem::WorkerThread, this, i + 1));
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(wakeMutex);
+		stopping = true;
+	}
+	wakeCondition.notify_all();
+	for(size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+	for(size_t i = 0; i < queues.size(); ++i)
+		delete queues[i];
+}
+
+int JobSystem::GetWorkersCount() const
+{
+	return (int)threads.size();
+}
+
+JobSystem::Job* JobSystem::Take(int queue)
+{
+	int queuesCount = (int)queues.size();
+	// своя очередь - с конца, чужие - с начала
+	for(int i = 0; i < queuesCount; ++i)
+	{
+		Queue& q = *queues[(queue + i) % queuesCount];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if(q.jobs.empty())
+			continue;
+		Job* job;
+		if(i == 0)
+		{
+			job = q.jobs.back();
+			q.jobs.pop_back();
+		}
+		else
+		{
+			job = q.jobs.front();
+			q.jobs.pop_front();
+		}
+		--queuedJobsCount;
+		return job;
+	}
+	return 0;
+}
+
+void JobSystem::Execute(Job* job)
+{
+	try
+	{
+		job->Execute();
+	}
+	catch(Exception* exception)
+	{
+		std::lock_guard<std::mutex> lock(errorMutex);
+		if(!error)
+			error = exception;
+		else
+			MakePointer(exception);
+	}
+	--pendingJobsCount;
+}
+
+void JobSystem::WorkerThread(int queue)
+{
+	for(;;)
+	{
+		Job* job = Take(queue);
+		if(job)
+		{
+			Execute(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(wakeMutex);
+		while(!stopping && queuedJobsCount.load() == 0)
+			wakeCondition.wait(lock);
+		if(stopping)
+			return;
+	}
+}
+
+void JobSystem::Submit(Job* job)
+{
+	if(threads.empty())
+	{
+		job->Execute();
+		return;
+	}
+
+	++pendingJobsCount;
+	// увеличивать счётчик до постановки задачи, чтобы взявший её поток
+	// не увёл счётчик в минус; и под мьютексом, чтобы поток не уснул, не заметив задачу
+	{
+		std::lock_guard<std::mutex> lock(wakeMutex);
+		++queuedJobsCount;
+	}
+	{
+		Queue& q = *queues[nextQueue];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		q.jobs.push_back(job);
+	}
+	nextQueue = (nextQueue + 1) % (int)queues.size();
+
+	wakeCondition.notify_one();
+}
+
+void JobSystem::Wait()
+{
+	// главный поток помогает, пока есть задачи
+	while(pendingJobsCount.load() > 0)
+	{
+		Job* job = Take(0);
+		if(job)
+			Execute(job);
+		else
+			std::this_thread::yield();
+	}
+
+	ptr<Exception> jobError;
+	{
+		std::lock_guard<std::mutex> lock(errorMutex);
+		jobError = error;
+		error = 0;
+	}
+	if(jobError)
+		THROW_SECONDARY("Job failed", jobError);
+}
+
+#else
+
+JobSystem::JobSystem(int workersCount) {}
+
+JobSystem::~JobSystem() {}
+
+int JobSystem::GetWorkersCount() const
+{
+	return 0;
+}
+
+void JobSystem::Submit(Job* job)
+{
+	job->Execute();
+}
+
+void JobSystem::Wait() {}
+
+#endif
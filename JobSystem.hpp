@@ -0,0 +1,80 @@
+#ifndef ___FARSH_JOB_SYSTEM_HPP___
+#define ___FARSH_JOB_SYSTEM_HPP___
+
+#include "general.hpp"
+#include <deque>
+
+#ifndef ___INANITY_PLATFORM_EMSCRIPTEN
+#define ___FARSH_JOB_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+/// Планировщик задач с перехватом работы (work stealing).
+/** У каждого потока своя очередь задач. Поток берёт задачи с конца
+своей очереди, а когда она пуста - перехватывает с начала чужих.
+Главный поток тоже участвует в работе, пока ждёт завершения задач.
+Без потоков (emscripten или 0 рабочих потоков) задачи выполняются сразу. */
+class JobSystem : public Object
+{
+public:
+	/// Задача.
+	/** Владеет задачей вызывающий код; задача должна жить до Wait. */
+	class Job
+	{
+	public:
+		virtual ~Job() {}
+		virtual void Execute() = 0;
+	};
+
+private:
+#ifdef ___FARSH_JOB_THREADS
+	/// Очередь задач потока.
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Job*> jobs;
+	};
+	/// Очереди; нулевая - главного потока.
+	std::vector<Queue*> queues;
+	std::vector<std::thread> threads;
+
+	/// Мьютекс и условие для пробуждения рабочих потоков.
+	std::mutex wakeMutex;
+	std::condition_variable wakeCondition;
+	bool stopping;
+
+	/// Количество задач в очередях.
+	std::atomic<int> queuedJobsCount;
+	/// Количество поставленных, но не завершённых задач.
+	std::atomic<int> pendingJobsCount;
+	/// Очередь для следующей задачи.
+	int nextQueue;
+
+	/// Первая ошибка, возникшая в задачах.
+	std::mutex errorMutex;
+	ptr<Exception> error;
+
+	/// Взять задачу из своей очереди или перехватить из чужой.
+	Job* Take(int queue);
+	void Execute(Job* job);
+	void WorkerThread(int queue);
+#endif
+
+public:
+	/// Создать планировщик.
+	/** Отрицательное количество рабочих потоков - по числу ядер минус один. */
+	JobSystem(int workersCount = -1);
+	~JobSystem();
+
+	int GetWorkersCount() const;
+
+	/// Поставить задачу.
+	void Submit(Job* job);
+	/// Дождаться выполнения всех поставленных задач.
+	void Wait();
+};
+
+#endif
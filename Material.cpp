@@ -17,8 +17,10 @@ bool operator==(const MaterialKey& a, const MaterialKey& b)
 
 //*** Material
 
+static int nextMaterialId = 0;
+
 Material::Material()
-: diffuse(1, 1, 1, 1), specular(1, 1, 1, 1), normalCoordTransform(1, 1, 0, 0) {}
+: diffuse(1, 1, 1, 1), specular(1, 1, 1, 1), normalCoordTransform(1, 1, 0, 0), id(nextMaterialId++), version(0) {}
 
 MaterialKey Material::GetKey() const
 {
@@ -28,34 +30,41 @@ MaterialKey Material::GetKey() const
 void Material::SetDiffuseTexture(ptr<Texture> diffuseTexture)
 {
 	this->diffuseTexture = diffuseTexture;
+	++version;
 }
 
 void Material::SetSpecularTexture(ptr<Texture> specularTexture)
 {
 	this->specularTexture = specularTexture;
+	++version;
 }
 
 void Material::SetNormalTexture(ptr<Texture> normalTexture)
 {
 	this->normalTexture = normalTexture;
+	++version;
 }
 
 void Material::SetDiffuse(const vec4& diffuse)
 {
 	this->diffuse = diffuse;
+	++version;
 }
 
 void Material::SetSpecular(const vec4& specular)
 {
 	this->specular = specular;
+	++version;
 }
 
 void Material::SetNormalCoordTransform(const vec4& normalCoordTransform)
 {
 	this->normalCoordTransform = normalCoordTransform;
+	++version;
 }
 
 void Material::SetEnvironmentCoef(float environmentCoef)
 {
 	this->environmentCoef = environmentCoef;
+	++version;
 }
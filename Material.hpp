@@ -27,6 +27,14 @@ struct Material : public Object
 	vec4 normalCoordTransform;
 	/// Коэффициент примешивания окружения к цвету.
 	float environmentCoef;
+	/// Номер материала в порядке создания.
+	/** Используется для детерминированной сортировки вместо адреса. */
+	int id;
+	/// Версия параметров.
+	/** Увеличивается при каждом изменении через Set*, по ней рисовальщик
+	узнаёт, что uniform-буфер материала нужно перезалить.
+	Поля напрямую менять не следует. */
+	int version;
 
 	Material();
 
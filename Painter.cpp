@@ -1,26 +1,35 @@
 #include "Painter.hpp"
 #include "BoneAnimation.hpp"
+#include "BoneAnimationTexture.hpp"
 #include "GeometryFormats.hpp"
 
-const int Painter::shadowMapSize = 1024;
+const int Painter::fullShadowMapSize = 1024;
+const int Painter::fastShadowMapSize = 512;
 const int Painter::downsamplingStepForBloom = 1;
-const int Painter::bloomMapSize = 1 << (Painter::downsamplingPassesCount - 1 - Painter::downsamplingStepForBloom);
+const int Painter::bloomMapSize = Painter::downsampleMapSize >> Painter::downsamplingStepForBloom;
+const float Painter::skinnedBoundMargin = 0.5f;
+const float Painter::sunShadowDistance = 60.0f;
+const float Painter::sunCascadesNear = 0.1f;
+const float Painter::sunCascadesSplitLambda = 0.75f;
+const float Painter::sunCasterDistance = 50.0f;
+const float Painter::clustersNear = 0.5f;
+const float Painter::clustersFar = 100.0f;
 
 //*** Painter::Hasher
 
 size_t Painter::Hasher::operator()(const LightVariantKey& key) const
 {
-	return key.basicLightsCount | (key.shadowLightsCount << 3);
+	return key.basicLightsCount | (key.shadowLightsCount << 3) | ((size_t)key.sunLight << 6);
 }
 
 size_t Painter::Hasher::operator()(const VertexShaderKey& key) const
 {
-	return (size_t)key.instanced | ((size_t)key.skinned << 1);
+	return (size_t)key.instanced | ((size_t)key.skinned << 1) | ((size_t)key.baked << 2);
 }
 
 size_t Painter::Hasher::operator()(const PixelShaderKey& key) const
 {
-	return key.basicLightsCount | (key.shadowLightsCount << 3) | ((*this)(key.materialKey) << 6);
+	return key.basicLightsCount | (key.shadowLightsCount << 3) | ((size_t)key.sunLight << 6) | ((size_t)key.clustered << 7) | ((size_t)key.deferred << 8) | ((*this)(key.materialKey) << 9);
 }
 
 size_t Painter::Hasher::operator()(const MaterialKey& key) const
@@ -43,6 +52,23 @@ Painter::ShadowLight::ShadowLight(ptr<UniformGroup> ug, int samplerNumber) :
 	uShadowSampler(samplerNumber)
 {}
 
+//*** Painter::SunCascade
+
+Painter::SunCascade::SunCascade(ptr<UniformGroup> ug, int samplerNumber) :
+	uTransform(ug->AddUniform<mat4x4>()),
+	uShadowSampler(samplerNumber)
+{}
+
+//*** Painter::SunLight
+
+Painter::SunLight::SunLight(ptr<UniformGroup> ug, int firstSamplerNumber) :
+	uToLight(ug->AddUniform<vec3>()),
+	uLightColor(ug->AddUniform<vec3>())
+{
+	for(int i = 0; i < sunCascadesCount; ++i)
+		cascades.push_back(SunCascade(ug, firstSamplerNumber + i));
+}
+
 // Painter::LightVariant
 
 Painter::LightVariant::LightVariant() :
@@ -50,29 +76,45 @@ Painter::LightVariant::LightVariant() :
 	uAmbientColor(ugLight->AddUniform<vec3>())
 {}
 
+//*** Painter::MaterialUniforms
+
+Painter::MaterialUniforms::MaterialUniforms(ptr<Device> device) :
+	ug(NEW(UniformGroup(2))),
+	uDiffuse(ug->AddUniform<vec4>()),
+	uSpecular(ug->AddUniform<vec4>()),
+	uNormalCoordTransform(ug->AddUniform<vec4>()),
+	version(-1),
+	variant(0),
+	variantVersion(-1)
+{
+	ug->Finalize(device);
+}
+
 bool operator==(const Painter::LightVariantKey& a, const Painter::LightVariantKey& b)
 {
 	return
 		a.basicLightsCount == b.basicLightsCount &&
-		a.shadowLightsCount == b.shadowLightsCount;
+		a.shadowLightsCount == b.shadowLightsCount &&
+		a.sunLight == b.sunLight;
 }
 
 //*** Painter::VertexShaderKey
 
-Painter::VertexShaderKey::VertexShaderKey(bool instanced, bool skinned)
-: instanced(instanced), skinned(skinned) {}
+Painter::VertexShaderKey::VertexShaderKey(bool instanced, bool skinned, bool baked)
+: instanced(instanced), skinned(skinned), baked(baked) {}
 
 bool operator==(const Painter::VertexShaderKey& a, const Painter::VertexShaderKey& b)
 {
 	return
 		a.instanced == b.instanced &&
-		a.skinned == b.skinned;
+		a.skinned == b.skinned &&
+		a.baked == b.baked;
 }
 
 //*** Painter::PixelShaderKey
 
-Painter::PixelShaderKey::PixelShaderKey(int basicLightsCount, int shadowLightsCount, const MaterialKey& materialKey) :
-basicLightsCount(basicLightsCount), shadowLightsCount(shadowLightsCount), materialKey(materialKey)
+Painter::PixelShaderKey::PixelShaderKey(int basicLightsCount, int shadowLightsCount, bool sunLight, bool clustered, bool deferred, const MaterialKey& materialKey) :
+basicLightsCount(basicLightsCount), shadowLightsCount(shadowLightsCount), sunLight(sunLight), clustered(clustered), deferred(deferred), materialKey(materialKey)
 {}
 
 bool operator==(const Painter::PixelShaderKey& a, const Painter::PixelShaderKey& b)
@@ -80,26 +122,89 @@ bool operator==(const Painter::PixelShaderKey& a, const Painter::PixelShaderKey&
 	return
 		a.basicLightsCount == b.basicLightsCount &&
 		a.shadowLightsCount == b.shadowLightsCount &&
+		a.sunLight == b.sunLight &&
+		a.clustered == b.clustered &&
+		a.deferred == b.deferred &&
 		a.materialKey == b.materialKey;
 }
 
 //*** Painter::Model
 
-Painter::Model::Model(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform)
-: material(material), geometry(geometry), worldTransform(worldTransform) {}
+Painter::Model::Model(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform, bool dynamic)
+: material(material), geometry(geometry), dynamic(dynamic)
+{
+	SetWorldTransform(worldTransform);
+}
+
+void Painter::Model::SetWorldTransform(const mat4x4& worldTransform)
+{
+	this->worldTransform = worldTransform;
+
+	boundRadius = geometry->GetBoundRadius();
+	const vec3& center = geometry->GetBoundCenter();
+	const mat4x4& m = worldTransform;
+	boundCenter = vec3(
+		m(0, 0) * center.x + m(0, 1) * center.y + m(0, 2) * center.z + m(0, 3),
+		m(1, 0) * center.x + m(1, 1) * center.y + m(1, 2) * center.z + m(1, 3),
+		m(2, 0) * center.x + m(2, 1) * center.y + m(2, 2) * center.z + m(2, 3));
+	// радиус умножается на наибольший масштаб по осям
+	if(boundRadius >= 0)
+	{
+		float scale = 0;
+		for(int i = 0; i < 3; ++i)
+			scale = std::max(scale, length(vec3(m(0, i), m(1, i), m(2, i))));
+		boundRadius *= scale;
+	}
+}
 
 //*** Painter::SkinnedModel
 
 Painter::SkinnedModel::SkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<Geometry> shadowGeometry, ptr<BoneAnimationFrame> animationFrame)
-: material(material), geometry(geometry), shadowGeometry(shadowGeometry), animationFrame(animationFrame) {}
+: material(material), geometry(geometry), shadowGeometry(shadowGeometry), animationFrame(animationFrame)
+{
+	// сфера вокруг параллелепипеда, ограничивающего кости
+	const std::vector<vec3>& positions = animationFrame->animationWorldPositions;
+	if(positions.empty())
+	{
+		boundCenter = vec3(0, 0, 0);
+		boundRadius = -1;
+		return;
+	}
+	vec3 minPosition = positions[0], maxPosition = positions[0];
+	for(size_t i = 1; i < positions.size(); ++i)
+	{
+		const vec3& position = positions[i];
+		minPosition = vec3(std::min(minPosition.x, position.x), std::min(minPosition.y, position.y), std::min(minPosition.z, position.z));
+		maxPosition = vec3(std::max(maxPosition.x, position.x), std::max(maxPosition.y, position.y), std::max(maxPosition.z, position.z));
+	}
+	boundCenter = (minPosition + maxPosition) * 0.5f;
+	boundRadius = length(maxPosition - minPosition) * 0.5f + skinnedBoundMargin;
+}
+
+//*** Painter::BakedSkinnedModel
+
+Painter::BakedSkinnedModel::BakedSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationTexture> animationTexture, const quat& orientation, const vec4& position)
+: material(material), geometry(geometry), animationTexture(animationTexture), orientation(orientation), position(position)
+{
+	// сфера геометрии в позе привязки, с запасом на анимацию
+	boundCenter = vec3(position.x, position.y, position.z) + fromEigen((toEigenQuat(orientation) * toEigen(geometry->GetBoundCenter())).eval());
+	boundRadius = geometry->GetBoundRadius();
+	if(boundRadius >= 0)
+		boundRadius += skinnedBoundMargin;
+}
 
 //*** Painter::Light
 
-Painter::Light::Light(const vec3& position, const vec3& color)
-: position(position), color(color), shadow(false) {}
+Painter::Light::Light(const vec3& position, const vec3& color, float radius)
+: position(position), color(color), shadow(false), radius(radius) {}
 
 Painter::Light::Light(const vec3& position, const vec3& color, const mat4x4& transform)
-: position(position), color(color), transform(transform), shadow(true) {}
+: position(position), color(color), transform(transform), shadow(true), radius(-1) {}
+
+//*** Painter::ShadowCache
+
+Painter::ShadowCache::ShadowCache()
+: valid(false), dynamic(false) {}
 
 //*** Painter
 
@@ -111,14 +216,24 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 	screenHeight(-1),
 	shaderCache(shaderCache),
 	geometryFormats(geometryFormats),
+	hdrPixelFormat(ChooseRenderBufferFormat(PixelFormats::floatRGB32, PixelFormats::floatRGBA64)),
+	normalPixelFormat(ChooseRenderBufferFormat(PixelFormats::floatRG32, PixelFormats::floatRGBA64)),
 
 	ab(device->CreateAttributeBinding(geometryFormats->al)),
-	instancer(NEW(Instancer(device, maxInstancesCount, geometryFormats->al))),
-	abInstanced(device->CreateAttributeBinding(geometryFormats->al)),
 	aPosition(geometryFormats->alePosition),
 	aNormal(geometryFormats->aleNormal),
 	aTexcoord(geometryFormats->aleTexcoord),
+	abInstanced(device->CreateAttributeBinding(geometryFormats->alInstanced)),
+	aInstancedPosition(geometryFormats->aleInstancedPosition),
+	aInstancedNormal(geometryFormats->aleInstancedNormal),
+	aInstancedTexcoord(geometryFormats->aleInstancedTexcoord),
+	aInstanceWorld0(geometryFormats->aleInstanceWorld0),
+	aInstanceWorld1(geometryFormats->aleInstanceWorld1),
+	aInstanceWorld2(geometryFormats->aleInstanceWorld2),
+	vbInstances(device->CreateDynamicVertexBuffer(maxModelInstancesCount * geometryFormats->vlInstance->GetStride(), geometryFormats->vlInstance)),
 	abSkinned(device->CreateAttributeBinding(geometryFormats->alSkinned)),
+	skinnedInstancer(NEW(Instancer(device, maxInstancesCount, geometryFormats->alSkinned))),
+	abSkinnedInstanced(device->CreateAttributeBinding(geometryFormats->alSkinned)),
 	aSkinnedPosition(geometryFormats->aleSkinnedPosition),
 	aSkinnedNormal(geometryFormats->aleSkinnedNormal),
 	aSkinnedTexcoord(geometryFormats->aleSkinnedTexcoord),
@@ -130,6 +245,22 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 	uInvViewProj(ugCamera->AddUniform<mat4x4>()),
 	uCameraPosition(ugCamera->AddUniform<vec3>()),
 
+	ugClusters(NEW(UniformGroup(4))),
+	uClusterLightPositions(ugClusters->AddUniformArray<vec4>(maxClusteredLightsCount + 1)),
+	uClusterLightColors(ugClusters->AddUniformArray<vec4>(maxClusteredLightsCount + 1)),
+	uClusterLights(ugClusters->AddUniformArray<vec4>(clustersCount / 2)),
+	uClusterDepthParams(ugClusters->AddUniform<vec4>()),
+
+	ugDeferredLight(NEW(UniformGroup(1))),
+	uDeferredLightPosition(ugDeferredLight->AddUniform<vec4>()),
+	uDeferredLightColor(ugDeferredLight->AddUniform<vec3>()),
+	uDeferredLightTransform(ugDeferredLight->AddUniform<mat4x4>()),
+	uDeferredLightRect(ugDeferredLight->AddUniform<vec4>()),
+	uDeferredDepthSampler(0),
+	uDeferredNormalSampler(1),
+	uDeferredAlbedoSampler(2),
+	uDeferredShadowSampler(3),
+
 	ugMaterial(NEW(UniformGroup(2))),
 	uDiffuse(ugMaterial->AddUniform<vec4>()),
 	uSpecular(ugMaterial->AddUniform<vec4>()),
@@ -142,16 +273,25 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 	ugModel(NEW(UniformGroup(3))),
 	uWorld(ugModel->AddUniform<mat4x4>()),
 
-	ugInstancedModel(NEW(UniformGroup(3))),
-	uWorlds(ugInstancedModel->AddUniformArray<mat4x4>(maxInstancesCount)),
-
 	ugSkinnedModel(NEW(UniformGroup(3))),
 	uBoneOrientations(ugSkinnedModel->AddUniformArray<vec4>(maxBonesCount)),
 	uBoneOffsets(ugSkinnedModel->AddUniformArray<vec4>(maxBonesCount)),
 
+	ugSkinnedInstancedModel(NEW(UniformGroup(3))),
+	uInstancedBoneOrientations(ugSkinnedInstancedModel->AddUniformArray<vec4>(maxSkinnedInstancedBonesCount)),
+	uInstancedBoneOffsets(ugSkinnedInstancedModel->AddUniformArray<vec4>(maxSkinnedInstancedBonesCount)),
+	uInstancedBonesCount(ugSkinnedInstancedModel->AddUniform<float>()),
+
+	ugBakedSkinnedModel(NEW(UniformGroup(3))),
+	uBakedOrientations(ugBakedSkinnedModel->AddUniformArray<vec4>(maxInstancesCount)),
+	uBakedPositions(ugBakedSkinnedModel->AddUniformArray<vec4>(maxInstancesCount)),
+	uBakedTexelSize(ugBakedSkinnedModel->AddUniform<vec2>()),
+	uBoneAnimationSampler(4),
+
 	ugShadowBlur(NEW(UniformGroup(0))),
 	uShadowBlurDirection(ugShadowBlur->AddUniform<vec2>()),
 	uShadowBlurSourceSampler(0),
+	uShadowBlurStaticSampler(1),
 
 	ugDownsample(NEW(UniformGroup(0))),
 	uDownsampleOffsets(ugDownsample->AddUniform<vec4>()),
@@ -161,6 +301,7 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 
 	ugBloom(NEW(UniformGroup(0))),
 	uBloomLimit(ugBloom->AddUniform<float>()),
+	uBloomOffset(ugBloom->AddUniform<float>()),
 	uBloomSourceSampler(0),
 
 	ugTone(NEW(UniformGroup(0))),
@@ -173,15 +314,33 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 	iNormal(0),
 	iTexcoord(1),
 	iWorldPosition(2),
-	iDepth(3)
+	iDepth(3),
+
+	shadowMapSize(fullShadowMapSize),
+	fastShadowFilter(false),
+
+	persistentModelTreeDirty(false),
+
+	depthPrepass(false),
+
+	sunLight(false),
+
+	clusteredLighting(false),
+
+	deferredShading(false),
+
+	pyramidBloom(false)
 
 {
 	// финализировать uniform группы
 	ugCamera->Finalize(device);
+	ugClusters->Finalize(device);
+	ugDeferredLight->Finalize(device);
 	ugMaterial->Finalize(device);
 	ugModel->Finalize(device);
-	ugInstancedModel->Finalize(device);
 	ugSkinnedModel->Finalize(device);
+	ugSkinnedInstancedModel->Finalize(device);
+	ugBakedSkinnedModel->Finalize(device);
 	ugShadowBlur->Finalize(device);
 	ugDownsample->Finalize(device);
 	ugBloom->Finalize(device);
@@ -200,38 +359,42 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 	// создать настройки depth-stencil state
 	dssNormal = device->CreateDepthStencilState();
 	dssNormal->SetDepthTest(DepthStencilState::testFuncLess, true);
+	dssEqual = device->CreateDepthStencilState();
+	dssEqual->SetDepthTest(DepthStencilState::testFuncEqual, false);
 	dssPass = device->CreateDepthStencilState();
 	dssPass->SetDepthTest(DepthStencilState::testFuncAlways, false);
 
 	//** создать ресурсы
-	dsbShadow = device->CreateDepthStencilBuffer(shadowMapSize, shadowMapSize, false);
-	for(int i = 0; i < maxShadowLightsCount; ++i)
-	{
-		ptr<RenderBuffer> rb = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
-		ptr<FrameBuffer> fb = device->CreateFrameBuffer();
-		fb->SetColorBuffer(0, rb);
-		fb->SetDepthStencilBuffer(dsbShadow);
-		ptr<FrameBuffer> fbBlur = device->CreateFrameBuffer();
-		fbBlur->SetColorBuffer(0, rb);
-		rbShadows[i] = rb;
-		fbShadows[i] = fb;
-		fbShadowBlurs[i] = fbBlur;
-	}
-	rbShadowBlur = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
+	CreateShadowMaps();
 
 	// буферы для downsample
 	for(int i = 0; i < downsamplingPassesCount; ++i)
 	{
-		ptr<RenderBuffer> rb = device->CreateRenderBuffer(1 << (downsamplingPassesCount - 1 - i), 1 << (downsamplingPassesCount - 1 - i),
-			i <= downsamplingStepForBloom ? PixelFormats::floatRGB32 : PixelFormats::floatR16, pointSamplerSettings);
+		ptr<RenderBuffer> rb = device->CreateRenderBuffer(downsampleMapSize >> i, downsampleMapSize >> i, hdrPixelFormat, pointSamplerSettings);
 		rbDownsamples[i] = rb;
 		ptr<FrameBuffer> fb = device->CreateFrameBuffer();
 		fb->SetColorBuffer(0, rb);
 		fbDownsamples[i] = fb;
 	}
+	// буферы для освещённости
+	for(int i = 0; i < luminancePassesCount; ++i)
+	{
+		int size = GetLuminanceMapSize(i);
+		ptr<RenderBuffer> rb = device->CreateRenderBuffer(size, size, PixelFormats::floatR16, pointSamplerSettings);
+		rbLuminances[i] = rb;
+		ptr<FrameBuffer> fb = device->CreateFrameBuffer();
+		fb->SetColorBuffer(0, rb);
+		fbLuminances[i] = fb;
+	}
 	// буферы для Bloom
-	rbBloom1 = device->CreateRenderBuffer(bloomMapSize, bloomMapSize, PixelFormats::floatRGB32, pointSamplerSettings);
-	rbBloom2 = device->CreateRenderBuffer(bloomMapSize, bloomMapSize, PixelFormats::floatRGB32, pointSamplerSettings);
+	rbBloom1 = device->CreateRenderBuffer(bloomMapSize, bloomMapSize, hdrPixelFormat, pointSamplerSettings);
+	rbBloom2 = device->CreateRenderBuffer(bloomMapSize, bloomMapSize, hdrPixelFormat, pointSamplerSettings);
+	for(int i = 0; i < bloomPyramidLevelsCount; ++i)
+	{
+		rbBloomPyramid[i] = device->CreateRenderBuffer(bloomMapSize >> (i + 1), bloomMapSize >> (i + 1), hdrPixelFormat, pointSamplerSettings);
+		fbBloomPyramid[i] = device->CreateFrameBuffer();
+		fbBloomPyramid[i]->SetColorBuffer(0, rbBloomPyramid[i]);
+	}
 
 	shadowSamplerState = device->CreateSamplerState(shadowSamplerSettings);
 
@@ -301,15 +464,45 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 			iTexcoord.Set(screenToTexture(quad.aPosition["xy"]))
 			));
 
-		// пиксельный шейдер для размытия тени
+		// пиксельные шейдеры для размытия тени
 		{
 			Value<float> sum = 0.0f;
+			Value<float> compositeSum = 0.0f;
 			static const float taps[] = { 0.006f, 0.061f, 0.242f, 0.383f, 0.242f, 0.061f, 0.006f };
 			for(int i = 0; i < int(sizeof(taps) / sizeof(taps[0])); ++i)
-				sum += exp(uShadowBlurSourceSampler.Sample(iTexcoord + uShadowBlurDirection * val((float)i - 3))) * val(taps[i]);
+			{
+				Value<vec2> texcoord = iTexcoord + uShadowBlurDirection * val((float)i - 3);
+				Value<float> depth = uShadowBlurSourceSampler.Sample(texcoord);
+				sum += exp(depth) * val(taps[i]);
+				compositeSum += exp(min(depth, uShadowBlurStaticSampler.Sample(texcoord))) * val(taps[i]);
+			}
 			psShadowBlur = shaderCache->GetPixelShader(
 				fragment(0, newvec4(log(sum), 0, 0, 1))
 			);
+			psShadowBlurComposite = shaderCache->GetPixelShader(
+				fragment(0, newvec4(log(compositeSum), 0, 0, 1))
+			);
+		}
+		// пиксельные шейдеры для быстрого размытия тени
+		// uShadowBlurDirection - размер текселя по обеим осям
+		{
+			Value<float> sum = 0.0f;
+			Value<float> compositeSum = 0.0f;
+			static const float taps[] = { 0.25f, 0.5f, 0.25f };
+			for(int i = 0; i < 3; ++i)
+				for(int j = 0; j < 3; ++j)
+				{
+					Value<vec2> texcoord = iTexcoord + uShadowBlurDirection * newvec2((float)i - 1, (float)j - 1);
+					Value<float> depth = uShadowBlurSourceSampler.Sample(texcoord);
+					sum += exp(depth) * val(taps[i] * taps[j]);
+					compositeSum += exp(min(depth, uShadowBlurStaticSampler.Sample(texcoord))) * val(taps[i] * taps[j]);
+				}
+			psShadowBlurFast = shaderCache->GetPixelShader(
+				fragment(0, newvec4(log(sum), 0, 0, 1))
+			);
+			psShadowBlurFastComposite = shaderCache->GetPixelShader(
+				fragment(0, newvec4(log(compositeSum), 0, 0, 1))
+			);
 		}
 
 		// пиксельный шейдер для downsample
@@ -378,6 +571,38 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 				fragment(0, newvec4(sum * Value<float>(1.0f / (sizeof(offsets) / sizeof(offsets[0]))), 1.0f))
 			);
 		}
+		// пиксельные шейдеры уменьшения для пирамиды bloom: семплы по углам
+		// текселя результата, каждый усредняет 2x2 текселя источника
+		{
+			Value<vec3> sum = uBloomSourceSampler.Sample(iTexcoord) * val(4.0f);
+			Value<vec3> limitSum = max(uBloomSourceSampler.Sample(iTexcoord) - uBloomLimit, newvec3(0, 0, 0)) * val(4.0f);
+			for(int i = 0; i < 4; ++i)
+			{
+				Value<vec3> sample = uBloomSourceSampler.Sample(iTexcoord + newvec2((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f) * uBloomOffset);
+				sum += sample;
+				limitSum += max(sample - uBloomLimit, newvec3(0, 0, 0));
+			}
+			psBloomPyramidDown = shaderCache->GetPixelShader(
+				fragment(0, newvec4(sum * val(1.0f / 8), 1.0f))
+			);
+			psBloomPyramidDownLimit = shaderCache->GetPixelShader(
+				fragment(0, newvec4(limitSum * val(1.0f / 8), 1.0f))
+			);
+		}
+		// пиксельный шейдер увеличения для пирамиды bloom
+		{
+			Value<vec3> sum = newvec3(0, 0, 0);
+			for(int i = 0; i < 4; ++i)
+			{
+				float x = (i & 1) ? 1.0f : -1.0f, y = (i & 2) ? 1.0f : -1.0f;
+				// по осям - на текселе источника, по диагоналям - на полтекселя с двойным весом
+				sum += uBloomSourceSampler.Sample(iTexcoord + newvec2((i & 2) ? 0.0f : x * 2, (i & 2) ? y * 2 : 0.0f) * uBloomOffset);
+				sum += uBloomSourceSampler.Sample(iTexcoord + newvec2(x, y) * uBloomOffset) * val(2.0f);
+			}
+			psBloomPyramidUp = shaderCache->GetPixelShader(
+				fragment(0, newvec4(sum * val(1.0f / 12), 1.0f))
+			);
+		}
 		// шейдер tone mapping
 		{
 			Value<vec3> color = uToneScreenSampler.Sample(iTexcoord) + uToneBloomSampler.Sample(iTexcoord);
@@ -417,10 +642,6 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 			ssPointBorder = device->CreateSamplerState(s);
 		}
 
-		// фреймбуферы для размытия тени
-		fbShadowBlur1 = device->CreateFrameBuffer();
-		fbShadowBlur1->SetColorBuffer(0, rbShadowBlur);
-
 		// для последнего прохода - специальный blend state
 		bsLastDownsample = device->CreateBlendState();
 		bsLastDownsample->SetColor(BlendState::colorSourceSrcAlpha, BlendState::colorSourceInvSrcAlpha, BlendState::operationAdd);
@@ -431,6 +652,130 @@ Painter::Painter(ptr<Device> device, ptr<Context> context, ptr<Presenter> presen
 		fbBloom2 = device->CreateFrameBuffer();
 		fbBloom2->SetColorBuffer(0, rbBloom2);
 	}
+
+	//** шейдеры и состояния отложенного освещения
+	{
+		// промежуточные
+		Interpolant<vec2> iScreenTexcoord(0);
+		Interpolant<vec2> iScreenPosition(1);
+
+		// квадрат растягивается на прямоугольник источника
+		Value<vec2> position = uDeferredLightRect["xy"] + (quad.aPosition["xy"] * val(0.5f) + val(0.5f)) * (uDeferredLightRect["zw"] - uDeferredLightRect["xy"]);
+		vsDeferredLight = shaderCache->GetVertexShader((
+			setPosition(newvec4(position, 0.0f, 1.0f)),
+			iScreenTexcoord.Set(screenToTexture(position)),
+			iScreenPosition.Set(position)
+			));
+
+		// восстановить положение по глубине и прочитать G-буфер
+		Value<float> depth = uDeferredDepthSampler.Sample(iScreenTexcoord);
+		Value<vec4> worldPosition = mul(uInvViewProj, newvec4(iScreenPosition, depth, 1.0f));
+		tmpWorldPosition = worldPosition / worldPosition["w"];
+		tmpNormal = DecodeNormal(uDeferredNormalSampler.Sample(iScreenTexcoord));
+		Value<vec4> albedo = uDeferredAlbedoSampler.Sample(iScreenTexcoord);
+		tmpDiffuse = newvec4(albedo["xyz"], 1.0f);
+		tmpSpecularExponent = exp2(albedo["w"] * val(4.0f));
+		tmpToCamera = normalize(uCameraPosition - tmpWorldPosition["xyz"]);
+
+		// плавное затухание до нуля на радиусе, как в кластерном режиме;
+		// фон (глубина 1) не освещается
+		Value<float> distance = length(uDeferredLightPosition["xyz"] - tmpWorldPosition["xyz"]) * uDeferredLightPosition["w"];
+		Value<float> window = saturate(val(1.0f) - distance * distance * distance * distance);
+		Value<vec3> lightColor = uDeferredLightColor * (window * window * (depth < val(1.0f)).Cast<float>());
+
+		// простой источник
+		tmpColor = newvec3(0, 0, 0);
+		ApplyMaterialLighting(uDeferredLightPosition["xyz"], lightColor);
+		psDeferredLight = shaderCache->GetPixelShader(
+			fragment(0, newvec4(tmpColor, 1.0f))
+		);
+
+		// источник с тенью
+		tmpColor = newvec3(0, 0, 0);
+		ApplyMaterialLighting(uDeferredLightPosition["xyz"], lightColor * SampleShadow(uDeferredLightTransform, uDeferredShadowSampler));
+		psDeferredShadowLight = shaderCache->GetPixelShader(
+			fragment(0, newvec4(tmpColor, 1.0f))
+		);
+
+		// вклады источников складываются
+		bsAdditive = device->CreateBlendState();
+		bsAdditive->SetColor(BlendState::colorSourceOne, BlendState::colorSourceOne, BlendState::operationAdd);
+	}
+}
+
+PixelFormat Painter::ChooseRenderBufferFormat(const PixelFormat& preferred, const PixelFormat& fallback)
+{
+	// пробный рендербуфер; если формат не поддерживается, устройство бросает исключение
+	// при создании или (на GL) при проверке полноты фреймбуфера, которая делается
+	// только при его установке - поэтому фреймбуфер устанавливается и очищается
+	try
+	{
+		SamplerSettings samplerSettings;
+		samplerSettings.SetFilter(SamplerSettings::filterPoint);
+		ptr<FrameBuffer> fb = device->CreateFrameBuffer();
+		fb->SetColorBuffer(0, device->CreateRenderBuffer(1, 1, preferred, samplerSettings));
+		Context::LetFrameBuffer lfb(context, fb);
+		Context::LetViewport lv(context, 1, 1);
+		context->ClearColor(0, vec4(0, 0, 0, 0));
+		return preferred;
+	}
+	catch(Exception* exception)
+	{
+		MakePointer(exception);
+		return fallback;
+	}
+}
+
+int Painter::GetLuminanceMapSize(int pass)
+{
+	return (downsampleMapSize >> (downsamplingPassesCount - 1)) >> ((pass + 1) * 2);
+}
+
+void Painter::CreateShadowMaps()
+{
+	SamplerSettings shadowSamplerSettings;
+	shadowSamplerSettings.SetWrap(SamplerSettings::wrapBorder);
+	shadowSamplerSettings.SetFilter(SamplerSettings::filterLinear);
+
+	dsbShadow = device->CreateDepthStencilBuffer(shadowMapSize, shadowMapSize, false);
+	rbShadowDepth = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
+	fbShadowDepth = device->CreateFrameBuffer();
+	fbShadowDepth->SetColorBuffer(0, rbShadowDepth);
+	fbShadowDepth->SetDepthStencilBuffer(dsbShadow);
+
+	for(int i = 0; i < maxShadowLightsCount; ++i)
+	{
+		rbShadows[i] = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
+		fbShadows[i] = device->CreateFrameBuffer();
+		fbShadows[i]->SetColorBuffer(0, rbShadows[i]);
+
+		rbStaticShadows[i] = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
+		fbStaticShadows[i] = device->CreateFrameBuffer();
+		fbStaticShadows[i]->SetColorBuffer(0, rbStaticShadows[i]);
+		fbStaticShadows[i]->SetDepthStencilBuffer(dsbShadow);
+
+		// новые карты пусты
+		shadowCaches[i] = ShadowCache();
+	}
+	for(int i = 0; i < sunCascadesCount; ++i)
+	{
+		rbSunCascades[i] = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
+		fbSunCascades[i] = device->CreateFrameBuffer();
+		fbSunCascades[i]->SetColorBuffer(0, rbSunCascades[i]);
+	}
+
+	// вспомогательная карта нужна только для полного размытия
+	if(fastShadowFilter)
+	{
+		rbShadowBlur = 0;
+		fbShadowBlur1 = 0;
+	}
+	else
+	{
+		rbShadowBlur = device->CreateRenderBuffer(shadowMapSize, shadowMapSize, PixelFormats::floatR16, shadowSamplerSettings);
+		fbShadowBlur1 = device->CreateFrameBuffer();
+		fbShadowBlur1->SetColorBuffer(0, rbShadowBlur);
+	}
 }
 
 void Painter::Resize(int screenWidth, int screenHeight)
@@ -447,15 +792,44 @@ void Painter::Resize(int screenWidth, int screenHeight)
 	pointSamplerSettings.SetWrap(SamplerSettings::wrapClamp);
 
 	// main screen
-	rbScreen = device->CreateRenderBuffer(screenWidth, screenHeight, PixelFormats::floatRGB32, pointSamplerSettings);
-	rbScreenNormal = device->CreateRenderBuffer(screenWidth, screenHeight, PixelFormats::floatRGB32, pointSamplerSettings);
+	rbScreen = device->CreateRenderBuffer(screenWidth, screenHeight, hdrPixelFormat, pointSamplerSettings);
 	dsbDepth = device->CreateDepthStencilBuffer(screenWidth, screenHeight, true);
 
 	// framebuffers
 	fbOpaque = device->CreateFrameBuffer();
 	fbOpaque->SetColorBuffer(0, rbScreen);
-	fbOpaque->SetColorBuffer(1, rbScreenNormal);
 	fbOpaque->SetDepthStencilBuffer(dsbDepth);
+	fbDepthPrepass = device->CreateFrameBuffer();
+	fbDepthPrepass->SetDepthStencilBuffer(dsbDepth);
+	fbDeferredLighting = device->CreateFrameBuffer();
+	fbDeferredLighting->SetColorBuffer(0, rbScreen);
+
+	CreateGBuffer();
+}
+
+void Painter::CreateGBuffer()
+{
+	// без отложенного освещения G-буфер не нужен
+	if(!deferredShading)
+	{
+		rbScreenNormal = 0;
+		rbScreenAlbedo = 0;
+		fbGBuffer = 0;
+		return;
+	}
+
+	SamplerSettings pointSamplerSettings;
+	pointSamplerSettings.SetFilter(SamplerSettings::filterPoint);
+	pointSamplerSettings.SetWrap(SamplerSettings::wrapClamp);
+
+	rbScreenNormal = device->CreateRenderBuffer(screenWidth, screenHeight, normalPixelFormat, pointSamplerSettings);
+	rbScreenAlbedo = device->CreateRenderBuffer(screenWidth, screenHeight, PixelFormats::intRGBA32, pointSamplerSettings);
+
+	fbGBuffer = device->CreateFrameBuffer();
+	fbGBuffer->SetColorBuffer(0, rbScreen);
+	fbGBuffer->SetColorBuffer(1, rbScreenNormal);
+	fbGBuffer->SetColorBuffer(2, rbScreenAlbedo);
+	fbGBuffer->SetDepthStencilBuffer(dsbDepth);
 }
 
 Painter::LightVariant& Painter::GetLightVariant(const LightVariantKey& key)
@@ -479,6 +853,9 @@ Painter::LightVariant& Painter::GetLightVariant(const LightVariantKey& key)
 	for(int i = 0; i < shadowLightsCount; ++i)
 		// первые 5 семплеров пропустить
 		lightVariant.shadowLights.push_back(ShadowLight(lightVariant.ugLight, i + 5));
+	// семплеры каскадов - после семплеров всех возможных теневых источников
+	if(key.sunLight)
+		lightVariant.sunLights.push_back(SunLight(lightVariant.ugLight, 5 + maxShadowLightsCount));
 
 	lightVariant.ugLight->Finalize(device);
 
@@ -494,6 +871,32 @@ Value<vec3> Painter::ApplyQuaternion(Value<vec4> q, Value<vec3> v)
 	return v + cross(q["xyz"], cross(q["xyz"], v) + v * q["w"]) * Value<float>(2);
 }
 
+/// Знак без нуля: -1 для отрицательных, иначе 1.
+static Value<float> SignNotZero(Value<float> v)
+{
+	return val(1.0f) - (v < val(0.0f)).Cast<float>() * val(2.0f);
+}
+
+Value<vec2> Painter::EncodeNormal(Value<vec3> normal)
+{
+	// проекция на октаэдр; нижняя половина отворачивается наружу по диагоналям
+	Value<vec2> p = normal["xy"] / (abs(normal["x"]) + abs(normal["y"]) + abs(normal["z"]));
+	Value<vec2> folded = newvec2(
+		(val(1.0f) - abs(p["y"])) * SignNotZero(p["x"]),
+		(val(1.0f) - abs(p["x"])) * SignNotZero(p["y"]));
+	return p + (folded - p) * (normal["z"] < val(0.0f)).Cast<float>();
+}
+
+Value<vec3> Painter::DecodeNormal(Value<vec2> encoded)
+{
+	Value<float> z = val(1.0f) - abs(encoded["x"]) - abs(encoded["y"]);
+	Value<float> t = saturate(z * val(-1.0f));
+	return normalize(newvec3(
+		encoded["x"] - SignNotZero(encoded["x"]) * t,
+		encoded["y"] - SignNotZero(encoded["y"]) * t,
+		z));
+}
+
 void Painter::GetWorldPositionAndNormal(const VertexShaderKey& key)
 {
 	if(key.skinned)
@@ -513,33 +916,94 @@ void Painter::GetWorldPositionAndNormal(const VertexShaderKey& key)
 			aSkinnedBoneWeights["z"],
 			aSkinnedBoneWeights["w"]
 		};
-		Value<vec3> boneOffsets[4] =
+		Value<vec4> boneOrientations[4];
+		Value<vec3> boneOffsets[4];
+		if(key.baked)
 		{
-			uBoneOffsets[boneNumbers[0]]["xyz"],
-			uBoneOffsets[boneNumbers[1]]["xyz"],
-			uBoneOffsets[boneNumbers[2]]["xyz"],
-			uBoneOffsets[boneNumbers[3]]["xyz"]
-		};
+			// кость - два текселя (ориентация и смещение) в строке кадра экземпляра;
+			// два соседних кадра читаются без фильтрации и интерполируются здесь
+			Value<float> frame = uBakedPositions[skinnedInstancer->GetInstanceID()]["w"];
+			Value<float> frameFloor = frame.Cast<uint>().Cast<float>();
+			Value<float> frameLerp = frame - frameFloor;
+			Value<float> v1 = (frameFloor + val(0.5f)) * uBakedTexelSize["y"];
+			Value<float> v2 = v1 + uBakedTexelSize["y"];
+			for(int i = 0; i < 4; ++i)
+			{
+				Value<float> u = (boneNumbers[i].Cast<float>() * val(2.0f) + val(0.5f)) * uBakedTexelSize["x"];
+				Value<float> uOffset = u + uBakedTexelSize["x"];
+				Value<vec4> orientation1 = uBoneAnimationSampler.Sample(newvec2(u, v1));
+				Value<vec4> orientation2 = uBoneAnimationSampler.Sample(newvec2(u, v2));
+				Value<vec3> offset1 = uBoneAnimationSampler.Sample(newvec2(uOffset, v1))["xyz"];
+				Value<vec3> offset2 = uBoneAnimationSampler.Sample(newvec2(uOffset, v2))["xyz"];
+				// между кадрами кватернион интерполируется линейно, нужна нормализация
+				boneOrientations[i] = normalize(orientation1 + (orientation2 - orientation1) * frameLerp);
+				boneOffsets[i] = offset1 + (offset2 - offset1) * frameLerp;
+			}
+		}
+		else if(key.instanced)
+		{
+			// кости экземпляра начинаются с instanceID * uInstancedBonesCount
+			Value<uint> boneBase = skinnedInstancer->GetInstanceID() * uInstancedBonesCount.Cast<uint>();
+			for(int i = 0; i < 4; ++i)
+			{
+				boneOrientations[i] = uInstancedBoneOrientations[boneBase + boneNumbers[i]];
+				boneOffsets[i] = uInstancedBoneOffsets[boneBase + boneNumbers[i]]["xyz"];
+			}
+		}
+		else
+			for(int i = 0; i < 4; ++i)
+			{
+				boneOrientations[i] = uBoneOrientations[boneNumbers[i]];
+				boneOffsets[i] = uBoneOffsets[boneNumbers[i]]["xyz"];
+			}
 
-		tmpVertexPosition = newvec4(
-			(ApplyQuaternion(uBoneOrientations[boneNumbers[0]], position) + boneOffsets[0]) * boneWeights[0] +
-			(ApplyQuaternion(uBoneOrientations[boneNumbers[1]], position) + boneOffsets[1]) * boneWeights[1] +
-			(ApplyQuaternion(uBoneOrientations[boneNumbers[2]], position) + boneOffsets[2]) * boneWeights[2] +
-			(ApplyQuaternion(uBoneOrientations[boneNumbers[3]], position) + boneOffsets[3]) * boneWeights[3],
-			1.0f);
-		tmpVertexNormal =
-			ApplyQuaternion(uBoneOrientations[boneNumbers[0]], aSkinnedNormal) * boneWeights[0] +
-			ApplyQuaternion(uBoneOrientations[boneNumbers[1]], aSkinnedNormal) * boneWeights[1] +
-			ApplyQuaternion(uBoneOrientations[boneNumbers[2]], aSkinnedNormal) * boneWeights[2] +
-			ApplyQuaternion(uBoneOrientations[boneNumbers[3]], aSkinnedNormal) * boneWeights[3];
+		Value<vec3> skinnedPosition =
+			(ApplyQuaternion(boneOrientations[0], position) + boneOffsets[0]) * boneWeights[0] +
+			(ApplyQuaternion(boneOrientations[1], position) + boneOffsets[1]) * boneWeights[1] +
+			(ApplyQuaternion(boneOrientations[2], position) + boneOffsets[2]) * boneWeights[2] +
+			(ApplyQuaternion(boneOrientations[3], position) + boneOffsets[3]) * boneWeights[3];
+		Value<vec3> skinnedNormal =
+			ApplyQuaternion(boneOrientations[0], aSkinnedNormal) * boneWeights[0] +
+			ApplyQuaternion(boneOrientations[1], aSkinnedNormal) * boneWeights[1] +
+			ApplyQuaternion(boneOrientations[2], aSkinnedNormal) * boneWeights[2] +
+			ApplyQuaternion(boneOrientations[3], aSkinnedNormal) * boneWeights[3];
+
+		// текстура анимации запечена в начале координат, перенести в положение экземпляра
+		if(key.baked)
+		{
+			Value<vec4> instanceOrientation = uBakedOrientations[skinnedInstancer->GetInstanceID()];
+			skinnedPosition = ApplyQuaternion(instanceOrientation, skinnedPosition) + uBakedPositions[skinnedInstancer->GetInstanceID()]["xyz"];
+			skinnedNormal = ApplyQuaternion(instanceOrientation, skinnedNormal);
+		}
+
+		tmpVertexPosition = newvec4(skinnedPosition, 1.0f);
+		tmpVertexNormal = skinnedNormal;
 	}
 	else
 	{
-		Value<mat4x4> tmpWorld = key.instanced ? uWorlds[instancer->GetInstanceID()] : uWorld;
-
-		tmpVertexPosition = mul(tmpWorld, newvec4(aPosition, 1.0f));
-		tmpVertexNormal = mul(tmpWorld.Cast<mat3x3>(), aNormal);
+		if(key.instanced)
+		{
+			// матрица 3x4 из строк в атрибутах экземпляра
+			Value<vec4> position = newvec4(aInstancedPosition, 1.0f);
+			tmpVertexPosition = newvec4(
+				dot(aInstanceWorld0, position),
+				dot(aInstanceWorld1, position),
+				dot(aInstanceWorld2, position),
+				1.0f);
+			tmpVertexNormal = newvec3(
+				dot(aInstanceWorld0["xyz"], aInstancedNormal),
+				dot(aInstanceWorld1["xyz"], aInstancedNormal),
+				dot(aInstanceWorld2["xyz"], aInstancedNormal));
+		}
+		else
+		{
+			tmpVertexPosition = mul(uWorld, newvec4(aPosition, 1.0f));
+			tmpVertexNormal = mul(uWorld.Cast<mat3x3>(), aNormal);
+		}
 	}
+
+	// одно выражение для всех проходов, чтобы глубина совпадала точно
+	tmpVertexClipPosition = mul(uViewProj, tmpVertexPosition);
 }
 
 void Painter::BeginMaterialLighting(const PixelShaderKey& key, Value<vec3> ambientColor)
@@ -581,7 +1045,11 @@ void Painter::BeginMaterialLighting(const PixelShaderKey& key, Value<vec3> ambie
 void Painter::ApplyMaterialLighting(Value<vec3> lightPosition, Value<vec3> lightColor)
 {
 	// направление на свет
-	Value<vec3> tmpToLight = normalize(lightPosition - iWorldPosition);
+	ApplyDirectionalMaterialLighting(normalize(lightPosition - tmpWorldPosition["xyz"]), lightColor);
+}
+
+void Painter::ApplyDirectionalMaterialLighting(Value<vec3> tmpToLight, Value<vec3> lightColor)
+{
 	// биссектриса между направлениями на свет и камеру
 	Value<vec3> tmpLightViewBissect = normalize(tmpToLight + tmpToCamera);
 	// диффузная составляющая
@@ -597,6 +1065,18 @@ void Painter::ApplyMaterialLighting(Value<vec3> lightPosition, Value<vec3> light
 	tmpColor += lightColor * (tmpDiffusePart + tmpSpecularPart);
 }
 
+Value<float> Painter::SampleShadow(Value<mat4x4> lightTransform, Sampler<float, 2>& shadowSampler)
+{
+	Value<vec4> shadowCoords = mul(lightTransform, tmpWorldPosition);
+	Value<float> lighted = (shadowCoords["z"] > val(0.0f)).Cast<float>();
+	Value<float> linearShadowZ = shadowCoords["z"];
+	//lighted = lighted * (linearShadowZ > Value<float>(0));
+	shadowCoords = shadowCoords / shadowCoords["w"];
+	lighted = lighted * (abs(shadowCoords["x"]) < val(1.0f)).Cast<float>() * (abs(shadowCoords["y"]) < val(1.0f)).Cast<float>();
+	Value<vec2> shadowCoordsXY = screenToTexture(shadowCoords["xy"]);
+	return lighted * saturate(exp(val(4.0f) * (shadowSampler.Sample(shadowCoordsXY) - linearShadowZ)));
+}
+
 ptr<VertexShader> Painter::GetVertexShader(const VertexShaderKey& key)
 {
 	// если есть в кэше, вернуть
@@ -611,9 +1091,9 @@ ptr<VertexShader> Painter::GetVertexShader(const VertexShaderKey& key)
 	GetWorldPositionAndNormal(key);
 
 	Expression e = (
-		setPosition(mul(uViewProj, tmpVertexPosition)),
+		setPosition(tmpVertexClipPosition),
 		iNormal.Set(tmpVertexNormal),
-		iTexcoord.Set(key.skinned ? aSkinnedTexcoord : aTexcoord),
+		iTexcoord.Set(key.skinned ? aSkinnedTexcoord : key.instanced ? aInstancedTexcoord : aTexcoord),
 		iWorldPosition.Set(tmpVertexPosition["xyz"])
 	);
 
@@ -637,11 +1117,9 @@ ptr<VertexShader> Painter::GetVertexShadowShader(const VertexShaderKey& key)
 
 	GetWorldPositionAndNormal(key);
 
-	Value<vec4> p = mul(uViewProj, tmpVertexPosition);
-
 	ptr<VertexShader> vertexShader = shaderCache->GetVertexShader(Expression((
-		setPosition(p),
-		iDepth.Set(p["z"])
+		setPosition(tmpVertexClipPosition),
+		iDepth.Set(tmpVertexClipPosition["z"])
 		)));
 
 	// добавить и вернуть
@@ -649,6 +1127,57 @@ ptr<VertexShader> Painter::GetVertexShadowShader(const VertexShaderKey& key)
 	return vertexShadowShaderCache.find(key)->second;
 }
 
+ptr<UniformGroup> Painter::GetMaterialUniforms(ptr<Material> material)
+{
+	std::unordered_map<int, MaterialUniforms>::iterator i = materialUniformsCache.find(material->id);
+	if(i == materialUniformsCache.end())
+		i = materialUniformsCache.insert(std::make_pair(material->id, MaterialUniforms(device))).first;
+
+	// перезалить, только если материал изменился
+	MaterialUniforms& materialUniforms = i->second;
+	if(materialUniforms.version != material->version)
+	{
+		materialUniforms.uDiffuse.Set(material->diffuse);
+		materialUniforms.uSpecular.Set(material->specular);
+		materialUniforms.uNormalCoordTransform.Set(material->normalCoordTransform);
+		materialUniforms.ug->Upload(context);
+		materialUniforms.version = material->version;
+	}
+
+	return materialUniforms.ug;
+}
+
+int Painter::GetMaterialVariant(ptr<Material> material)
+{
+	std::unordered_map<int, MaterialUniforms>::iterator i = materialUniformsCache.find(material->id);
+	if(i == materialUniformsCache.end())
+		i = materialUniformsCache.insert(std::make_pair(material->id, MaterialUniforms(device))).first;
+
+	// ключ материала может поменяться только вместе с версией
+	MaterialUniforms& materialUniforms = i->second;
+	if(materialUniforms.variantVersion != material->version)
+	{
+		MaterialKey key = material->GetKey();
+		std::unordered_map<MaterialKey, int, Hasher>::iterator j = materialVariants.find(key);
+		if(j == materialVariants.end())
+			j = materialVariants.insert(std::make_pair(key, (int)materialVariants.size())).first;
+		materialUniforms.variant = j->second;
+		materialUniforms.variantVersion = material->version;
+	}
+
+	return materialUniforms.variant;
+}
+
+/// Одинаковы ли у материалов текстуры и пиксельный шейдер.
+static bool SameMaterialBindings(ptr<Material> a, ptr<Material> b)
+{
+	return a == b || (
+		a->diffuseTexture == b->diffuseTexture &&
+		a->specularTexture == b->specularTexture &&
+		a->normalTexture == b->normalTexture &&
+		a->GetKey() == b->GetKey());
+}
+
 ptr<PixelShader> Painter::GetPixelShader(const PixelShaderKey& key)
 {
 	// если есть в кэше, вернуть
@@ -664,7 +1193,7 @@ ptr<PixelShader> Painter::GetPixelShader(const PixelShaderKey& key)
 	int shadowLightsCount = key.shadowLightsCount;
 
 	// получить вариант света
-	LightVariant& lightVariant = GetLightVariant(LightVariantKey(basicLightsCount, shadowLightsCount));
+	LightVariant& lightVariant = GetLightVariant(LightVariantKey(basicLightsCount, shadowLightsCount, key.sunLight));
 
 	// пиксельный шейдер
 	BeginMaterialLighting(key, lightVariant.uAmbientColor);
@@ -677,30 +1206,89 @@ ptr<PixelShader> Painter::GetPixelShader(const PixelShaderKey& key)
 		ApplyMaterialLighting(basicLight.uLightPosition, basicLight.uLightColor);
 	}
 
+	// учесть простые источники света своего кластера
+	if(key.clustered)
+	{
+		// кластер: плитка экрана и слой глубины (w - глубина в пространстве камеры)
+		Value<vec4> clusterCoords = mul(uViewProj, tmpWorldPosition);
+		Value<vec2> clusterScreen = saturate(clusterCoords["xy"] / clusterCoords["w"] * val(0.5f) + val(0.5f));
+		Value<float> clusterX = min(clusterScreen["x"] * val((float)clustersCountX), val(clustersCountX - 0.5f));
+		Value<float> clusterY = min(clusterScreen["y"] * val((float)clustersCountY), val(clustersCountY - 0.5f));
+		Value<float> clusterZ = min(max(log(clusterCoords["w"]) * uClusterDepthParams["x"] + uClusterDepthParams["y"], val(0.0f)), val(clustersCountZ - 0.5f));
+		Value<uint> cluster =
+			(clusterZ.Cast<uint>() * Value<uint>((uint)clustersCountY) + clusterY.Cast<uint>()) * Value<uint>((uint)clustersCountX) + clusterX.Cast<uint>();
+		// чётный кластер пары - в xy, нечётный - в zw
+		Value<uint> clusterPair = (cluster.Cast<float>() * val(0.5f)).Cast<uint>();
+		Value<float> clusterOdd = cluster.Cast<float>() - clusterPair.Cast<float>() * val(2.0f);
+		Value<vec4> clusterPairLights = uClusterLights[clusterPair];
+		Value<vec2> clusterPackedLights = clusterPairLights["xy"] + (clusterPairLights["zw"] - clusterPairLights["xy"]) * clusterOdd;
+
+		static const char* const components[] = { "x", "y" };
+		const float clusterLightBase = (float)(1 << clusterLightBits);
+		Value<float> packedLights;
+		for(int i = 0; i < clusterLightsCount; ++i)
+		{
+			// номера достаются из компоненты младшими разрядами вперёд;
+			// деление на степень двойки и отбрасывание дробной части точны
+			if(i % 4 == 0)
+				packedLights = clusterPackedLights[components[i / 4]];
+			Value<float> restLights = (packedLights * val(1.0f / clusterLightBase)).Cast<uint>().Cast<float>();
+			Value<uint> lightNumber = (packedLights - restLights * val(clusterLightBase)).Cast<uint>();
+			packedLights = restLights;
+			Value<vec4> lightPosition = uClusterLightPositions[lightNumber];
+			// плавное затухание до нуля на радиусе
+			Value<float> distance = length(lightPosition["xyz"] - iWorldPosition) * lightPosition["w"];
+			Value<float> window = saturate(val(1.0f) - distance * distance * distance * distance);
+			ApplyMaterialLighting(lightPosition["xyz"], uClusterLightColors[lightNumber]["xyz"] * (window * window));
+		}
+	}
+
 	// учесть все источники света с тенями
 	for(int i = 0; i < shadowLightsCount; ++i)
 	{
 		ShadowLight& shadowLight = lightVariant.shadowLights[i];
 
-		// тень
-		Value<vec4> shadowCoords = mul(shadowLight.uLightTransform, tmpWorldPosition);
-		Value<float> lighted = (shadowCoords["z"] > val(0.0f)).Cast<float>();
-		Value<float> linearShadowZ = shadowCoords["z"];
-		//lighted = lighted * (linearShadowZ > Value<float>(0));
-		shadowCoords = shadowCoords / shadowCoords["w"];
-		lighted = lighted * (abs(shadowCoords["x"]) < val(1.0f)).Cast<float>() * (abs(shadowCoords["y"]) < val(1.0f)).Cast<float>();
-		Value<vec2> shadowCoordsXY = screenToTexture(shadowCoords["xy"]);
-		Value<float> shadowMultiplier = lighted * saturate(exp(val(4.0f) * (shadowLight.uShadowSampler.Sample(shadowCoordsXY) - linearShadowZ)));
+		Value<float> shadowMultiplier = SampleShadow(shadowLight.uLightTransform, shadowLight.uShadowSampler);
 
 		ApplyMaterialLighting(shadowLight.uLightPosition, shadowLight.uLightColor * shadowMultiplier);
 	}
 
-	ptr<PixelShader> pixelShader = shaderCache->GetPixelShader((
+	// учесть направленный источник
+	if(key.sunLight)
+	{
+		SunLight& sun = lightVariant.sunLights[0];
+
+		// каскады перебираются от дальнего к ближнему, так что
+		// берётся самый ближний каскад, в который попадает точка;
+		// вне всех каскадов тени нет
+		Value<float> shadowMultiplier = 1.0f;
+		for(int i = sunCascadesCount - 1; i >= 0; --i)
+		{
+			SunCascade& cascade = sun.cascades[i];
+			Value<vec4> cascadeCoords = mul(cascade.uTransform, tmpWorldPosition);
+			cascadeCoords = cascadeCoords / cascadeCoords["w"];
+			Value<float> inCascade = (abs(cascadeCoords["x"]) < val(1.0f)).Cast<float>() * (abs(cascadeCoords["y"]) < val(1.0f)).Cast<float>();
+			shadowMultiplier = shadowMultiplier + (SampleShadow(cascade.uTransform, cascade.uShadowSampler) - shadowMultiplier) * inCascade;
+		}
+
+		ApplyDirectionalMaterialLighting(sun.uToLight, sun.uLightColor * shadowMultiplier);
+	}
+
+	Expression expression = (
 		iNormal,
 		iTexcoord,
 		iWorldPosition,
 		fragment(0, newvec4(tmpColor, tmpDiffuse["w"]))
-	));
+	);
+	// G-буфер: нормаль в октаэдрической развёртке, specular - только параметр экспоненты
+	if(key.deferred)
+		expression = (
+			expression,
+			fragment(1, newvec4(EncodeNormal(tmpNormal), 0.0f, 0.0f)),
+			fragment(2, newvec4(tmpDiffuse["xyz"], tmpSpecular["x"]))
+		);
+
+	ptr<PixelShader> pixelShader = shaderCache->GetPixelShader(expression);
 
 	// добавить и вернуть
 	pixelShaderCache.insert(std::make_pair(key, pixelShader));
@@ -713,7 +1301,9 @@ void Painter::BeginFrame(float frameTime)
 
 	models.clear();
 	skinnedModels.clear();
+	bakedSkinnedModels.clear();
 	lights.clear();
+	sunLight = false;
 }
 
 void Painter::SetCamera(const mat4x4& cameraViewProj, const vec3& cameraPosition)
@@ -721,6 +1311,9 @@ void Painter::SetCamera(const mat4x4& cameraViewProj, const vec3& cameraPosition
 	this->cameraViewProj = cameraViewProj;
 	this->cameraInvViewProj = fromEigen(toEigen(cameraViewProj).inverse().eval());
 	this->cameraPosition = cameraPosition;
+
+	Eigen::Vector4f farCenter = toEigen(cameraInvViewProj) * Eigen::Vector4f(0, 0, 1, 1);
+	cameraDirection = normalize(vec3(farCenter.x() / farCenter.w(), farCenter.y() / farCenter.w(), farCenter.z() / farCenter.w()) - cameraPosition);
 }
 
 void Painter::AddModel(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform)
@@ -728,228 +1321,904 @@ void Painter::AddModel(ptr<Material> material, ptr<Geometry> geometry, const mat
 	models.push_back(Model(material, geometry, worldTransform));
 }
 
-void Painter::AddSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationFrame> animationFrame)
+int Painter::AddPersistentModel(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform, bool dynamic)
 {
-	AddSkinnedModel(material, geometry, geometry, animationFrame);
+	int handle;
+	if(freePersistentModelHandles.empty())
+	{
+		handle = (int)persistentModelIndices.size();
+		persistentModelIndices.push_back(-1);
+	}
+	else
+	{
+		handle = freePersistentModelHandles.back();
+		freePersistentModelHandles.pop_back();
+	}
+
+	persistentModelIndices[handle] = (int)persistentModels.size();
+	persistentModels.push_back(Model(material, geometry, worldTransform, dynamic));
+	persistentModelHandles.push_back(handle);
+
+	persistentModelTreeDirty = true;
+
+	const Model& model = persistentModels.back();
+	if(!dynamic)
+		InvalidateStaticShadows(model.boundCenter, model.boundRadius);
+
+	return handle;
 }
 
-void Painter::AddSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<Geometry> shadowGeometry, ptr<BoneAnimationFrame> animationFrame)
+/// Совпадают ли матрицы.
+static bool SameTransform(const mat4x4& a, const mat4x4& b)
 {
-	skinnedModels.push_back(SkinnedModel(material, geometry, shadowGeometry, animationFrame));
+	for(int i = 0; i < 4; ++i)
+		for(int j = 0; j < 4; ++j)
+			if(a(i, j) != b(i, j))
+				return false;
+	return true;
 }
 
-void Painter::SetAmbientColor(const vec3& ambientColor)
+void Painter::SetPersistentModelTransform(int handle, const mat4x4& worldTransform)
 {
-	this->ambientColor = ambientColor;
+	int index = persistentModelIndices[handle];
+	Model& model = persistentModels[index];
+	// неподвижные модели не трогают ни кэши теней, ни иерархию
+	if(SameTransform(model.worldTransform, worldTransform))
+		return;
+	vec3 oldBoundCenter = model.boundCenter;
+	float oldBoundRadius = model.boundRadius;
+	model.SetWorldTransform(worldTransform);
+
+	// статическая модель сбрасывает кэши теней и на старом, и на новом месте
+	if(!model.dynamic)
+	{
+		InvalidateStaticShadows(oldBoundCenter, oldBoundRadius);
+		InvalidateStaticShadows(model.boundCenter, model.boundRadius);
+	}
+
+	// ограниченную модель достаточно обновить в иерархии
+	if(oldBoundRadius >= 0 && model.boundRadius >= 0)
+	{
+		if(!persistentModelTreeDirty)
+		{
+			persistentModelTree.Update(index, model.boundCenter, model.boundRadius);
+			// сферы предков только растут, так что разросшееся дерево перестраивается
+			if(persistentModelTree.NeedsRebuild())
+				persistentModelTreeDirty = true;
+		}
+	}
+	else
+		persistentModelTreeDirty = true;
 }
 
-void Painter::SetEnvironmentTexture(ptr<Texture> environmentTexture)
+void Painter::RemovePersistentModel(int handle)
 {
-	this->environmentTexture = environmentTexture;
+	// перенести последнюю модель на место удаляемой
+	int index = persistentModelIndices[handle];
+	int lastIndex = (int)persistentModels.size() - 1;
+	if(!persistentModels[index].dynamic)
+		InvalidateStaticShadows(persistentModels[index].boundCenter, persistentModels[index].boundRadius);
+	if(index != lastIndex)
+	{
+		persistentModels[index] = persistentModels[lastIndex];
+		persistentModelHandles[index] = persistentModelHandles[lastIndex];
+		persistentModelIndices[persistentModelHandles[index]] = index;
+	}
+	persistentModels.pop_back();
+	persistentModelHandles.pop_back();
+	persistentModelIndices[handle] = -1;
+	freePersistentModelHandles.push_back(handle);
+
+	persistentModelTreeDirty = true;
 }
 
-void Painter::AddBasicLight(const vec3& position, const vec3& color)
+void Painter::InvalidateStaticShadows(const vec3& center, float radius)
 {
-	lights.push_back(Light(position, color));
+	for(int i = 0; i < maxShadowLightsCount; ++i)
+		if(shadowCaches[i].valid && Frustum(shadowCaches[i].transform).Intersects(center, radius))
+			shadowCaches[i].valid = false;
 }
 
-void Painter::AddShadowLight(const vec3& position, const vec3& color, const mat4x4& transform)
+void Painter::AddSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationFrame> animationFrame)
 {
-	lights.push_back(Light(position, color, transform));
+	AddSkinnedModel(material, geometry, geometry, animationFrame);
 }
 
-void Painter::SetupPostprocess(float bloomLimit, float toneLuminanceKey, float toneMaxLuminance)
+void Painter::AddSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<Geometry> shadowGeometry, ptr<BoneAnimationFrame> animationFrame)
 {
-	this->bloomLimit = bloomLimit;
-	this->toneLuminanceKey = toneLuminanceKey;
-	this->toneMaxLuminance = toneMaxLuminance;
+	skinnedModels.push_back(SkinnedModel(material, geometry, shadowGeometry, animationFrame));
 }
 
-void Painter::Draw()
+void Painter::DrawSkinnedBatch(const SkinnedModel* models, int count, bool depthOnly, bool shadow)
 {
-	// получить количество простых и теневых источников света
-	int basicLightsCount = 0;
-	int shadowLightsCount = 0;
-	for(size_t i = 0; i < lights.size(); ++i)
-		++(lights[i].shadow ? shadowLightsCount : basicLightsCount);
-
-	// выполнить теневые проходы
-	int shadowPassNumber = 0;
-	for(size_t i = 0; i < lights.size(); ++i)
-		if(lights[i].shadow)
+	// одну модель рисуем без инстансинга, чтобы не заливать кости всех экземпляров
+	bool instanced = count > 1;
+	VertexShaderKey key(instanced, true);
+	ptr<UniformGroup> ug = instanced ? ugSkinnedInstancedModel : ugSkinnedModel;
+	UniformArray<vec4>& boneOrientations = instanced ? uInstancedBoneOrientations : uBoneOrientations;
+	UniformArray<vec4>& boneOffsets = instanced ? uInstancedBoneOffsets : uBoneOffsets;
+
+	// установить привязку атрибутов
+	Context::LetAttributeBinding lab(context, instanced ? abSkinnedInstanced : abSkinned);
+	// установить вершинный шейдер
+	Context::LetVertexShader lvs(context, depthOnly ? GetVertexShadowShader(key) : GetVertexShader(key));
+	// установить константный буфер
+	Context::LetUniformBuffer lubModel(context, ug);
+
+	// установить геометрию
+	ptr<Geometry> geometry = shadow ? models[0].shadowGeometry : models[0].geometry;
+	Context::LetVertexBuffer lvb(context, 0, geometry->GetVertexBuffer());
+	Context::LetIndexBuffer lib(context, geometry->GetIndexBuffer());
+
+	// установить uniform'ы костей; экземпляры лежат подряд по числу костей первого
+	int instanceBonesCount = (int)models[0].animationFrame->orientations.size();
+	for(int i = 0; i < count; ++i)
+	{
+		ptr<BoneAnimationFrame> animationFrame = models[i].animationFrame;
+		const std::vector<quat>& orientations = animationFrame->orientations;
+		const std::vector<vec3>& offsets = animationFrame->offsets;
+		int bonesCount = (int)orientations.size();
+#ifdef _DEBUG
+		if(bonesCount > maxBonesCount || (instanced && (bonesCount != instanceBonesCount || count * bonesCount > maxSkinnedInstancedBonesCount)))
+			THROW("Too many bones");
+#endif
+		int boneBase = i * instanceBonesCount;
+		for(int k = 0; k < bonesCount; ++k)
 		{
-			Context::LetViewport lv(context, shadowMapSize, shadowMapSize);
-			Context::LetFrameBuffer lfb(context, fbShadows[shadowPassNumber]);
-			Context::LetUniformBuffer lubCamera(context, ugCamera);
-			Context::LetPixelShader lps(context, psShadow);
+			boneOrientations.Set(boneBase + k, orientations[k]);
+			boneOffsets.Set(boneBase + k, vec4(offsets[k].x, offsets[k].y, offsets[k].z, 0));
+		}
+	}
+	if(instanced)
+		uInstancedBonesCount.Set((float)instanceBonesCount);
+	// и залить в GPU
+	ug->Upload(context);
+
+	// нарисовать
+	if(instanced)
+		skinnedInstancer->Draw(context, count);
+	else
+		context->Draw();
+}
 
-			ptr<RenderBuffer> rb = rbShadows[shadowPassNumber];
+int Painter::GetSkinnedBatchCapacity(const SkinnedModel& model)
+{
+	int bonesCount = std::max((int)model.animationFrame->orientations.size(), 1);
+	return std::max(std::min(maxSkinnedInstancedBonesCount / bonesCount, maxInstancesCount), 1);
+}
 
-			// указать трансформацию
-			uViewProj.Set(lights[i].transform);
-			ugCamera->Upload(context);
+void Painter::AddBakedSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationTexture> animationTexture, const vec3& position, const quat& orientation, float time)
+{
+	bakedSkinnedModels.push_back(BakedSkinnedModel(material, geometry, animationTexture, orientation,
+		vec4(position.x, position.y, position.z, animationTexture->GetFrame(time))));
+}
 
-			// очистить карту теней
-			context->ClearColor(0, vec4(1e8, 1e8, 1e8, 1e8));
-			context->ClearDepth(1.0f);
+void Painter::DrawBakedSkinnedBatch(const BakedSkinnedModel* models, int count, bool shadow)
+{
+	VertexShaderKey key(true, true, true);
+
+	// установить привязку атрибутов
+	Context::LetAttributeBinding lab(context, abSkinnedInstanced);
+	// установить вершинный шейдер
+	Context::LetVertexShader lvs(context, shadow ? GetVertexShadowShader(key) : GetVertexShader(key));
+	// установить константный буфер
+	Context::LetUniformBuffer lubModel(context, ugBakedSkinnedModel);
+
+	// установить геометрию и текстуру анимации
+	ptr<Geometry> geometry = models[0].geometry;
+	Context::LetVertexBuffer lvb(context, 0, geometry->GetVertexBuffer());
+	Context::LetIndexBuffer lib(context, geometry->GetIndexBuffer());
+	ptr<BoneAnimationTexture> animationTexture = models[0].animationTexture;
+	Context::LetSampler lsAnimation(context, uBoneAnimationSampler, animationTexture->GetTexture(device), ssPoint);
+
+	// установить uniform'ы экземпляров
+	for(int i = 0; i < count; ++i)
+	{
+		const quat& orientation = models[i].orientation;
+		uBakedOrientations.Set(i, vec4(orientation.x, orientation.y, orientation.z, orientation.w));
+		uBakedPositions.Set(i, models[i].position);
+	}
+	uBakedTexelSize.Set(vec2(1.0f / animationTexture->GetWidth(), 1.0f / animationTexture->GetHeight()));
+	ugBakedSkinnedModel->Upload(context);
 
-			// сортировщик моделей по геометрии
-			struct GeometrySorter
-			{
-				bool operator()(const Model& a, const Model& b) const
-				{
-					return a.geometry < b.geometry;
-				}
-				bool operator()(const SkinnedModel& a, const SkinnedModel& b) const
-				{
-					return a.shadowGeometry < b.shadowGeometry;
-				}
-			};
+	// нарисовать
+	skinnedInstancer->Draw(context, count);
+}
 
-			//** рисуем простые модели
+void Painter::SetAmbientColor(const vec3& ambientColor)
+{
+	this->ambientColor = ambientColor;
+}
 
-			// отсортировать объекты по геометрии
-			std::sort(models.begin(), models.end(), GeometrySorter());
+void Painter::SetEnvironmentTexture(ptr<Texture> environmentTexture)
+{
+	this->environmentTexture = environmentTexture;
+}
 
-			{
-				// установить привязку атрибутов
-				Context::LetAttributeBinding lab(context, abInstanced);
-				// установить вершинный шейдер
-				Context::LetVertexShader lvs(context, GetVertexShadowShader(VertexShaderKey(true, false)));
-				// установить константный буфер
-				Context::LetUniformBuffer lubModel(context, ugInstancedModel);
-
-				// нарисовать инстансингом с группировкой по геометрии
-				for(size_t j = 0; j < models.size(); )
-				{
-					// количество рисуемых объектов
-					int batchCount;
-					for(batchCount = 1;
-						batchCount < maxInstancesCount &&
-						j + batchCount < models.size() &&
-						models[j].geometry == models[j + batchCount].geometry;
-						++batchCount);
-
-					// установить геометрию
-					Context::LetVertexBuffer lvb(context, 0, models[j].geometry->GetVertexBuffer());
-					Context::LetIndexBuffer lib(context, models[j].geometry->GetIndexBuffer());
-					// установить uniform'ы
-					for(int k = 0; k < batchCount; ++k)
-						uWorlds.Set(k, models[j + k].worldTransform);
-					// и залить в GPU
-					ugInstancedModel->Upload(context);
-
-					// нарисовать
-					instancer->Draw(context, batchCount);
-
-					j += batchCount;
-				}
-			}
+void Painter::AddBasicLight(const vec3& position, const vec3& color, float radius)
+{
+	lights.push_back(Light(position, color, radius));
+}
 
-			//** рисуем skinned-модели
+void Painter::AddShadowLight(const vec3& position, const vec3& color, const mat4x4& transform)
+{
+	lights.push_back(Light(position, color, transform));
+}
 
-			// отсортировать объекты по геометрии
-			std::sort(skinnedModels.begin(), skinnedModels.end(), GeometrySorter());
+void Painter::SetSunLight(const vec3& direction, const vec3& color)
+{
+	sunLight = true;
+	sunDirection = normalize(direction);
+	sunColor = color;
+}
 
-			{
-				// установить привязку атрибутов
-				Context::LetAttributeBinding lab(context, abSkinned);
-				// установить вершинный шейдер
-				Context::LetVertexShader lvs(context, GetVertexShadowShader(VertexShaderKey(false, true)));
-				// установить константный буфер
-				Context::LetUniformBuffer lubModel(context, ugSkinnedModel);
-
-				// нарисовать с группировкой по геометрии
-				for(size_t j = 0; j < skinnedModels.size(); ++j)
-				{
-					const SkinnedModel& skinnedModel = skinnedModels[j];
-					// установить геометрию
-					Context::LetVertexBuffer lvb(context, 0, skinnedModel.shadowGeometry->GetVertexBuffer());
-					Context::LetIndexBuffer lib(context, skinnedModel.shadowGeometry->GetIndexBuffer());
-					// установить uniform'ы костей
-					ptr<BoneAnimationFrame> animationFrame = skinnedModel.animationFrame;
-					const std::vector<quat>& orientations = animationFrame->orientations;
-					const std::vector<vec3>& offsets = animationFrame->offsets;
-					int bonesCount = (int)orientations.size();
-#ifdef _DEBUG
-					if(bonesCount > maxBonesCount)
-						THROW("Too many bones");
-#endif
-					for(int k = 0; k < bonesCount; ++k)
-					{
-						uBoneOrientations.Set(k, orientations[k]);
-						uBoneOffsets.Set(k, vec4(offsets[k].x, offsets[k].y, offsets[k].z, 0));
-					}
-					// и залить в GPU
-					ugSkinnedModel->Upload(context);
+/// Слой кластеров для глубины в пространстве камеры.
+static int GetClusterSlice(float depth, float depthScale, float depthBias, int slicesCount)
+{
+	if(depth <= 0)
+		return 0;
+	return std::max(0, std::min(slicesCount - 1, (int)floor(log(depth) * depthScale + depthBias)));
+}
 
-					// нарисовать
-					context->Draw();
-				}
-			}
+/// Плитка кластеров для координаты экрана в [-1, 1].
+static int GetClusterTile(float screen, int tilesCount)
+{
+	return std::max(0, std::min(tilesCount - 1, (int)floor((screen * 0.5f + 0.5f) * tilesCount)));
+}
 
-			// выполнить размытие тени
-			{
-				Context::LetViewport lv(context, shadowMapSize, shadowMapSize);
-				Context::LetAttributeBinding lab(context, abFilter);
-				Context::LetVertexBuffer lvb(context, 0, vbFilter);
-				Context::LetIndexBuffer lib(context, ibFilter);
-				Context::LetVertexShader lvs(context, vsFilter);
-				Context::LetPixelShader lps(context, psShadowBlur);
-				Context::LetDepthStencilState ldss(context, dssPass);
+bool Painter::GetLightScreenRect(const Light& light, vec4& rect) const
+{
+	rect = vec4(-1, -1, 1, 1);
+	if(light.radius < 0)
+		return true;
+
+	// источник целиком позади камеры
+	if(dot(light.position - cameraPosition, cameraDirection) + light.radius <= 0)
+		return false;
+
+	// прямоугольник проекции ограничивающего куба
+	Eigen::Matrix4f viewProj = toEigen(cameraViewProj);
+	float minScreenX = 1, maxScreenX = -1, minScreenY = 1, maxScreenY = -1;
+	for(int j = 0; j < 8; ++j)
+	{
+		Eigen::Vector4f corner = viewProj * Eigen::Vector4f(
+			light.position.x + ((j & 1) ? light.radius : -light.radius),
+			light.position.y + ((j & 2) ? light.radius : -light.radius),
+			light.position.z + ((j & 4) ? light.radius : -light.radius),
+			1.0f);
+		// куб пересекает плоскость камеры
+		if(corner.w() <= 1e-4f)
+			return true;
+		float x = corner.x() / corner.w(), y = corner.y() / corner.w();
+		minScreenX = std::min(minScreenX, x);
+		maxScreenX = std::max(maxScreenX, x);
+		minScreenY = std::min(minScreenY, y);
+		maxScreenY = std::max(maxScreenY, y);
+	}
 
-				// первый проход
+	// источник вне экрана
+	if(maxScreenX < -1 || minScreenX > 1 || maxScreenY < -1 || minScreenY > 1)
+		return false;
 
-				{
-					Context::LetFrameBuffer lfb(context, fbShadowBlur1);
-					Context::LetSampler ls(context, uShadowBlurSourceSampler, rb->GetTexture(), ssPoint);
-					Context::LetUniformBuffer lub(context, ugShadowBlur);
+	rect = vec4(std::max(minScreenX, -1.0f), std::max(minScreenY, -1.0f), std::min(maxScreenX, 1.0f), std::min(maxScreenY, 1.0f));
+	return true;
+}
 
-					uShadowBlurDirection.Set(vec2(1.0f / shadowMapSize, 0));
-					ugShadowBlur->Upload(context);
+void Painter::BinClusteredLights()
+{
+	// логарифмическое разбиение по глубине, как в шейдере
+	float depthScale = clustersCountZ / log(clustersFar / clustersNear);
+	float depthBias = -log(clustersNear) * depthScale;
 
-					context->ClearColor(0, vec4(0, 0, 0, 0));
-					context->Draw();
-				}
+	clusterLights.assign(clustersCount * clusterLightsCount, maxClusteredLightsCount);
+	clusterLightCounts.assign(clustersCount, 0);
 
-				// второй проход
-				{
-					Context::LetFrameBuffer lfb(context, fbShadowBlurs[i]);
-					Context::LetSampler ls(context, uShadowBlurSourceSampler, rbShadowBlur->GetTexture(), ssPoint);
-					Context::LetUniformBuffer lub(context, ugShadowBlur);
+	int lightsCount = 0;
+	for(size_t i = 0; i < lights.size() && lightsCount < maxClusteredLightsCount; ++i)
+	{
+		const Light& light = lights[i];
+		if(light.shadow)
+			continue;
+
+		// диапазон задеваемых кластеров; неограниченный источник - во всех
+		int minX = 0, maxX = clustersCountX - 1;
+		int minY = 0, maxY = clustersCountY - 1;
+		int minZ = 0, maxZ = clustersCountZ - 1;
+		vec4 rect;
+		if(!GetLightScreenRect(light, rect))
+			continue;
+		if(light.radius >= 0)
+		{
+			float depth = dot(light.position - cameraPosition, cameraDirection);
+			minZ = GetClusterSlice(depth - light.radius, depthScale, depthBias, clustersCountZ);
+			maxZ = GetClusterSlice(depth + light.radius, depthScale, depthBias, clustersCountZ);
+			minX = GetClusterTile(rect.x, clustersCountX);
+			maxX = GetClusterTile(rect.z, clustersCountX);
+			minY = GetClusterTile(rect.y, clustersCountY);
+			maxY = GetClusterTile(rect.w, clustersCountY);
+		}
 
-					uShadowBlurDirection.Set(vec2(0, 1.0f / shadowMapSize));
-					ugShadowBlur->Upload(context);
+		int lightNumber = lightsCount++;
+		uClusterLightPositions.Set(lightNumber, vec4(light.position.x, light.position.y, light.position.z, light.radius > 0 ? 1.0f / light.radius : 0.0f));
+		uClusterLightColors.Set(lightNumber, vec4(light.color.x, light.color.y, light.color.z, 0));
 
-					context->ClearColor(0, vec4(0, 0, 0, 0));
-					context->Draw();
+		for(int z = minZ; z <= maxZ; ++z)
+			for(int y = minY; y <= maxY; ++y)
+				for(int x = minX; x <= maxX; ++x)
+				{
+					int cluster = (z * clustersCountY + y) * clustersCountX + x;
+					int& count = clusterLightCounts[cluster];
+					if(count < clusterLightsCount)
+						clusterLights[cluster * clusterLightsCount + count++] = lightNumber;
 				}
-			}
+	}
+
+	// пустой источник
+	uClusterLightPositions.Set(maxClusteredLightsCount, vec4(0, 0, 0, 0));
+	uClusterLightColors.Set(maxClusteredLightsCount, vec4(0, 0, 0, 0));
 
-			shadowPassNumber++;
+	// упаковать по 4 номера в компоненту, первый - в младшие разряды
+	float packedLights[4];
+	for(int i = 0; i < clustersCount / 2; ++i)
+	{
+		for(int j = 0; j < 4; ++j)
+		{
+			const int* numbers = &clusterLights[(i * 4 + j) * 4];
+			packedLights[j] = (float)(numbers[0] | (numbers[1] << clusterLightBits) | (numbers[2] << (clusterLightBits * 2)) | (numbers[3] << (clusterLightBits * 3)));
 		}
+		uClusterLights.Set(i, vec4(packedLights[0], packedLights[1], packedLights[2], packedLights[3]));
+	}
+	uClusterDepthParams.Set(vec4(depthScale, depthBias, 0, 0));
+	ugClusters->Upload(context);
+}
 
-	// основное рисование
+void Painter::SetupSunCascades()
+{
+	// дальние углы пирамиды камеры
+	vec3 farCorners[4];
+	for(int i = 0; i < 4; ++i)
+	{
+		Eigen::Vector4f corner = toEigen(cameraInvViewProj) * Eigen::Vector4f((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, 1.0f, 1.0f);
+		farCorners[i] = vec3(corner.x() / corner.w(), corner.y() / corner.w(), corner.z() / corner.w());
+	}
+	vec3 farCenter = (farCorners[0] + farCorners[1] + farCorners[2] + farCorners[3]) * 0.25f;
+	vec3 viewDirection = normalize(farCenter - cameraPosition);
+	float farDepth = dot(farCenter - cameraPosition, viewDirection);
+	float shadowDepth = std::min(sunShadowDistance, farDepth);
+
+	// границы каскадов по глубине: смесь логарифмического и равномерного разбиений
+	float splits[sunCascadesCount + 1];
+	splits[0] = 0;
+	for(int i = 1; i <= sunCascadesCount; ++i)
+	{
+		float t = (float)i / sunCascadesCount;
+		float logSplit = sunCascadesNear * pow(shadowDepth / sunCascadesNear, t);
+		float uniformSplit = sunCascadesNear + (shadowDepth - sunCascadesNear) * t;
+		splits[i] = sunCascadesSplitLambda * logSplit + (1 - sunCascadesSplitLambda) * uniformSplit;
+	}
+
+	// базис пространства источника
+	vec3 forward = sunDirection;
+	vec3 up = fabs(forward.z) < 0.99f ? vec3(0, 0, 1) : vec3(1, 0, 0);
+	vec3 right = normalize(cross(up, forward));
+	up = cross(forward, right);
 
-	// сортировщик моделей по материалу, а затем по геометрии
-	struct Sorter
+	for(int i = 0; i < sunCascadesCount; ++i)
 	{
-		bool operator()(const Model& a, const Model& b) const
+		// ограничивающая сфера куска пирамиды
+		vec3 corners[8];
+		vec3 center(0, 0, 0);
+		for(int j = 0; j < 4; ++j)
 		{
-			return a.material < b.material || (a.material == b.material && a.geometry < b.geometry);
+			vec3 ray = (farCorners[j] - cameraPosition) * (1.0f / farDepth);
+			corners[j * 2] = cameraPosition + ray * splits[i];
+			corners[j * 2 + 1] = cameraPosition + ray * splits[i + 1];
+			center = center + corners[j * 2] + corners[j * 2 + 1];
 		}
+		center = center * (1.0f / 8);
+		float radius = 0;
+		for(int j = 0; j < 8; ++j)
+			radius = std::max(radius, length(corners[j] - center));
+		// округлить радиус, чтобы погрешности не меняли размер текселя
+		radius = ceil(radius * 16) / 16;
+
+		// привязать центр к текселям
+		float texelSize = radius * 2 / shadowMapSize;
+		float centerX = floor(dot(center, right) / texelSize + 0.5f) * texelSize;
+		float centerY = floor(dot(center, up) / texelSize + 0.5f) * texelSize;
+		float nearZ = dot(center, forward) - radius - sunCasterDistance;
+		float depthRange = radius * 2 + sunCasterDistance;
+
+		// ортографическая проекция, умноженная на depthRange: после деления
+		// на w получается обычная ортографическая проекция, а z до деления -
+		// расстояние от ближней плоскости, как и у перспективных источников
+		float scale = depthRange / radius;
+		Eigen::Matrix4f m;
+		m <<
+			right.x * scale, right.y * scale, right.z * scale, -centerX * scale,
+			up.x * scale, up.y * scale, up.z * scale, -centerY * scale,
+			forward.x, forward.y, forward.z, -nearZ,
+			0, 0, 0, depthRange;
+		sunCascadeTransforms[i] = fromEigen(m);
+	}
+}
+
+void Painter::SetDepthPrepass(bool depthPrepass)
+{
+	this->depthPrepass = depthPrepass;
+}
+
+void Painter::SetFastShadowFilter(bool fastShadowFilter)
+{
+	if(this->fastShadowFilter == fastShadowFilter)
+		return;
+
+	this->fastShadowFilter = fastShadowFilter;
+	shadowMapSize = fastShadowFilter ? fastShadowMapSize : fullShadowMapSize;
+	CreateShadowMaps();
+}
+
+void Painter::SetClusteredLighting(bool clusteredLighting)
+{
+	this->clusteredLighting = clusteredLighting;
+}
+
+void Painter::SetDeferredShading(bool deferredShading)
+{
+	if(this->deferredShading == deferredShading)
+		return;
+
+	this->deferredShading = deferredShading;
+	// до первого Resize буферы ещё не созданы
+	if(screenWidth >= 0)
+		CreateGBuffer();
+}
+
+void Painter::SetupPostprocess(float bloomLimit, float toneLuminanceKey, float toneMaxLuminance)
+{
+	this->bloomLimit = bloomLimit;
+	this->toneLuminanceKey = toneLuminanceKey;
+	this->toneMaxLuminance = toneMaxLuminance;
+}
+
+void Painter::SetPyramidBloom(bool pyramidBloom)
+{
+	this->pyramidBloom = pyramidBloom;
+}
+
+int Painter::GetBloomFetchesCount() const
+{
+	if(!pyramidBloom)
+		// проход с ограничением и проход по y, затем ещё bloomPassesCount - 1 пар проходов
+		return (bloomPassesCount * 2) * bloomTapsCount * bloomMapSize * bloomMapSize;
+
+	int count = 0;
+	for(int i = 0; i < bloomPyramidLevelsCount; ++i)
+	{
+		// уменьшение в уровень i и увеличение из него
+		int size = bloomMapSize >> (i + 1);
+		count += size * size * 5 + size * size * 4 * 8;
+	}
+	return count;
+}
+
+template <typename ModelType>
+static void CullModelsOfType(const std::vector<ModelType>& models, const Frustum& frustum, std::vector<ModelType>& visibleModels)
+{
+	visibleModels.clear();
+	for(size_t i = 0; i < models.size(); ++i)
+		if(frustum.Intersects(models[i].boundCenter, models[i].boundRadius))
+			visibleModels.push_back(models[i]);
+}
+
+void Painter::CullModels(const Frustum& frustum)
+{
+	visibleModels.clear();
+	for(size_t i = 0; i < models.size(); ++i)
+		if(frustum.Intersects(models[i].boundCenter, models[i].boundRadius))
+			visibleModels.push_back(&models[i]);
+	visiblePersistentModels.clear();
+	persistentModelTree.Query(frustum, visiblePersistentModels);
+	for(size_t i = 0; i < visiblePersistentModels.size(); ++i)
+		visibleModels.push_back(&persistentModels[visiblePersistentModels[i]]);
+
+	CullModelsOfType(skinnedModels, frustum, visibleSkinnedModels);
+	CullModelsOfType(bakedSkinnedModels, frustum, visibleBakedSkinnedModels);
+}
+
+void Painter::DrawModelBatch(int first, int count)
+{
+	// установить геометрию
+	ptr<Geometry> geometry = visibleModels[first]->geometry;
+	Context::LetVertexBuffer lvb(context, 0, geometry->GetVertexBuffer());
+	Context::LetIndexBuffer lib(context, geometry->GetIndexBuffer());
+
+	// залить трансформации экземпляров
+	context->SetVertexBufferData(vbInstances, &visibleTransforms[first * 3], count * 3 * sizeof(vec4));
+	Context::LetVertexBuffer lvbInstances(context, 1, vbInstances);
+
+	// нарисовать
+	context->DrawInstanced(count);
+}
+
+bool Painter::MaterialSorter::operator()(const SkinnedModel& a, const SkinnedModel& b) const
+{
+	return a.material->id < b.material->id || (a.material == b.material && a.geometry->GetId() < b.geometry->GetId());
+}
+
+bool Painter::MaterialSorter::operator()(const BakedSkinnedModel& a, const BakedSkinnedModel& b) const
+{
+	return a.material->id < b.material->id || (a.material == b.material && (a.animationTexture < b.animationTexture ||
+		(a.animationTexture == b.animationTexture && a.geometry->GetId() < b.geometry->GetId())));
+}
+
+void Painter::DrawDepth(bool shadow)
+{
+	// сортировщик моделей по геометрии
+	struct GeometrySorter
+	{
+		bool shadow;
 		bool operator()(const SkinnedModel& a, const SkinnedModel& b) const
 		{
-			return a.material < b.material || (a.material == b.material && a.geometry < b.geometry);
+			return (shadow ? a.shadowGeometry : a.geometry)->GetId() < (shadow ? b.shadowGeometry : b.geometry)->GetId();
+		}
+		bool operator()(const BakedSkinnedModel& a, const BakedSkinnedModel& b) const
+		{
+			return a.animationTexture < b.animationTexture || (a.animationTexture == b.animationTexture && a.geometry->GetId() < b.geometry->GetId());
 		}
 	};
 
+	//** рисуем простые модели
+	// модели уже упорядочены по ключам рисования
+
+	{
+		// установить привязку атрибутов
+		Context::LetAttributeBinding lab(context, abInstanced);
+		// установить вершинный шейдер
+		Context::LetVertexShader lvs(context, GetVertexShadowShader(VertexShaderKey(true, false)));
+
+		// нарисовать инстансингом с группировкой по геометрии
+		for(int j = 0; j < (int)visibleModels.size(); )
+		{
+			// количество рисуемых объектов
+			int batchCount;
+			for(batchCount = 1;
+				batchCount < maxModelInstancesCount &&
+				j + batchCount < (int)visibleModels.size() &&
+				visibleModels[j]->geometry == visibleModels[j + batchCount]->geometry;
+				++batchCount);
+
+			DrawModelBatch(j, batchCount);
+
+			j += batchCount;
+		}
+	}
+
+	//** рисуем skinned-модели
+
+	// отсортировать объекты по геометрии; для предварительного прохода -
+	// как в основном, чтобы батчи (а значит, и варианты шейдера) совпадали
+	GeometrySorter geometrySorter = { shadow };
+	if(shadow)
+		std::sort(visibleSkinnedModels.begin(), visibleSkinnedModels.end(), geometrySorter);
+	else
+		std::sort(visibleSkinnedModels.begin(), visibleSkinnedModels.end(), MaterialSorter());
+
+	// нарисовать инстансингом с группировкой по геометрии
+	for(size_t j = 0; j < visibleSkinnedModels.size(); )
+	{
+		// количество рисуемых объектов
+		int batchCount;
+		for(batchCount = 1;
+			batchCount < GetSkinnedBatchCapacity(visibleSkinnedModels[j]) &&
+			j + batchCount < visibleSkinnedModels.size() &&
+			(shadow ? visibleSkinnedModels[j].shadowGeometry == visibleSkinnedModels[j + batchCount].shadowGeometry :
+				visibleSkinnedModels[j].material == visibleSkinnedModels[j + batchCount].material &&
+				visibleSkinnedModels[j].geometry == visibleSkinnedModels[j + batchCount].geometry);
+			++batchCount);
+
+		DrawSkinnedBatch(&visibleSkinnedModels[j], batchCount, true, shadow);
+
+		j += batchCount;
+	}
+
+	//** рисуем skinned-модели с текстурами анимации
+
+	// отсортировать объекты по текстуре анимации и геометрии
+	std::sort(visibleBakedSkinnedModels.begin(), visibleBakedSkinnedModels.end(), geometrySorter);
+
+	for(size_t j = 0; j < visibleBakedSkinnedModels.size(); )
+	{
+		// количество рисуемых объектов
+		int batchCount;
+		for(batchCount = 1;
+			batchCount < maxInstancesCount &&
+			j + batchCount < visibleBakedSkinnedModels.size() &&
+			visibleBakedSkinnedModels[j].animationTexture == visibleBakedSkinnedModels[j + batchCount].animationTexture &&
+			visibleBakedSkinnedModels[j].geometry == visibleBakedSkinnedModels[j + batchCount].geometry;
+			++batchCount);
+
+		DrawBakedSkinnedBatch(&visibleBakedSkinnedModels[j], batchCount, true);
+
+		j += batchCount;
+	}
+}
+
+/// Поразрядная сортировка 64-битных ключей.
+/** Байты, одинаковые у всех ключей, пропускаются. */
+static void RadixSort(std::vector<unsigned long long>& keys, std::vector<unsigned long long>& temp)
+{
+	size_t count = keys.size();
+	temp.resize(count);
+	for(int shift = 0; shift < 64; shift += 8)
 	{
-		Context::LetFrameBuffer lfb(context, fbOpaque);
+		size_t offsets[256] = { 0 };
+		for(size_t i = 0; i < count; ++i)
+			++offsets[(keys[i] >> shift) & 0xff];
+		if(offsets[(keys[0] >> shift) & 0xff] == count)
+			continue;
+		size_t offset = 0;
+		for(int i = 0; i < 256; ++i)
+		{
+			size_t c = offsets[i];
+			offsets[i] = offset;
+			offset += c;
+		}
+		for(size_t i = 0; i < count; ++i)
+			temp[offsets[(keys[i] >> shift) & 0xff]++] = keys[i];
+		keys.swap(temp);
+	}
+}
+
+void Painter::SortVisibleModels(const vec3& viewPosition)
+{
+	int count = (int)visibleModels.size();
+
+	drawKeys.resize(count);
+	for(int i = 0; i < count; ++i)
+	{
+		const Model& model = *visibleModels[i];
+		// ведро расстояния - в логарифмическом масштабе, подробнее вблизи
+		float distance = length(model.boundCenter - viewPosition);
+		unsigned long long depthBucket = (unsigned long long)std::min(255.0f, log2(1 + distance) * 32);
+		drawKeys[i] =
+			((unsigned long long)GetMaterialVariant(model.material) << 60) |
+			((unsigned long long)(model.material->id & 0x3fff) << 46) |
+			((unsigned long long)(model.geometry->GetId() & 0x3fff) << 32) |
+			(depthBucket << 24) |
+			(unsigned long long)i;
+	}
+
+	if(count > 1)
+		RadixSort(drawKeys, drawKeysTemp);
+
+	sortedModels.resize(count);
+	visibleTransforms.resize(count * 3);
+	for(int i = 0; i < count; ++i)
+	{
+		const Model* model = visibleModels[drawKeys[i] & 0xffffff];
+		sortedModels[i] = model;
+		const mat4x4& m = model->worldTransform;
+		for(int j = 0; j < 3; ++j)
+			visibleTransforms[i * 3 + j] = vec4(m(j, 0), m(j, 1), m(j, 2), m(j, 3));
+	}
+	visibleModels.swap(sortedModels);
+}
+
+void Painter::BlurShadowMap(ptr<RenderBuffer> rb, ptr<RenderBuffer> rbStatic, ptr<FrameBuffer> fbTarget)
+{
+	Context::LetViewport lv(context, shadowMapSize, shadowMapSize);
+	Context::LetAttributeBinding lab(context, abFilter);
+	Context::LetVertexBuffer lvb(context, 0, vbFilter);
+	Context::LetIndexBuffer lib(context, ibFilter);
+	Context::LetVertexShader lvs(context, vsFilter);
+	Context::LetDepthStencilState ldss(context, dssPass);
+
+	// быстрое размытие - один проход
+	if(fastShadowFilter)
+	{
+		Context::LetFrameBuffer lfb(context, fbTarget);
+		Context::LetPixelShader lps(context, rbStatic ? psShadowBlurFastComposite : psShadowBlurFast);
+		Context::LetSampler ls(context, uShadowBlurSourceSampler, rb->GetTexture(), ssPoint);
+		Context::LetSampler lsStatic;
+		if(rbStatic)
+			lsStatic(context, uShadowBlurStaticSampler, rbStatic->GetTexture(), ssPoint);
+		Context::LetUniformBuffer lub(context, ugShadowBlur);
+
+		uShadowBlurDirection.Set(vec2(1.0f / shadowMapSize, 1.0f / shadowMapSize));
+		ugShadowBlur->Upload(context);
+
+		context->ClearColor(0, vec4(0, 0, 0, 0));
+		context->Draw();
+		return;
+	}
+
+	// первый проход, с наложением статической карты
+
+	{
+		Context::LetFrameBuffer lfb(context, fbShadowBlur1);
+		Context::LetPixelShader lps(context, rbStatic ? psShadowBlurComposite : psShadowBlur);
+		Context::LetSampler ls(context, uShadowBlurSourceSampler, rb->GetTexture(), ssPoint);
+		Context::LetSampler lsStatic;
+		if(rbStatic)
+			lsStatic(context, uShadowBlurStaticSampler, rbStatic->GetTexture(), ssPoint);
+		Context::LetUniformBuffer lub(context, ugShadowBlur);
+
+		uShadowBlurDirection.Set(vec2(1.0f / shadowMapSize, 0));
+		ugShadowBlur->Upload(context);
+
+		context->ClearColor(0, vec4(0, 0, 0, 0));
+		context->Draw();
+	}
+
+	// второй проход
+	{
+		Context::LetFrameBuffer lfb(context, fbTarget);
+		Context::LetPixelShader lps(context, psShadowBlur);
+		Context::LetSampler ls(context, uShadowBlurSourceSampler, rbShadowBlur->GetTexture(), ssPoint);
+		Context::LetUniformBuffer lub(context, ugShadowBlur);
+
+		uShadowBlurDirection.Set(vec2(0, 1.0f / shadowMapSize));
+		ugShadowBlur->Upload(context);
+
+		context->ClearColor(0, vec4(0, 0, 0, 0));
+		context->Draw();
+	}
+}
+
+void Painter::Draw()
+{
+	// перестроить иерархию постоянных моделей
+	if(persistentModelTreeDirty)
+	{
+		std::vector<vec3> centers(persistentModels.size());
+		std::vector<float> radii(persistentModels.size());
+		for(size_t i = 0; i < persistentModels.size(); ++i)
+		{
+			centers[i] = persistentModels[i].boundCenter;
+			radii[i] = persistentModels[i].boundRadius;
+		}
+		persistentModelTree.Build(centers, radii);
+		persistentModelTreeDirty = false;
+	}
+
+	// получить количество простых и теневых источников света
+	int basicLightsCount = 0;
+	int shadowLightsCount = 0;
+	for(size_t i = 0; i < lights.size(); ++i)
+		++(lights[i].shadow ? shadowLightsCount : basicLightsCount);
+	// при отложенном освещении точечные источники считаются отдельными проходами,
+	// а кластеры не нужны
+	bool clustered = clusteredLighting && !deferredShading;
+	if(deferredShading)
+		shadowLightsCount = 0;
+	// в кластерном и отложенном режимах простые источники не входят в вариант света
+	if(clustered || deferredShading)
+		basicLightsCount = 0;
+
+	// выполнить теневые проходы
+	// статические модели рисуются в кэшированную карту, только когда она устарела;
+	// динамические - каждый кадр в общую карту, которая накладывается на статическую при размытии;
+	// если ничего не изменилось, размытая карта остаётся с прошлого кадра
+	int shadowPassNumber = 0;
+	for(size_t i = 0; i < lights.size(); ++i)
+		if(lights[i].shadow)
+		{
+			int slot = shadowPassNumber++;
+			ShadowCache& cache = shadowCaches[slot];
+
+			// источник сдвинулся - статическая карта устарела
+			if(cache.valid && !SameTransform(cache.transform, lights[i].transform))
+				cache.valid = false;
+
+			// отобрать модели, попадающие в карту теней, и отделить статические
+			CullModels(Frustum(lights[i].transform));
+			shadowStaticModels.clear();
+			size_t dynamicModelsCount = 0;
+			for(size_t j = 0; j < visibleModels.size(); ++j)
+				if(visibleModels[j]->dynamic)
+					visibleModels[dynamicModelsCount++] = visibleModels[j];
+				else
+					shadowStaticModels.push_back(visibleModels[j]);
+			visibleModels.resize(dynamicModelsCount);
+			bool dynamic = dynamicModelsCount > 0 || !visibleSkinnedModels.empty() || !visibleBakedSkinnedModels.empty();
+
+			if(cache.valid && !dynamic && !cache.dynamic)
+				continue;
+
+			Context::LetViewport lv(context, shadowMapSize, shadowMapSize);
+			Context::LetUniformBuffer lubCamera(context, ugCamera);
+			Context::LetPixelShader lps(context, psShadow);
+
+			// указать трансформацию
+			uViewProj.Set(lights[i].transform);
+			ugCamera->Upload(context);
+
+			// нарисовать динамические модели
+			if(dynamic)
+			{
+				Context::LetFrameBuffer lfb(context, fbShadowDepth);
+
+				SortVisibleModels(lights[i].position);
+
+				context->ClearColor(0, vec4(1e8, 1e8, 1e8, 1e8));
+				context->ClearDepth(1.0f);
+
+				DrawDepth(true);
+			}
+
+			// перерисовать статические модели
+			if(!cache.valid)
+			{
+				Context::LetFrameBuffer lfb(context, fbStaticShadows[slot]);
+
+				visibleModels.swap(shadowStaticModels);
+				visibleSkinnedModels.clear();
+				visibleBakedSkinnedModels.clear();
+				SortVisibleModels(lights[i].position);
+
+				context->ClearColor(0, vec4(1e8, 1e8, 1e8, 1e8));
+				context->ClearDepth(1.0f);
+
+				DrawDepth(true);
+
+				cache.transform = lights[i].transform;
+				cache.valid = true;
+			}
+			cache.dynamic = dynamic;
+
+			// выполнить размытие тени, наложив динамические модели на статические
+			if(dynamic)
+				BlurShadowMap(rbShadowDepth, rbStaticShadows[slot], fbShadows[slot]);
+			else
+				BlurShadowMap(rbStaticShadows[slot], 0, fbShadows[slot]);
+		}
+
+	// выполнить проходы каскадов направленного источника
+	if(sunLight)
+	{
+		SetupSunCascades();
+
+		for(int i = 0; i < sunCascadesCount; ++i)
+		{
+			{
+				Context::LetViewport lv(context, shadowMapSize, shadowMapSize);
+				Context::LetFrameBuffer lfb(context, fbShadowDepth);
+				Context::LetUniformBuffer lubCamera(context, ugCamera);
+				Context::LetPixelShader lps(context, psShadow);
+
+				// указать трансформацию
+				uViewProj.Set(sunCascadeTransforms[i]);
+				ugCamera->Upload(context);
+
+				// отобрать модели, попадающие в каскад
+				CullModels(Frustum(sunCascadeTransforms[i]));
+				SortVisibleModels(cameraPosition - sunDirection * sunCasterDistance);
+
+				// очистить карту теней
+				context->ClearColor(0, vec4(1e8, 1e8, 1e8, 1e8));
+				context->ClearDepth(1.0f);
+
+				// нарисовать модели
+				DrawDepth(true);
+			}
+
+			BlurShadowMap(rbShadowDepth, 0, fbSunCascades[i]);
+		}
+	}
+
+	// основное рисование
+
+	{
+		Context::LetFrameBuffer lfb(context, deferredShading ? fbGBuffer : fbOpaque);
 		Context::LetViewport lv(context, screenWidth, screenHeight);
 		Context::LetDepthStencilState ldss(context, dssNormal);
 		Context::LetUniformBuffer lubCamera(context, ugCamera);
 
+		// отобрать видимые модели
+		CullModels(Frustum(cameraViewProj));
+		SortVisibleModels(cameraPosition);
+
 		// установить uniform'ы камеры
 		uViewProj.Set(cameraViewProj);
 		uInvViewProj.Set(cameraInvViewProj);
@@ -957,14 +2226,14 @@ void Painter::Draw()
 		ugCamera->Upload(context);
 
 		// установить параметры источников света
-		LightVariant& lightVariant = GetLightVariant(LightVariantKey(basicLightsCount, shadowLightsCount));
+		LightVariant& lightVariant = GetLightVariant(LightVariantKey(basicLightsCount, shadowLightsCount, sunLight));
 		Context::LetUniformBuffer lubLight(context, lightVariant.ugLight);
 
 		lightVariant.uAmbientColor.Set(ambientColor);
 		int basicLightNumber = 0;
 		int shadowLightNumber = 0;
 		Context::LetSampler ls[maxShadowLightsCount];
-		for(size_t i = 0; i < lights.size(); ++i)
+		for(size_t i = 0; i < lights.size() && !deferredShading; ++i)
 			if(lights[i].shadow)
 			{
 				ShadowLight& shadowLight = lightVariant.shadowLights[shadowLightNumber];
@@ -976,143 +2245,287 @@ void Painter::Draw()
 
 				shadowLightNumber++;
 			}
-			else
+			else if(!clustered)
 			{
 				BasicLight& basicLight = lightVariant.basicLights[basicLightNumber++];
 				basicLight.uLightPosition.Set(lights[i].position);
 				basicLight.uLightColor.Set(lights[i].color);
 			}
+		Context::LetSampler lsSun[sunCascadesCount];
+		if(sunLight)
+		{
+			SunLight& sun = lightVariant.sunLights[0];
+			sun.uToLight.Set(sunDirection * -1.0f);
+			sun.uLightColor.Set(sunColor);
+			for(int i = 0; i < sunCascadesCount; ++i)
+			{
+				sun.cascades[i].uTransform.Set(sunCascadeTransforms[i]);
+				lsSun[i](context, sun.cascades[i].uShadowSampler, rbSunCascades[i]->GetTexture(), shadowSamplerState);
+			}
+		}
 		lightVariant.ugLight->Upload(context);
 
+		// распределить простые источники по кластерам
+		Context::LetUniformBuffer lubClusters;
+		if(clustered)
+		{
+			BinClusteredLights();
+			lubClusters(context, ugClusters);
+		}
+
+		// текстура окружения общая для всех материалов
+		Context::LetSampler lsEnvironment(context, uEnvironmentSampler, environmentTexture, ssColorTexture);
+
 		// очистить рендербуферы
 		context->ClearColor(0, vec4(0, 0, 0, 1)); // color
-		context->ClearColor(1, vec4(0, 0, 0, 1)); // normal
+		if(deferredShading)
+		{
+			context->ClearColor(1, vec4(0, 0, 0, 1)); // normal
+			context->ClearColor(2, vec4(0, 0, 0, 0)); // albedo
+		}
 		context->ClearDepth(1.0f);
 
-		//** нарисовать простые модели
+		// предварительный проход глубины теми же шейдерами, что и для теней,
+		// в фреймбуфер без цветовых буферов;
+		// дальше освещение считается только для видимых пикселей
+		if(depthPrepass)
 		{
-			std::sort(models.begin(), models.end(), Sorter());
+			Context::LetFrameBuffer lfbDepth(context, fbDepthPrepass);
+			Context::LetPixelShader lps(context, psShadow);
+			DrawDepth(false);
+		}
+		Context::LetDepthStencilState ldssShading(context, depthPrepass ? dssEqual : dssNormal);
 
+		//** нарисовать простые модели
+		{
 			// установить привязку атрибутов
 			Context::LetAttributeBinding lab(context, abInstanced);
 			// установить вершинный шейдер
 			Context::LetVertexShader lvs(context, GetVertexShader(VertexShaderKey(true, false)));
-			// установить константный буфер
-			Context::LetUniformBuffer lubModel(context, ugInstancedModel);
-			// установить материал
-			Context::LetUniformBuffer lubMaterial(context, ugMaterial);
 
 			// нарисовать
-			for(size_t i = 0; i < models.size(); )
+			for(int i = 0; i < (int)visibleModels.size(); )
 			{
-				// выяснить размер батча по материалу
-				ptr<Material> material = models[i].material;
-				int materialBatchCount;
-				for(materialBatchCount = 1;
-					i + materialBatchCount < models.size() &&
-					material == models[i + materialBatchCount].material;
-					++materialBatchCount);
-
-				// установить параметры материала
-				Context::LetSampler lsDiffuse(context, uDiffuseSampler, material->diffuseTexture, ssColorTexture);
-				Context::LetSampler lsSpecular(context, uSpecularSampler, material->specularTexture, ssColorTexture);
-				Context::LetSampler lsNormal(context, uNormalSampler, material->normalTexture, ssColorTexture);
-				Context::LetSampler lsEnvironment(context, uEnvironmentSampler, environmentTexture, ssColorTexture);
-				uDiffuse.Set(material->diffuse);
-				uSpecular.Set(material->specular);
-				uNormalCoordTransform.Set(material->normalCoordTransform);
-				ugMaterial->Upload(context);
+				// выяснить размер батча по текстурам и шейдеру материала
+				ptr<Material> bindingMaterial = visibleModels[i]->material;
+				int bindingBatchCount;
+				for(bindingBatchCount = 1;
+					i + bindingBatchCount < (int)visibleModels.size() &&
+					SameMaterialBindings(bindingMaterial, visibleModels[i + bindingBatchCount]->material);
+					++bindingBatchCount);
+
+				// установить текстуры материала
+				Context::LetSampler lsDiffuse(context, uDiffuseSampler, bindingMaterial->diffuseTexture, ssColorTexture);
+				Context::LetSampler lsSpecular(context, uSpecularSampler, bindingMaterial->specularTexture, ssColorTexture);
+				Context::LetSampler lsNormal(context, uNormalSampler, bindingMaterial->normalTexture, ssColorTexture);
 
 				// рисуем инстансингом обычные модели
 				// установить пиксельный шейдер
-				Context::LetPixelShader lps(context, GetPixelShader(PixelShaderKey(basicLightsCount, shadowLightsCount, material->GetKey())));
-				// цикл по батчам по геометрии
-				for(int j = 0; j < materialBatchCount; )
+				Context::LetPixelShader lps(context, GetPixelShader(PixelShaderKey(basicLightsCount, shadowLightsCount, sunLight, clustered, deferredShading, bindingMaterial->GetKey())));
+
+				// цикл по батчам по материалу
+				for(int j = 0; j < bindingBatchCount; )
 				{
-					// выяснить размер батча по геометрии
-					ptr<Geometry> geometry = models[i + j].geometry;
-					int geometryBatchCount;
-					for(geometryBatchCount = 1;
-						geometryBatchCount < maxInstancesCount &&
-						j + geometryBatchCount < materialBatchCount &&
-						geometry == models[i + j + geometryBatchCount].geometry;
-						++geometryBatchCount);
-
-					// установить геометрию
-					Context::LetVertexBuffer lvb(context, 0, geometry->GetVertexBuffer());
-					Context::LetIndexBuffer lib(context, geometry->GetIndexBuffer());
-
-					// установить uniform'ы
-					for(int k = 0; k < geometryBatchCount; ++k)
-						uWorlds.Set(k, models[i + j + k].worldTransform);
-					ugInstancedModel->Upload(context);
-
-					// нарисовать
-					instancer->Draw(context, geometryBatchCount);
-
-					j += geometryBatchCount;
+					// выяснить размер батча по материалу
+					ptr<Material> material = visibleModels[i + j]->material;
+					int materialBatchCount;
+					for(materialBatchCount = 1;
+						j + materialBatchCount < bindingBatchCount &&
+						material == visibleModels[i + j + materialBatchCount]->material;
+						++materialBatchCount);
+
+					// установить uniform-буфер материала (заливается, только если материал изменился)
+					Context::LetUniformBuffer lubMaterial(context, GetMaterialUniforms(material));
+
+					// цикл по батчам по геометрии
+					for(int k = 0; k < materialBatchCount; )
+					{
+						// выяснить размер батча по геометрии
+						ptr<Geometry> geometry = visibleModels[i + j + k]->geometry;
+						int geometryBatchCount;
+						for(geometryBatchCount = 1;
+							geometryBatchCount < maxModelInstancesCount &&
+							k + geometryBatchCount < materialBatchCount &&
+							geometry == visibleModels[i + j + k + geometryBatchCount]->geometry;
+							++geometryBatchCount);
+
+						DrawModelBatch(i + j + k, geometryBatchCount);
+
+						k += geometryBatchCount;
+					}
+
+					j += materialBatchCount;
 				}
 
-				i += materialBatchCount;
+				i += bindingBatchCount;
 			}
 		}
 
 		//** нарисовать skinned-модели
 		{
-			std::sort(skinnedModels.begin(), skinnedModels.end(), Sorter());
+			std::sort(visibleSkinnedModels.begin(), visibleSkinnedModels.end(), MaterialSorter());
 
-			// установить привязку атрибутов
-			Context::LetAttributeBinding lab(context, abSkinned);
-			// установить вершинный шейдер
-			Context::LetVertexShader lvs(context, GetVertexShader(VertexShaderKey(false, true)));
-			// установить константный буфер
-			Context::LetUniformBuffer lubModel(context, ugSkinnedModel);
-			// установить материал
-			Context::LetUniformBuffer lubMaterial(context, ugMaterial);
+			// нарисовать
+			for(size_t i = 0; i < visibleSkinnedModels.size(); )
+			{
+				// выяснить размер батча по текстурам и шейдеру материала
+				ptr<Material> bindingMaterial = visibleSkinnedModels[i].material;
+				int bindingBatchCount;
+				for(bindingBatchCount = 1;
+					i + bindingBatchCount < visibleSkinnedModels.size() &&
+					SameMaterialBindings(bindingMaterial, visibleSkinnedModels[i + bindingBatchCount].material);
+					++bindingBatchCount);
+
+				// установить текстуры материала
+				Context::LetSampler lsDiffuse(context, uDiffuseSampler, bindingMaterial->diffuseTexture, ssColorTexture);
+				Context::LetSampler lsSpecular(context, uSpecularSampler, bindingMaterial->specularTexture, ssColorTexture);
+				Context::LetSampler lsNormal(context, uNormalSampler, bindingMaterial->normalTexture, ssColorTexture);
+
+				// установить пиксельный шейдер
+				Context::LetPixelShader lps(context, GetPixelShader(PixelShaderKey(basicLightsCount, shadowLightsCount, sunLight, clustered, deferredShading, bindingMaterial->GetKey())));
+
+				// цикл по батчам по материалу
+				for(int j = 0; j < bindingBatchCount; )
+				{
+					// выяснить размер батча по материалу
+					ptr<Material> material = visibleSkinnedModels[i + j].material;
+					int materialBatchCount;
+					for(materialBatchCount = 1;
+						j + materialBatchCount < bindingBatchCount &&
+						material == visibleSkinnedModels[i + j + materialBatchCount].material;
+						++materialBatchCount);
+
+					// установить uniform-буфер материала (заливается, только если материал изменился)
+					Context::LetUniformBuffer lubMaterial(context, GetMaterialUniforms(material));
+
+					// цикл по батчам по геометрии
+					for(int k = 0; k < materialBatchCount; )
+					{
+						// выяснить размер батча по геометрии
+						ptr<Geometry> geometry = visibleSkinnedModels[i + j + k].geometry;
+						int geometryBatchCount;
+						for(geometryBatchCount = 1;
+							geometryBatchCount < GetSkinnedBatchCapacity(visibleSkinnedModels[i + j + k]) &&
+							k + geometryBatchCount < materialBatchCount &&
+							geometry == visibleSkinnedModels[i + j + k + geometryBatchCount].geometry;
+							++geometryBatchCount);
+
+						DrawSkinnedBatch(&visibleSkinnedModels[i + j + k], geometryBatchCount, false, false);
+
+						k += geometryBatchCount;
+					}
+
+					j += materialBatchCount;
+				}
+
+				i += bindingBatchCount;
+			}
+		}
+
+		//** нарисовать skinned-модели с текстурами анимации
+		{
+			std::sort(visibleBakedSkinnedModels.begin(), visibleBakedSkinnedModels.end(), MaterialSorter());
 
 			// нарисовать
-			for(size_t i = 0; i < skinnedModels.size(); ++i)
+			for(size_t i = 0; i < visibleBakedSkinnedModels.size(); )
 			{
-				const SkinnedModel& skinnedModel = skinnedModels[i];
-
-				// установить параметры материала
-				ptr<Material> material = skinnedModel.material;
-				Context::LetSampler lsDiffuse(context, uDiffuseSampler, material->diffuseTexture, ssColorTexture);
-				Context::LetSampler lsSpecular(context, uSpecularSampler, material->specularTexture, ssColorTexture);
-				Context::LetSampler lsNormal(context, uNormalSampler, material->normalTexture, ssColorTexture);
-				Context::LetSampler lsEnvironment(context, uEnvironmentSampler, environmentTexture, ssColorTexture);
-				uDiffuse.Set(material->diffuse);
-				uSpecular.Set(material->specular);
-				uNormalCoordTransform.Set(material->normalCoordTransform);
-				ugMaterial->Upload(context);
+				// выяснить размер батча по текстурам и шейдеру материала
+				ptr<Material> bindingMaterial = visibleBakedSkinnedModels[i].material;
+				int bindingBatchCount;
+				for(bindingBatchCount = 1;
+					i + bindingBatchCount < visibleBakedSkinnedModels.size() &&
+					SameMaterialBindings(bindingMaterial, visibleBakedSkinnedModels[i + bindingBatchCount].material);
+					++bindingBatchCount);
+
+				// установить текстуры материала
+				Context::LetSampler lsDiffuse(context, uDiffuseSampler, bindingMaterial->diffuseTexture, ssColorTexture);
+				Context::LetSampler lsSpecular(context, uSpecularSampler, bindingMaterial->specularTexture, ssColorTexture);
+				Context::LetSampler lsNormal(context, uNormalSampler, bindingMaterial->normalTexture, ssColorTexture);
 
 				// установить пиксельный шейдер
-				Context::LetPixelShader lps(context, GetPixelShader(PixelShaderKey(basicLightsCount, shadowLightsCount, material->GetKey())));
-
-				// установить геометрию
-				ptr<Geometry> geometry = skinnedModel.geometry;
-				Context::LetVertexBuffer lvb(context, 0, geometry->GetVertexBuffer());
-				Context::LetIndexBuffer lib(context, geometry->GetIndexBuffer());
-
-				// установить uniform'ы костей
-				ptr<BoneAnimationFrame> animationFrame = skinnedModel.animationFrame;
-				const std::vector<quat>& orientations = animationFrame->orientations;
-				const std::vector<vec3>& offsets = animationFrame->offsets;
-				int bonesCount = (int)orientations.size();
-#ifdef _DEBUG
-				if(bonesCount > maxBonesCount)
-					THROW("Too many bones");
-#endif
-				for(int k = 0; k < bonesCount; ++k)
+				Context::LetPixelShader lps(context, GetPixelShader(PixelShaderKey(basicLightsCount, shadowLightsCount, sunLight, clustered, deferredShading, bindingMaterial->GetKey())));
+
+				// цикл по батчам по материалу
+				for(int j = 0; j < bindingBatchCount; )
 				{
-					uBoneOrientations.Set(k, orientations[k]);
-					uBoneOffsets.Set(k, vec4(offsets[k].x, offsets[k].y, offsets[k].z, 0));
+					// выяснить размер батча по материалу
+					ptr<Material> material = visibleBakedSkinnedModels[i + j].material;
+					int materialBatchCount;
+					for(materialBatchCount = 1;
+						j + materialBatchCount < bindingBatchCount &&
+						material == visibleBakedSkinnedModels[i + j + materialBatchCount].material;
+						++materialBatchCount);
+
+					// установить uniform-буфер материала (заливается, только если материал изменился)
+					Context::LetUniformBuffer lubMaterial(context, GetMaterialUniforms(material));
+
+					// цикл по батчам по текстуре анимации и геометрии
+					for(int k = 0; k < materialBatchCount; )
+					{
+						const BakedSkinnedModel& first = visibleBakedSkinnedModels[i + j + k];
+						int batchCount;
+						for(batchCount = 1;
+							batchCount < maxInstancesCount &&
+							k + batchCount < materialBatchCount &&
+							first.animationTexture == visibleBakedSkinnedModels[i + j + k + batchCount].animationTexture &&
+							first.geometry == visibleBakedSkinnedModels[i + j + k + batchCount].geometry;
+							++batchCount);
+
+						DrawBakedSkinnedBatch(&first, batchCount, false);
+
+						k += batchCount;
+					}
+
+					j += materialBatchCount;
 				}
-				ugSkinnedModel->Upload(context);
 
-				// нарисовать
-				context->Draw();
+				i += bindingBatchCount;
+			}
+		}
+	}
+
+	// отложенное освещение: каждый точечный источник добавляется проходом
+	// по своему прямоугольнику экрана
+	if(deferredShading)
+	{
+		Context::LetFrameBuffer lfb(context, fbDeferredLighting);
+		Context::LetViewport lv(context, screenWidth, screenHeight);
+		Context::LetAttributeBinding lab(context, abFilter);
+		Context::LetVertexBuffer lvb(context, 0, vbFilter);
+		Context::LetIndexBuffer lib(context, ibFilter);
+		Context::LetVertexShader lvs(context, vsDeferredLight);
+		Context::LetDepthStencilState ldss(context, dssPass);
+		Context::LetBlendState lbs(context, bsAdditive);
+		Context::LetUniformBuffer lubCamera(context, ugCamera);
+		Context::LetUniformBuffer lubLight(context, ugDeferredLight);
+		Context::LetSampler lsDepth(context, uDeferredDepthSampler, dsbDepth->GetTexture(), ssPoint);
+		Context::LetSampler lsNormal(context, uDeferredNormalSampler, rbScreenNormal->GetTexture(), ssPoint);
+		Context::LetSampler lsAlbedo(context, uDeferredAlbedoSampler, rbScreenAlbedo->GetTexture(), ssPoint);
+
+		int shadowLightNumber = 0;
+		for(size_t i = 0; i < lights.size(); ++i)
+		{
+			const Light& light = lights[i];
+
+			// источник с тенью ограничен только своей картой теней
+			vec4 rect(-1, -1, 1, 1);
+			if(!light.shadow && !GetLightScreenRect(light, rect))
+				continue;
+
+			uDeferredLightPosition.Set(vec4(light.position.x, light.position.y, light.position.z, light.radius > 0 ? 1.0f / light.radius : 0.0f));
+			uDeferredLightColor.Set(light.color);
+			uDeferredLightRect.Set(rect);
+
+			Context::LetSampler lsShadow;
+			if(light.shadow)
+			{
+				uDeferredLightTransform.Set(light.transform);
+				lsShadow(context, uDeferredShadowSampler, rbShadows[shadowLightNumber++]->GetTexture(), shadowSamplerState);
 			}
+			ugDeferredLight->Upload(context);
+
+			Context::LetPixelShader lps(context, light.shadow ? psDeferredShadowLight : psDeferredLight);
+			context->Draw();
 		}
 	}
 
@@ -1135,36 +2548,55 @@ void Painter::Draw()
 		uDownsampleBlend.Set(1.0f - exp(frameTime * (-0.79f)));
 		for(int i = 0; i < downsamplingPassesCount; ++i)
 		{
-			float halfSourcePixelWidth = 0.5f / (i == 0 ? screenWidth : (1 << (downsamplingPassesCount - i)));
-			float halfSourcePixelHeight = 0.5f / (i == 0 ? screenHeight : (1 << (downsamplingPassesCount - i)));
+			float halfSourcePixelWidth = 0.5f / (i == 0 ? screenWidth : (downsampleMapSize >> (i - 1)));
+			float halfSourcePixelHeight = 0.5f / (i == 0 ? screenHeight : (downsampleMapSize >> (i - 1)));
 			uDownsampleOffsets.Set(vec4(-halfSourcePixelWidth, halfSourcePixelWidth, -halfSourcePixelHeight, halfSourcePixelHeight));
 			ugDownsample->Upload(context);
 
 			Context::LetFrameBuffer lfb(context, fbDownsamples[i]);
-			Context::LetViewport lv(context, 1 << (downsamplingPassesCount - 1 - i), 1 << (downsamplingPassesCount - 1 - i));
+			Context::LetViewport lv(context, downsampleMapSize >> i, downsampleMapSize >> i);
+			Context::LetUniformBuffer lub(context, ugDownsample);
+			Context::LetSampler ls(context,
+				uDownsampleSourceSampler,
+				i == 0 ? rbScreen->GetTexture() : rbDownsamples[i - 1]->GetTexture(),
+				i == 0 ? ssLinear : ssPoint
+			);
+			Context::LetPixelShader lps(context, psDownsample);
+
+			context->ClearColor(0, vec4(0, 0, 0, 0));
+			context->Draw();
+		}
+
+		// уменьшение логарифма освещённости до 1x1 проходами по 4x;
+		// семплы берутся на границах текселей, так что линейная фильтрация
+		// усредняет каждым семплом 2x2 текселя
+		for(int i = 0; i < luminancePassesCount; ++i)
+		{
+			float sourcePixelSize = 1.0f / GetLuminanceMapSize(i - 1);
+			uDownsampleOffsets.Set(vec4(-sourcePixelSize, sourcePixelSize, -sourcePixelSize, sourcePixelSize));
+			ugDownsample->Upload(context);
+
+			Context::LetFrameBuffer lfb(context, fbLuminances[i]);
+			Context::LetViewport lv(context, GetLuminanceMapSize(i), GetLuminanceMapSize(i));
 			Context::LetUniformBuffer lub(context, ugDownsample);
 			const SamplerBase* sbSampler;
-			if(i <= downsamplingStepForBloom + 1)
+			if(i == 0)
 				sbSampler = &uDownsampleSourceSampler;
 			else
 				sbSampler = &uDownsampleLuminanceSourceSampler;
 			Context::LetSampler ls(context,
 				*sbSampler,
-				i == 0 ? rbScreen->GetTexture() : rbDownsamples[i - 1]->GetTexture(),
-				i == 0 ? ssLinear : ssPoint
+				i == 0 ? rbDownsamples[downsamplingPassesCount - 1]->GetTexture() : rbLuminances[i - 1]->GetTexture(),
+				ssLinear
 			);
 
-			Context::LetPixelShader lps(context,
-				i <= downsamplingStepForBloom ? psDownsample :
-				i == downsamplingStepForBloom + 1 ? psDownsampleLuminanceFirst :
-				psDownsampleLuminance
-			);
+			Context::LetPixelShader lps(context, i == 0 ? psDownsampleLuminanceFirst : psDownsampleLuminance);
 
 			Context::LetBlendState lbs;
-			if(i == downsamplingPassesCount - 1)
+			if(i == luminancePassesCount - 1)
 				lbs(context, bsLastDownsample);
 
-			if(veryFirstDownsampling || i < downsamplingPassesCount - 1)
+			if(veryFirstDownsampling || i < luminancePassesCount - 1)
 				context->ClearColor(0, vec4(0, 0, 0, 0));
 			context->Draw();
 		}
@@ -1175,13 +2607,41 @@ void Painter::Draw()
 			uBloomLimit.Set(bloomLimit);
 			ugBloom->Upload(context);
 
-			const int bloomPassesCount = 5;
-
 			bool enableBloom = true;
 
 			Context::LetViewport lv(context, bloomMapSize, bloomMapSize);
 			Context::LetUniformBuffer lub(context, ugBloom);
-			if(enableBloom)
+			if(enableBloom && pyramidBloom)
+			{
+				// уменьшение до последнего уровня, на первом - с ограничением по освещённости
+				for(int i = 0; i < bloomPyramidLevelsCount; ++i)
+				{
+					int sourceSize = bloomMapSize >> i;
+					uBloomOffset.Set(1.0f / sourceSize);
+					ugBloom->Upload(context);
+
+					Context::LetFrameBuffer lfb(context, fbBloomPyramid[i]);
+					Context::LetViewport lv(context, sourceSize / 2, sourceSize / 2);
+					Context::LetSampler ls(context, uBloomSourceSampler,
+						i == 0 ? rbDownsamples[downsamplingStepForBloom]->GetTexture() : rbBloomPyramid[i - 1]->GetTexture(), ssLinear);
+					Context::LetPixelShader lps(context, i == 0 ? psBloomPyramidDownLimit : psBloomPyramidDown);
+					context->Draw();
+				}
+				// увеличение обратно поверх уменьшенных уровней, последний шаг - в rbBloom1
+				for(int i = bloomPyramidLevelsCount - 1; i >= 0; --i)
+				{
+					int sourceSize = bloomMapSize >> (i + 1);
+					uBloomOffset.Set(0.5f / sourceSize);
+					ugBloom->Upload(context);
+
+					Context::LetFrameBuffer lfb(context, i == 0 ? fbBloom1 : fbBloomPyramid[i - 1]);
+					Context::LetViewport lv(context, sourceSize * 2, sourceSize * 2);
+					Context::LetSampler ls(context, uBloomSourceSampler, rbBloomPyramid[i]->GetTexture(), ssLinear);
+					Context::LetPixelShader lps(context, psBloomPyramidUp);
+					context->Draw();
+				}
+			}
+			else if(enableBloom)
 			{
 				{
 					Context::LetFrameBuffer lfb(context, fbBloom2);
@@ -1230,7 +2690,7 @@ void Painter::Draw()
 			Context::LetViewport lv(context, screenWidth, screenHeight);
 			Context::LetSampler lsBloom(context, uToneBloomSampler, rbBloom1->GetTexture(), ssLinear);
 			Context::LetSampler lsScreen(context, uToneScreenSampler, rbScreen->GetTexture(), ssPoint);
-			Context::LetSampler lsAverage(context, uToneAverageSampler, rbDownsamples[downsamplingPassesCount - 1]->GetTexture(), ssPoint);
+			Context::LetSampler lsAverage(context, uToneAverageSampler, rbLuminances[luminancePassesCount - 1]->GetTexture(), ssPoint);
 
 			uToneLuminanceKey.Set(toneLuminanceKey);
 			uToneMaxLuminance.Set(toneMaxLuminance);
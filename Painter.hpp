@@ -2,11 +2,14 @@
 #define ___FARSH_PAINTER_HPP___
 
 #include "general.hpp"
+#include "Frustum.hpp"
+#include "SphereTree.hpp"
 #include "Geometry.hpp"
 #include "Material.hpp"
 #include <unordered_map>
 
 class BoneAnimationFrame;
+class BoneAnimationTexture;
 class GeometryFormats;
 
 /// Класс, занимающийся рисованием моделей.
@@ -33,15 +36,39 @@ private:
 
 		ShadowLight(ptr<UniformGroup> ug, int samplerNumber);
 	};
+	/// Каскад тени направленного источника света.
+	struct SunCascade
+	{
+		/// Матрица трансформации каскада.
+		Uniform<mat4x4> uTransform;
+		/// Семплер карты теней каскада.
+		Sampler<float, 2> uShadowSampler;
+
+		SunCascade(ptr<UniformGroup> ug, int samplerNumber);
+	};
+	/// Параметры направленного источника света с каскадными тенями.
+	struct SunLight
+	{
+		/// Направление на источник.
+		Uniform<vec3> uToLight;
+		/// Цвет источника.
+		Uniform<vec3> uLightColor;
+		/// Каскады, от ближнего к дальнему.
+		std::vector<SunCascade> cascades;
+
+		SunLight(ptr<UniformGroup> ug, int firstSamplerNumber);
+	};
 
 	/// Структура ключа варианта света.
 	struct LightVariantKey
 	{
 		int basicLightsCount;
 		int shadowLightsCount;
+		/// Есть ли направленный источник.
+		bool sunLight;
 
-		LightVariantKey(int basicLightsCount, int shadowLightsCount)
-		: basicLightsCount(basicLightsCount), shadowLightsCount(shadowLightsCount)
+		LightVariantKey(int basicLightsCount, int shadowLightsCount, bool sunLight)
+		: basicLightsCount(basicLightsCount), shadowLightsCount(shadowLightsCount), sunLight(sunLight)
 		{}
 	};
 	/// Структура варианта света.
@@ -55,6 +82,8 @@ private:
 		std::vector<BasicLight> basicLights;
 		/// Источники света с тенями.
 		std::vector<ShadowLight> shadowLights;
+		/// Направленный источник (не больше одного).
+		std::vector<SunLight> sunLights;
 
 		LightVariant();
 	};
@@ -63,12 +92,16 @@ private:
 	struct VertexShaderKey
 	{
 		/// Instanced?
+		/** У обычных моделей трансформации экземпляров берутся из вершинного буфера. */
 		bool instanced;
 		/// Скиннинг?
-		/** Только при instanced=false. */
+		/** При instanced=true кости всех экземпляров лежат в одном массиве. */
 		bool skinned;
+		/// Анимация из текстуры анимации?
+		/** Только при instanced=true и skinned=true. */
+		bool baked;
 
-		VertexShaderKey(bool instanced, bool skinned);
+		VertexShaderKey(bool instanced, bool skinned, bool baked = false);
 	};
 
 	/// Ключ пиксельного шейдера в кэше.
@@ -78,10 +111,19 @@ private:
 		int basicLightsCount;
 		/// Количество источников света с тенями.
 		int shadowLightsCount;
+		/// Есть ли направленный источник с каскадными тенями.
+		bool sunLight;
+		/// Простые источники света берутся из кластеров.
+		/** basicLightsCount при этом 0. */
+		bool clustered;
+		/// Пишутся ли данные для отложенного освещения.
+		/** Точечные источники (простые и с тенями) считаются потом проходами
+		по экрану, basicLightsCount и shadowLightsCount при этом 0. */
+		bool deferred;
 		/// Ключ материала.
 		MaterialKey materialKey;
 
-		PixelShaderKey(int basicLightsCount, int shadowLightsCount, const MaterialKey& materialKey);
+		PixelShaderKey(int basicLightsCount, int shadowLightsCount, bool sunLight, bool clustered, bool deferred, const MaterialKey& materialKey);
 	};
 
 	struct Hasher
@@ -107,6 +149,15 @@ private:
 	/// Форматы геометрии.
 	ptr<GeometryFormats> geometryFormats;
 
+	/// Выбрать формат рендербуфера, поддерживаемый устройством.
+	/** Возвращает preferred, если в рендербуфер из него удаётся рисовать, иначе fallback. */
+	PixelFormat ChooseRenderBufferFormat(const PixelFormat& preferred, const PixelFormat& fallback);
+	/// Формат HDR-рендербуферов: R11G11B10F, иначе RGBA16F.
+	PixelFormat hdrPixelFormat;
+	/// Формат экранной карты нормалей: RG16F, иначе RGBA16F.
+	/** Нормали хранятся в октаэдрической развёртке в xy. */
+	PixelFormat normalPixelFormat;
+
 	/// Текстура окружения.
 	ptr<Texture> environmentTexture;
 
@@ -114,19 +165,57 @@ private:
 	static const int maxBasicLightsCount = 4;
 	/// Максимальное количество источников света с тенями.
 	static const int maxShadowLightsCount = 4;
-	/// Количество для instancing'а.
+	/// Количество каскадов тени направленного источника.
+	static const int sunCascadesCount = 4;
+	/// Максимальное количество простых источников света в кластерном режиме.
+	/** Вместе с пустым источником номер должен укладываться в clusterLightBits. */
+	static const int maxClusteredLightsCount = 32;
+	/// Количество источников света на кластер.
+	/** Пиксельный шейдер всегда перебирает столько источников;
+	лишние источники в переполненном кластере отбрасываются. */
+	static const int clusterLightsCount = 8;
+	/// Количество бит на номер источника в упакованных номерах кластера.
+	/** По 4 номера в компоненте (24 бита точно представимы во float),
+	2 компоненты на кластер, 2 кластера на vec4. */
+	static const int clusterLightBits = 6;
+	/// Размеры сетки кластеров: по экрану и по глубине.
+	/** Все uniform'ы кластеров занимают 131 vec4, чтобы кластерный вариант
+	пиксельного шейдера укладывался в 224 вектора ES/WebGL. */
+	static const int clustersCountX = 8, clustersCountY = 4, clustersCountZ = 4;
+	static const int clustersCount = clustersCountX * clustersCountY * clustersCountZ;
+	/// Количество для instancing'а с данными экземпляров в uniform-буфере.
 	static const int maxInstancesCount = 32;
+	/// Количество для instancing'а обычных моделей.
+	/** Трансформации экземпляров лежат в динамическом вершинном буфере. */
+	static const int maxModelInstancesCount = 4096;
 	/// Количество костей для skinning.
 	static const int maxBonesCount = 64;
+	/// Количество костей всех экземпляров в батче instanced skinned-моделей.
+	/** Два вектора на кость - 224 вектора, чтобы вместе с остальными uniform'ами
+	уложиться в 256 векторов вершинного шейдера ES/WebGL. Экземпляры лежат
+	подряд по числу костей скелета, поэтому размер батча зависит от скелета,
+	см. GetSkinnedBatchCapacity. Модели с текстурой анимации рисуются
+	пачками по maxInstancesCount. */
+	static const int maxSkinnedInstancedBonesCount = 112;
 
 	//*** Атрибуты.
 	ptr<AttributeBinding> ab;
-	ptr<Instancer> instancer;
-	ptr<AttributeBinding> abInstanced;
 	Value<vec3> aPosition;
 	Value<vec3> aNormal;
 	Value<vec2> aTexcoord;
+	ptr<AttributeBinding> abInstanced;
+	Value<vec3> aInstancedPosition;
+	Value<vec3> aInstancedNormal;
+	Value<vec2> aInstancedTexcoord;
+	/// Строки матрицы мира экземпляра.
+	Value<vec4> aInstanceWorld0;
+	Value<vec4> aInstanceWorld1;
+	Value<vec4> aInstanceWorld2;
+	/// Вершинный буфер трансформаций экземпляров.
+	ptr<VertexBuffer> vbInstances;
 	ptr<AttributeBinding> abSkinned;
+	ptr<Instancer> skinnedInstancer;
+	ptr<AttributeBinding> abSkinnedInstanced;
 	Value<vec3> aSkinnedPosition;
 	Value<vec3> aSkinnedNormal;
 	Value<vec2> aSkinnedTexcoord;
@@ -147,14 +236,47 @@ private:
 
 	/// Настройки depth-stencil state.
 	ptr<DepthStencilState> dssNormal;
+	/// Проверка глубины на равенство без записи - для прохода после предварительного прохода глубины.
+	ptr<DepthStencilState> dssEqual;
 	ptr<DepthStencilState> dssPass;
 
+	///*** Uniform-группа кластеров света.
+	ptr<UniformGroup> ugClusters;
+	/// Положения простых источников (w - обратный радиус, 0 для неограниченных).
+	/** Последний элемент - пустой источник для незанятых мест в кластерах. */
+	UniformArray<vec4> uClusterLightPositions;
+	/// Цвета простых источников.
+	UniformArray<vec4> uClusterLightColors;
+	/// Упакованные номера источников по кластерам, по 2 кластера в vec4.
+	/** См. clusterLightBits. */
+	UniformArray<vec4> uClusterLights;
+	/// Параметры разбиения по глубине: номер слоя = log(глубина) * x + y.
+	Uniform<vec4> uClusterDepthParams;
+
+	///*** Uniform-группа источника для отложенного освещения.
+	ptr<UniformGroup> ugDeferredLight;
+	/// Положение источника (w - обратный радиус, 0 для неограниченных).
+	Uniform<vec4> uDeferredLightPosition;
+	/// Цвет источника.
+	Uniform<vec3> uDeferredLightColor;
+	/// Трансформация источника с тенью.
+	Uniform<mat4x4> uDeferredLightTransform;
+	/// Прямоугольник источника на экране (xy - минимум, zw - максимум).
+	Uniform<vec4> uDeferredLightRect;
+	/// Семплеры G-буфера: глубина, нормаль, диффузный цвет со specular.
+	Sampler<float, 2> uDeferredDepthSampler;
+	Sampler<vec2, 2> uDeferredNormalSampler;
+	Sampler<vec4, 2> uDeferredAlbedoSampler;
+	/// Семплер карты теней источника.
+	Sampler<float, 2> uDeferredShadowSampler;
+
 	/// Варианты света.
 	std::unordered_map<LightVariantKey, LightVariant, Hasher> lightVariantsCache;
 	/// Получить вариант света.
 	LightVariant& GetLightVariant(const LightVariantKey& key);
 
 	///*** Uniform-группа материала.
+	/** Задаёт раскладку для генерации шейдеров, данные материалов лежат в MaterialUniforms. */
 	ptr<UniformGroup> ugMaterial;
 	/// Диффузный цвет с альфа-каналом.
 	Uniform<vec4> uDiffuse;
@@ -171,16 +293,38 @@ private:
 	/// Семплер текстуры окружения.
 	SamplerCube<vec3> uEnvironmentSampler;
 
+	/// Uniform-группа конкретного материала.
+	/** Раскладка совпадает с ugMaterial, по которой генерируются шейдеры. */
+	struct MaterialUniforms
+	{
+		ptr<UniformGroup> ug;
+		Uniform<vec4> uDiffuse;
+		Uniform<vec4> uSpecular;
+		Uniform<vec4> uNormalCoordTransform;
+		/// Залитая версия материала; -1 - ещё не залита.
+		int version;
+		/// Номер варианта шейдера материала, см. GetMaterialVariant.
+		int variant;
+		/// Версия материала, для которой получен variant; -1 - ещё не получен.
+		int variantVersion;
+
+		MaterialUniforms(ptr<Device> device);
+	};
+	/// Uniform-группы материалов по номерам материалов.
+	std::unordered_map<int, MaterialUniforms> materialUniformsCache;
+	/// Получить uniform-группу материала, перезалив её, если материал изменился.
+	ptr<UniformGroup> GetMaterialUniforms(ptr<Material> material);
+	/// Номера вариантов шейдера по ключам материалов, в порядке появления.
+	std::unordered_map<MaterialKey, int, Hasher> materialVariants;
+	/// Получить плотный номер варианта шейдера материала.
+	/** Кэшируется у материала до изменения его версии. */
+	int GetMaterialVariant(ptr<Material> material);
+
 	///*** Uniform-группа модели.
 	ptr<UniformGroup> ugModel;
 	/// Матрица мира.
 	Uniform<mat4x4> uWorld;
 
-	///*** Uniform-группа instanced-модели.
-	ptr<UniformGroup> ugInstancedModel;
-	/// Матрицы мира.
-	UniformArray<mat4x4> uWorlds;
-
 	///*** Uniform-группа skinned-модели.
 	ptr<UniformGroup> ugSkinnedModel;
 	/// Кватернионы костей.
@@ -188,12 +332,34 @@ private:
 	/// Смещения костей.
 	UniformArray<vec4> uBoneOffsets;
 
+	///*** Uniform-группа instanced skinned-модели.
+	ptr<UniformGroup> ugSkinnedInstancedModel;
+	/// Кватернионы костей по экземплярам (по uInstancedBonesCount на экземпляр).
+	UniformArray<vec4> uInstancedBoneOrientations;
+	/// Смещения костей по экземплярам.
+	UniformArray<vec4> uInstancedBoneOffsets;
+	/// Количество костей на экземпляр.
+	Uniform<float> uInstancedBonesCount;
+
+	///*** Uniform-группа skinned-модели с текстурой анимации.
+	ptr<UniformGroup> ugBakedSkinnedModel;
+	/// Ориентации экземпляров.
+	UniformArray<vec4> uBakedOrientations;
+	/// Положения экземпляров и номера кадров (в w).
+	UniformArray<vec4> uBakedPositions;
+	/// Размер текселя текстуры анимации.
+	Uniform<vec2> uBakedTexelSize;
+	/// Семплер текстуры анимации.
+	Sampler<vec4, 2> uBoneAnimationSampler;
+
 	///*** Uniform-группа размытия тени.
 	ptr<UniformGroup> ugShadowBlur;
 	/// Вектор направления размытия.
 	Uniform<vec2> uShadowBlurDirection;
 	/// Семплер для тени.
 	Sampler<float, 2> uShadowBlurSourceSampler;
+	/// Семплер кэшированной тени статических моделей.
+	Sampler<float, 2> uShadowBlurStaticSampler;
 
 	///*** Uniform-группа даунсемплинга.
 	ptr<UniformGroup> ugDownsample;
@@ -211,6 +377,8 @@ private:
 	ptr<UniformGroup> ugBloom;
 	/// Ограничение по освещённости для bloom.
 	Uniform<float> uBloomLimit;
+	/// Смещение семплов пирамиды bloom в текстурных координатах.
+	Uniform<float> uBloomOffset;
 	/// Семплер исходника для bloom.
 	Sampler<vec3, 2> uBloomSourceSampler;
 
@@ -239,10 +407,23 @@ private:
 	ptr<IndexBuffer> ibFilter;
 	ptr<VertexShader> vsFilter;
 	ptr<PixelShader> psShadowBlur;
+	/// Размытие с наложением динамической тени на статическую.
+	/** Источник - карта динамических моделей, глубина берётся минимальная из двух карт. */
+	ptr<PixelShader> psShadowBlurComposite;
+	/// Быстрое размытие одним проходом 3x3, обычное и с наложением.
+	ptr<PixelShader> psShadowBlurFast, psShadowBlurFastComposite;
 	ptr<PixelShader> psDownsample;
 	ptr<PixelShader> psDownsampleLuminanceFirst;
 	ptr<PixelShader> psDownsampleLuminance;
 	ptr<PixelShader> psBloomLimit, psBloom1, psBloom2, psTone;
+	/// Шейдеры пирамиды bloom.
+	/** Уменьшение - 5 семплов (первый уровень - с ограничением по освещённости),
+	увеличение - 8 семплов с весами tent-фильтра. */
+	ptr<PixelShader> psBloomPyramidDownLimit, psBloomPyramidDown, psBloomPyramidUp;
+	/// Шейдеры проходов отложенного освещения.
+	/** Вершинный шейдер растягивает квадрат на прямоугольник источника. */
+	ptr<VertexShader> vsDeferredLight;
+	ptr<PixelShader> psDeferredLight, psDeferredShadowLight;
 
 	ptr<SamplerState> ssPoint;
 	ptr<SamplerState> ssLinear;
@@ -250,49 +431,123 @@ private:
 	ptr<SamplerState> ssColorTexture;
 
 	ptr<BlendState> bsLastDownsample;
+	/// Сложение с тем, что уже нарисовано.
+	ptr<BlendState> bsAdditive;
 
 	ptr<PixelShader> psShadow;
 
-	/// Размер карты теней.
-	static const int shadowMapSize;
-	/// Количество проходов downsampling.
-	static const int downsamplingPassesCount = 10;
+	/// Размер карты теней при полном и быстром размытии.
+	static const int fullShadowMapSize, fastShadowMapSize;
+	/// Текущий размер карт теней.
+	int shadowMapSize;
+	/// Быстрое размытие теней.
+	/** Карты теней вдвое меньше и размываются одним проходом 3x3 вместо
+	двух проходов по 7 семплов. */
+	bool fastShadowFilter;
+	/// Количество проходов downsampling экрана (каждый уменьшает вдвое).
+	static const int downsamplingPassesCount = 2;
+	/// Размер карты после первого прохода downsampling.
+	static const int downsampleMapSize = 512;
 	/// Номер прохода, после которого делать bloom.
 	static const int downsamplingStepForBloom;
 	/// Размер карты для bloom.
 	static const int bloomMapSize;
+	/// Количество семплов в проходе размытия bloom.
+	static const int bloomTapsCount = 13;
+	/// Количество пар проходов размытия bloom.
+	static const int bloomPassesCount = 5;
+	/// Количество уровней пирамиды bloom.
+	static const int bloomPyramidLevelsCount = 5;
+	/// Количество проходов уменьшения карты освещённости до 1x1.
+	/** Каждый проход уменьшает в 4 раза: 4 билинейных семпла
+	усредняют блок 4x4 текселей. */
+	static const int luminancePassesCount = 4;
+	/// Получить размер карты освещённости после прохода.
+	/** Для pass = -1 - размер исходной карты (результата downsampling). */
+	static int GetLuminanceMapSize(int pass);
 
 	//** Рендербуферы.
 	/// HDR-текстура для изначального рисования.
 	ptr<RenderBuffer> rbScreen;
 	/// Экранная карта нормалей.
+	/** Создаётся только при отложенном освещении, см. normalPixelFormat. */
 	ptr<RenderBuffer> rbScreenNormal;
+	/// Экранная карта диффузного цвета (xyz) и параметра specular (w).
+	/** Создаётся только при отложенном освещении. */
+	ptr<RenderBuffer> rbScreenAlbedo;
 	/// Фреймбуферы для downsampling.
 	ptr<FrameBuffer> fbDownsamples[downsamplingPassesCount];
 	/// Фреймбуферы для bloom.
 	ptr<FrameBuffer> fbBloom1, fbBloom2;
 	/// HDR-буферы для downsampling.
 	ptr<RenderBuffer> rbDownsamples[downsamplingPassesCount];
+	/// Карты логарифма освещённости; последняя (1x1) - средняя освещённость с накоплением по времени.
+	ptr<RenderBuffer> rbLuminances[luminancePassesCount];
+	/// Фреймбуферы для карт освещённости.
+	ptr<FrameBuffer> fbLuminances[luminancePassesCount];
 	/// HDR-буферы для Bloom.
 	ptr<RenderBuffer> rbBloom1, rbBloom2;
+	/// Уровни пирамиды bloom: bloomMapSize / 2, bloomMapSize / 4 и т.д.
+	ptr<RenderBuffer> rbBloomPyramid[bloomPyramidLevelsCount];
+	ptr<FrameBuffer> fbBloomPyramid[bloomPyramidLevelsCount];
 	/// Backbuffer.
 	ptr<RenderBuffer> rbBack;
 	/// Буфер глубины.
 	ptr<DepthStencilBuffer> dsbDepth;
 	/// Буфер глубины для карт теней.
 	ptr<DepthStencilBuffer> dsbShadow;
-	/// Карты теней.
+	/// Неразмытая карта теней текущего прохода, общая для всех источников.
+	ptr<RenderBuffer> rbShadowDepth;
+	ptr<FrameBuffer> fbShadowDepth;
+	/// Размытые карты теней.
 	ptr<RenderBuffer> rbShadows[maxShadowLightsCount];
-	/// Фреймбуферы для карт теней.
+	/// Фреймбуферы для размытых карт теней.
 	ptr<FrameBuffer> fbShadows[maxShadowLightsCount];
-	/// Фреймбуферы для размытия карт теней.
-	ptr<FrameBuffer> fbShadowBlurs[maxShadowLightsCount];
 	/// Фреймбуфер для первого шага размытия карт теней.
 	ptr<FrameBuffer> fbShadowBlur1;
 	/// Вспомогательная карта для размытия.
 	ptr<RenderBuffer> rbShadowBlur;
-	/// Основной фреймбуфер.
+	/// Размытые карты теней каскадов направленного источника.
+	ptr<RenderBuffer> rbSunCascades[sunCascadesCount];
+	/// Фреймбуферы для карт теней каскадов.
+	ptr<FrameBuffer> fbSunCascades[sunCascadesCount];
+	/// Создать карты теней текущего размера.
+	void CreateShadowMaps();
+	/// Размыть карту теней.
+	/** Результат пишется в fbTarget (при полном размытии - через rbShadowBlur).
+	Если задана rbStatic, берётся минимальная глубина из rb и rbStatic. */
+	void BlurShadowMap(ptr<RenderBuffer> rb, ptr<RenderBuffer> rbStatic, ptr<FrameBuffer> fbTarget);
+	/// Кэшированные карты теней статических моделей (неразмытые).
+	ptr<RenderBuffer> rbStaticShadows[maxShadowLightsCount];
+	/// Фреймбуферы для кэшированных карт теней.
+	ptr<FrameBuffer> fbStaticShadows[maxShadowLightsCount];
+	/// Состояние кэша карты теней.
+	struct ShadowCache
+	{
+		/// Трансформация источника, для которой нарисована статическая карта.
+		mat4x4 transform;
+		/// Действительна ли статическая карта.
+		bool valid;
+		/// Были ли в итоговой карте динамические модели.
+		/** Если были, итоговую карту нужно пересобрать, даже когда их больше нет. */
+		bool dynamic;
+
+		ShadowCache();
+	};
+	ShadowCache shadowCaches[maxShadowLightsCount];
+	/// Сбросить кэши карт теней, в которые попадает сфера.
+	void InvalidateStaticShadows(const vec3& center, float radius);
+	/// Основной фреймбуфер (только rbScreen).
 	ptr<FrameBuffer> fbOpaque;
+	/// Фреймбуфер G-буфера: rbScreen, rbScreenNormal и rbScreenAlbedo.
+	/** Создаётся только при отложенном освещении. */
+	ptr<FrameBuffer> fbGBuffer;
+	/// Создать (или освободить) G-буфер текущего размера экрана.
+	void CreateGBuffer();
+	/// Фреймбуфер предварительного прохода глубины (только dsbDepth).
+	ptr<FrameBuffer> fbDepthPrepass;
+	/// Фреймбуфер проходов отложенного освещения (только rbScreen).
+	ptr<FrameBuffer> fbDeferredLighting;
 
 private:
 	/// Кэш вершинных шейдеров.
@@ -307,12 +562,18 @@ private:
 	/// Временные переменные вершинного шейдера моделей.
 	Value<vec4> tmpVertexPosition;
 	Value<vec3> tmpVertexNormal;
+	Value<vec4> tmpVertexClipPosition;
 
 	/// Повернуть вектор кватернионом.
 	static Value<vec3> ApplyQuaternion(Value<vec4> q, Value<vec3> v);
+	/// Упаковать нормированный вектор в октаэдрическую развёртку [-1, 1]^2.
+	static Value<vec2> EncodeNormal(Value<vec3> normal);
+	/// Распаковать нормаль из октаэдрической развёртки.
+	static Value<vec3> DecodeNormal(Value<vec2> encoded);
 	/// Получить положение вершины и нормаль в мире.
 	/** Возвращает выражение, которое записывает положение и нормаль во
-	временные переменные tmpVertexPosition и tmpVertexNormal. */
+	временные переменные tmpVertexPosition и tmpVertexNormal, а положение
+	на экране - в tmpVertexClipPosition (общее для всех вершинных шейдеров). */
 	void GetWorldPositionAndNormal(const VertexShaderKey& key);
 
 	/// Кэш пиксельных шейдеров.
@@ -333,6 +594,11 @@ private:
 	void BeginMaterialLighting(const PixelShaderKey& key, Value<vec3> ambientColor);
 	/// Вычислить добавку к цвету и прибавить её к tmpColor.
 	void ApplyMaterialLighting(Value<vec3> lightPosition, Value<vec3> lightColor);
+	/// Вычислить добавку от света с заданного (нормированного) направления.
+	void ApplyDirectionalMaterialLighting(Value<vec3> toLight, Value<vec3> lightColor);
+	/// Вычислить множитель тени по карте теней с экспоненциальной глубиной.
+	/** Вне карты - 0. */
+	Value<float> SampleShadow(Value<mat4x4> lightTransform, Sampler<float, 2>& shadowSampler);
 
 	/// Текущее время кадра.
 	float frameTime;
@@ -343,6 +609,8 @@ private:
 	mat4x4 cameraViewProj;
 	mat4x4 cameraInvViewProj;
 	vec3 cameraPosition;
+	/// Направление взгляда камеры.
+	vec3 cameraDirection;
 
 	/// Модель для рисования.
 	struct Model
@@ -350,10 +618,57 @@ private:
 		ptr<Material> material;
 		ptr<Geometry> geometry;
 		mat4x4 worldTransform;
+		/// Ограничивающая сфера в мировом пространстве.
+		vec3 boundCenter;
+		float boundRadius;
+		/// Может ли модель двигаться.
+		/** Тени статических моделей кэшируются. */
+		bool dynamic;
 
-		Model(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform);
+		Model(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform, bool dynamic = true);
+
+		/// Установить трансформацию и пересчитать ограничивающую сферу.
+		void SetWorldTransform(const mat4x4& worldTransform);
 	};
 	std::vector<Model> models;
+	/// Модели, видимые в текущем проходе.
+	/** После SortVisibleModels - в порядке рисования. */
+	std::vector<const Model*> visibleModels;
+	/// Трансформации видимых моделей в порядке рисования.
+	/** По три строки матрицы мира на модель, как в вершинном буфере экземпляров. */
+	std::vector<vec4> visibleTransforms;
+	/// Нарисовать видимые модели с одной геометрией.
+	/** Трансформации заливаются в вершинный буфер экземпляров, рисование - одним вызовом.
+	Привязка атрибутов, вершинный и пиксельный шейдеры должны быть установлены. */
+	void DrawModelBatch(int first, int count);
+	/// Ключи рисования видимых моделей и буфер для сортировки.
+	std::vector<unsigned long long> drawKeys, drawKeysTemp;
+	std::vector<const Model*> sortedModels;
+	/// Упорядочить видимые модели по ключам рисования.
+	/** Ключ (от старших битов): номер варианта шейдера материала (4 бита,
+	вариантов MaterialKey не больше 16),
+	номер материала (14 бит), номер геометрии (14 бит), ведро расстояния
+	до точки наблюдения (8 бит, ближние раньше), номер модели (24 бита).
+	Номера материалов и геометрий берутся по модулю, поэтому совпадение
+	ключей не означает совпадения - батчи всё равно сравнивают указатели. */
+	void SortVisibleModels(const vec3& viewPosition);
+	/// Постоянные модели.
+	/** Регистрируются один раз, а не каждый кадр. */
+	std::vector<Model> persistentModels;
+	/// Номера постоянных моделей по хендлам; -1 у свободных хендлов.
+	std::vector<int> persistentModelIndices;
+	/// Хендлы постоянных моделей по номерам.
+	std::vector<int> persistentModelHandles;
+	/// Свободные хендлы.
+	std::vector<int> freePersistentModelHandles;
+	/// Иерархия сфер постоянных моделей.
+	SphereTree persistentModelTree;
+	/// Нужно ли перестроить иерархию.
+	bool persistentModelTreeDirty;
+	/// Номера постоянных моделей, видимых в текущем проходе.
+	std::vector<int> visiblePersistentModels;
+	/// Статические модели, попадающие в карту теней.
+	std::vector<const Model*> shadowStaticModels;
 
 	/// Skinned модель для рисования.
 	struct SkinnedModel
@@ -363,10 +678,60 @@ private:
 		ptr<Geometry> shadowGeometry;
 		/// Настроенный кадр анимации.
 		ptr<BoneAnimationFrame> animationFrame;
+		/// Ограничивающая сфера по положениям костей.
+		vec3 boundCenter;
+		float boundRadius;
 
 		SkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<Geometry> shadowGeometry, ptr<BoneAnimationFrame> animationFrame);
 	};
 	std::vector<SkinnedModel> skinnedModels;
+	std::vector<SkinnedModel> visibleSkinnedModels;
+	/// Запас ограничивающей сферы skinned-модели на вершины вокруг костей и отклонение от позы привязки.
+	static const float skinnedBoundMargin;
+	/// Нарисовать skinned-модели с одной геометрией.
+	/** Несколько моделей рисуются за один вызов инстансингом.
+	Пиксельный шейдер и материал должны быть установлены.
+	depthOnly - рисовать вершинным шейдером теней, shadow - брать теневую геометрию. */
+	void DrawSkinnedBatch(const SkinnedModel* models, int count, bool depthOnly, bool shadow);
+	/// Получить наибольший размер батча для скелета skinned-модели.
+	static int GetSkinnedBatchCapacity(const SkinnedModel& model);
+
+	/// Skinned модель с анимацией из текстуры.
+	struct BakedSkinnedModel
+	{
+		ptr<Material> material;
+		ptr<Geometry> geometry;
+		ptr<BoneAnimationTexture> animationTexture;
+		quat orientation;
+		/// Положение и текстурная координата времени.
+		vec4 position;
+		/// Ограничивающая сфера.
+		vec3 boundCenter;
+		float boundRadius;
+
+		BakedSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationTexture> animationTexture, const quat& orientation, const vec4& position);
+	};
+	std::vector<BakedSkinnedModel> bakedSkinnedModels;
+	std::vector<BakedSkinnedModel> visibleBakedSkinnedModels;
+	/// Сортировщик моделей по материалу, а затем по геометрии.
+	struct MaterialSorter
+	{
+		bool operator()(const SkinnedModel& a, const SkinnedModel& b) const;
+		bool operator()(const BakedSkinnedModel& a, const BakedSkinnedModel& b) const;
+	};
+
+	/// Нарисовать видимые модели только для глубины.
+	/** Используются вершинные шейдеры теней, пиксельный шейдер должен быть установлен.
+	shadow - для карты теней (skinned-модели рисуются теневой геометрией);
+	иначе skinned-модели группируются так же, как в основном проходе. */
+	void DrawDepth(bool shadow);
+	/// Делать ли предварительный проход глубины.
+	bool depthPrepass;
+
+	/// Отобрать модели, пересекающие пирамиду видимости.
+	void CullModels(const Frustum& frustum);
+	/// Нарисовать skinned-модели с одной геометрией и текстурой анимации.
+	void DrawBakedSkinnedBatch(const BakedSkinnedModel* models, int count, bool shadow);
 
 	// Источники света.
 	/// Рассеянный свет.
@@ -378,14 +743,59 @@ private:
 		vec3 color;
 		mat4x4 transform;
 		bool shadow;
+		/// Радиус действия; отрицательный - неограниченный.
+		float radius;
 
-		Light(const vec3& position, const vec3& color);
+		Light(const vec3& position, const vec3& color, float radius);
 		Light(const vec3& position, const vec3& color, const mat4x4& transform);
 	};
 	std::vector<Light> lights;
+	/// Направленный источник света.
+	/** Зарегистрирован ли в текущем кадре, направление распространения света, цвет. */
+	bool sunLight;
+	vec3 sunDirection;
+	vec3 sunColor;
+	/// Трансформации каскадов направленного источника в текущем кадре.
+	mat4x4 sunCascadeTransforms[sunCascadesCount];
+	/// Дальность теней направленного источника от камеры.
+	static const float sunShadowDistance;
+	/// Ближняя граница для логарифмического разбиения на каскады.
+	static const float sunCascadesNear;
+	/// Доля логарифмического разбиения (остальное - равномерное).
+	static const float sunCascadesSplitLambda;
+	/// Запас для отбрасывающих тень моделей между каскадом и источником.
+	static const float sunCasterDistance;
+
+	/// Кластерный режим освещения.
+	bool clusteredLighting;
+	/// Границы разбиения на кластеры по глубине.
+	static const float clustersNear, clustersFar;
+	/// Номера источников по кластерам, с пустым источником на свободных местах.
+	std::vector<int> clusterLights;
+	/// Количества источников в кластерах.
+	std::vector<int> clusterLightCounts;
+	/// Распределить простые источники света по кластерам и залить uniform'ы.
+	/** Для каждого источника берутся слои глубины, которые задевает его сфера,
+	и прямоугольник проекции её ограничивающего куба на экран. */
+	void BinClusteredLights();
+	/// Отложенный режим освещения.
+	bool deferredShading;
+	/// Получить прямоугольник экрана, который может освещать простой источник.
+	/** Прямоугольник в координатах [-1, 1]: xy - минимум, zw - максимум.
+	Для неограниченного источника, а также если его ограничивающий куб
+	пересекает плоскость камеры, - весь экран. Возвращает false, если
+	источник целиком позади камеры или вне экрана. */
+	bool GetLightScreenRect(const Light& light, vec4& rect) const;
+	/// Вписать каскады в пирамиду камеры.
+	/** Каждый каскад описывается сферой вокруг своего куска пирамиды, поэтому
+	его размер не зависит от поворота камеры; центр привязывается к текселям
+	карты теней, чтобы края теней не дрожали при движении камеры. */
+	void SetupSunCascades();
 
 	// Параметры постпроцессинга.
 	float bloomLimit, toneLuminanceKey, toneMaxLuminance;
+	/// Bloom пирамидой уменьшений и увеличений.
+	bool pyramidBloom;
 
 	/// Сгенерировать вершинный шейдер.
 	ptr<VertexShader> GenerateVS(Expression expression);
@@ -404,20 +814,66 @@ public:
 	void SetCamera(const mat4x4& cameraViewProj, const vec3& cameraPosition);
 	/// Зарегистрировать модель.
 	void AddModel(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform);
+	/// Зарегистрировать постоянную модель.
+	/** В отличие от остальных моделей, постоянные не очищаются в BeginFrame.
+	Тени нединамических моделей кэшируются, и каждое их изменение
+	заставляет перерисовать карты теней вокруг. Возвращает хендл модели. */
+	int AddPersistentModel(ptr<Material> material, ptr<Geometry> geometry, const mat4x4& worldTransform, bool dynamic);
+	/// Изменить трансформацию постоянной модели.
+	void SetPersistentModelTransform(int handle, const mat4x4& worldTransform);
+	/// Удалить постоянную модель.
+	void RemovePersistentModel(int handle);
 	/// Зарегистрировать skinned-модель.
 	void AddSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationFrame> animationFrame);
 	void AddSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<Geometry> shadowGeometry, ptr<BoneAnimationFrame> animationFrame);
+	/// Зарегистрировать skinned-модель, анимируемую на GPU по текстуре анимации.
+	void AddBakedSkinnedModel(ptr<Material> material, ptr<Geometry> geometry, ptr<BoneAnimationTexture> animationTexture, const vec3& position, const quat& orientation, float time);
 	/// Установить рассеянный свет.
 	void SetAmbientColor(const vec3& ambientColor);
 	/// Установить текстуру окружения.
 	void SetEnvironmentTexture(ptr<Texture> environmentTexture);
 	/// Зарегистрировать простой источник света.
-	void AddBasicLight(const vec3& position, const vec3& color);
+	/** Радиус действия учитывается только в кластерном и отложенном режимах;
+	отрицательный радиус - свет без затухания. */
+	void AddBasicLight(const vec3& position, const vec3& color, float radius = -1);
 	/// Зарегистрировать источник света с тенью.
 	void AddShadowLight(const vec3& position, const vec3& color, const mat4x4& transform);
+	/// Зарегистрировать направленный источник света с каскадными тенями.
+	/** direction - направление распространения света. */
+	void SetSunLight(const vec3& direction, const vec3& color);
+
+	/// Включить или выключить предварительный проход глубины.
+	/** Модели сначала рисуются только в буфер глубины, затем освещение
+	считается с проверкой глубины на равенство, то есть без перерисовки. */
+	void SetDepthPrepass(bool depthPrepass);
+	/// Включить или выключить быстрое размытие теней.
+	/** Для сравнения качества с полным размытием. Карты теней пересоздаются,
+	кэши статических теней сбрасываются. */
+	void SetFastShadowFilter(bool fastShadowFilter);
+	/// Включить или выключить кластерное освещение.
+	/** Простые источники распределяются по кластерам пирамиды камеры, и
+	пиксельный шейдер считает только источники своего кластера. Их количество
+	не влияет на варианты шейдеров и ограничено maxClusteredLightsCount.
+	Источники с тенями и направленный источник считаются как обычно. */
+	void SetClusteredLighting(bool clusteredLighting);
+	/// Включить или выключить отложенное освещение.
+	/** Модели пишут нормаль, диффузный цвет и specular в G-буфер, а точечные
+	источники (простые и с тенями) накладываются аддитивными проходами по
+	экрану, положение восстанавливается по глубине. Простые источники рисуются
+	только в прямоугольнике своей сферы. Рассеянный свет и направленный
+	источник считаются при рисовании моделей. Кластерный режим при этом не действует. */
+	void SetDeferredShading(bool deferredShading);
 
 	/// Установить параметры постпроцессинга.
 	void SetupPostprocess(float bloomLimit, float toneLuminanceKey, float toneMaxLuminance);
+	/// Включить или выключить bloom пирамидой.
+	/** Вместо многократного размытия на bloomMapSize ограниченная по
+	освещённости картинка уменьшается по уровням пирамиды и увеличивается
+	обратно. Свечение получается шире, а выборок из текстур - на порядок меньше. */
+	void SetPyramidBloom(bool pyramidBloom);
+	/// Получить количество выборок из текстур на bloom за кадр.
+	/** Для сравнения стоимости режимов bloom. */
+	int GetBloomFetchesCount() const;
 
 	/// Выполнить рисование.
 	void Draw();
@@ -15,7 +15,8 @@
 }
 */
 
-Skeleton::Skeleton(const std::vector<Bone>& bones) : bones(bones)
+Skeleton::Skeleton(const std::vector<Bone>& bones) :
+	bones(bones), reducedRateScreenSize(0), leafBonesScreenSize(0)
 {
 	// отсортировать кости топологически
 	sortedBones.reserve(bones.size());
@@ -39,6 +40,77 @@ Skeleton::Skeleton(const std::vector<Bone>& bones) : bones(bones)
 			s.pop();
 		}
 	}
+
+	// вычислить уровни костей (корневая кость - 0)
+	std::vector<int> levels(bonesCount, 0);
+	int levelsCount = bonesCount ? 1 : 0;
+	for(int i = 0; i < bonesCount; ++i)
+	{
+		int boneNumber = sortedBones[i];
+		if(boneNumber)
+		{
+			levels[boneNumber] = levels[bones[boneNumber].parent] + 1;
+			levelsCount = std::max(levelsCount, levels[boneNumber] + 1);
+		}
+	}
+
+	// разложить кости по слотам (сортировка подсчётом по уровням)
+	levelOffsets.assign(levelsCount + 1, 0);
+	for(int i = 0; i < bonesCount; ++i)
+		levelOffsets[levels[i] + 1]++;
+	for(int i = 0; i < levelsCount; ++i)
+		levelOffsets[i + 1] += levelOffsets[i];
+	slotBones.resize(bonesCount);
+	boneSlots.resize(bonesCount);
+	{
+		std::vector<int> levelEnds(levelOffsets.begin(), levelOffsets.end() - 1);
+		for(int i = 0; i < bonesCount; ++i)
+		{
+			int boneNumber = sortedBones[i];
+			int slot = levelEnds[levels[boneNumber]]++;
+			slotBones[slot] = boneNumber;
+			boneSlots[boneNumber] = slot;
+		}
+	}
+
+	// пачка по 4 может начинаться с любого слота
+	paddedSlotsCount = (bonesCount + 7) & ~3;
+	slotParents.assign(paddedSlotsCount, 0);
+	slotRelativePositions.Resize(paddedSlotsCount);
+	slotInvWorldOrientations.Resize(paddedSlotsCount);
+	slotWorldPositions.Resize(paddedSlotsCount);
+	for(int i = 0; i < bonesCount; ++i)
+	{
+		int boneNumber = slotBones[i];
+		const Bone& bone = bones[boneNumber];
+		if(boneNumber)
+		{
+			slotParents[i] = boneSlots[bone.parent];
+			if(slotParents[i] >= levelOffsets[levels[boneNumber]])
+				THROW("Parent bone is not on the previous level");
+		}
+		slotRelativePositions.Set(i, bone.originalRelativePosition);
+		slotInvWorldOrientations.Set(i, fromEigen(toEigenQuat(bone.originalWorldOrientation).conjugate()));
+		slotWorldPositions.Set(i, bone.originalWorldPosition);
+	}
+
+	// найти листовые кости
+	std::vector<bool> hasChildren(bonesCount, false);
+	for(int i = 1; i < bonesCount; ++i)
+		hasChildren[bones[i].parent] = true;
+	for(int i = 0; i < bonesCount; ++i)
+	{
+		int boneNumber = sortedBones[i];
+		if(!boneNumber || hasChildren[boneNumber])
+			lodBones.push_back(boneNumber);
+		else
+		{
+			const Bone& bone = bones[boneNumber];
+			leafSlots.push_back(boneSlots[boneNumber]);
+			leafRelativeOrientations.push_back(fromEigen(
+				toEigenQuat(bones[bone.parent].originalWorldOrientation).conjugate() * toEigenQuat(bone.originalWorldOrientation)));
+		}
+	}
 }
 
 const std::vector<Skeleton::Bone>& Skeleton::GetBones() const
@@ -51,6 +123,77 @@ const std::vector<int>& Skeleton::GetSortedBones() const
 	return sortedBones;
 }
 
+const std::vector<int>& Skeleton::GetSlotBones() const
+{
+	return slotBones;
+}
+
+const std::vector<int>& Skeleton::GetBoneSlots() const
+{
+	return boneSlots;
+}
+
+const std::vector<int>& Skeleton::GetSlotParents() const
+{
+	return slotParents;
+}
+
+const std::vector<int>& Skeleton::GetLevelOffsets() const
+{
+	return levelOffsets;
+}
+
+int Skeleton::GetPaddedSlotsCount() const
+{
+	return paddedSlotsCount;
+}
+
+const SoaVecs& Skeleton::GetSlotRelativePositions() const
+{
+	return slotRelativePositions;
+}
+
+const SoaQuats& Skeleton::GetSlotInvWorldOrientations() const
+{
+	return slotInvWorldOrientations;
+}
+
+const SoaVecs& Skeleton::GetSlotWorldPositions() const
+{
+	return slotWorldPositions;
+}
+
+const std::vector<int>& Skeleton::GetLodBones() const
+{
+	return lodBones;
+}
+
+const std::vector<int>& Skeleton::GetLeafSlots() const
+{
+	return leafSlots;
+}
+
+const std::vector<quat>& Skeleton::GetLeafRelativeOrientations() const
+{
+	return leafRelativeOrientations;
+}
+
+float Skeleton::GetReducedRateScreenSize() const
+{
+	return reducedRateScreenSize;
+}
+
+float Skeleton::GetLeafBonesScreenSize() const
+{
+	return leafBonesScreenSize;
+}
+
+void Skeleton::SetLod(float reducedRateScreenSize, float leafBonesScreenSize)
+{
+	this->reducedRateScreenSize = reducedRateScreenSize;
+	this->leafBonesScreenSize = leafBonesScreenSize;
+}
+
 ptr<Skeleton> Skeleton::Deserialize(ptr<InputStream> inputStream)
 {
 	try
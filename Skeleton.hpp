@@ -2,6 +2,7 @@
 #define ___FARSH_SKELETON_HPP___
 
 #include "general.hpp"
+#include "Soa.hpp"
 
 /// Класс скелета.
 /** Содержит иерархию костей. */
@@ -27,11 +28,62 @@ public:
 	/// Порядок топологической сортировки для костей.
 	std::vector<int> sortedBones;
 
+	//*** Раскладка костей по слотам для SIMD-вычислений.
+	/** Слоты - это кости, упорядоченные по уровням иерархии. Кости одного
+	уровня не зависят друг от друга, и их можно обрабатывать пачками. */
+	/// Номера костей по слотам.
+	std::vector<int> slotBones;
+	/// Слоты по номерам костей.
+	std::vector<int> boneSlots;
+	/// Слоты родительских костей (для дополнительных слотов - 0).
+	std::vector<int> slotParents;
+	/// Начала уровней в слотах; последний элемент - количество костей.
+	std::vector<int> levelOffsets;
+	/// Количество слотов с запасом, чтобы пачки по 4 не выходили за границу.
+	int paddedSlotsCount;
+	/// Относительные позиции костей по слотам.
+	SoaVecs slotRelativePositions;
+	/// Сопряжённые оригинальные мировые ориентации по слотам.
+	SoaQuats slotInvWorldOrientations;
+	/// Оригинальные мировые позиции по слотам.
+	SoaVecs slotWorldPositions;
+
+	//*** Уровень детализации анимации.
+	/// Кости, которые считаются всегда (нелистовые и корневая), в топологическом порядке.
+	std::vector<int> lodBones;
+	/// Слоты листовых костей (кроме корневой).
+	std::vector<int> leafSlots;
+	/// Оригинальные относительные ориентации листовых костей.
+	/** С ними листовая кость повторяет трансформацию родителя. */
+	std::vector<quat> leafRelativeOrientations;
+	/// Размер на экране, ниже которого анимация обновляется реже.
+	float reducedRateScreenSize;
+	/// Размер на экране, ниже которого листовые кости не анимируются.
+	float leafBonesScreenSize;
+
 public:
 	Skeleton(const std::vector<Bone>& bones);
 
 	const std::vector<Bone>& GetBones() const;
 	const std::vector<int>& GetSortedBones() const;
+	const std::vector<int>& GetSlotBones() const;
+	const std::vector<int>& GetBoneSlots() const;
+	const std::vector<int>& GetSlotParents() const;
+	const std::vector<int>& GetLevelOffsets() const;
+	int GetPaddedSlotsCount() const;
+	const SoaVecs& GetSlotRelativePositions() const;
+	const SoaQuats& GetSlotInvWorldOrientations() const;
+	const SoaVecs& GetSlotWorldPositions() const;
+	const std::vector<int>& GetLodBones() const;
+	const std::vector<int>& GetLeafSlots() const;
+	const std::vector<quat>& GetLeafRelativeOrientations() const;
+	float GetReducedRateScreenSize() const;
+	float GetLeafBonesScreenSize() const;
+
+	/// Установить пороги уровня детализации анимации.
+	/** Размер на экране - отношение радиуса персонажа к половине высоты экрана.
+	Нулевые пороги (по умолчанию) отключают упрощения. */
+	void SetLod(float reducedRateScreenSize, float leafBonesScreenSize);
 
 	static ptr<Skeleton> Deserialize(ptr<InputStream> inputStream);
 
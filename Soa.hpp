@@ -0,0 +1,120 @@
+#ifndef ___FARSH_SOA_HPP___
+#define ___FARSH_SOA_HPP___
+
+#include "general.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define ___FARSH_SSE
+#include <xmmintrin.h>
+#endif
+
+/// Четвёрка float'ов для SIMD-вычислений.
+/** Если SSE недоступен (например, emscripten), работает поэлементно. */
+struct float4
+{
+#ifdef ___FARSH_SSE
+	__m128 v;
+
+	float4() {}
+	float4(__m128 v) : v(v) {}
+	explicit float4(float a) : v(_mm_set1_ps(a)) {}
+	float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+	static float4 Load(const float* p) { return _mm_loadu_ps(p); }
+	void Store(float* p) const { _mm_storeu_ps(p, v); }
+
+	friend float4 operator+(const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+	friend float4 operator-(const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+	friend float4 operator*(const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+	friend float4 operator/(const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+	friend float4 operator-(const float4& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+	friend float4 sqrt(const float4& a) { return _mm_sqrt_ps(a.v); }
+	friend float4 abs(const float4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+	/// Умножить a на знак s.
+	friend float4 mulsign(const float4& a, const float4& s) { return _mm_xor_ps(a.v, _mm_and_ps(s.v, _mm_set1_ps(-0.0f))); }
+	/// Битовая маска элементов, для которых a < b.
+	friend int lessmask(const float4& a, const float4& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+#else
+	float v[4];
+
+	float4() {}
+	explicit float4(float a) { v[0] = v[1] = v[2] = v[3] = a; }
+	float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+	static float4 Load(const float* p) { return float4(p[0], p[1], p[2], p[3]); }
+	void Store(float* p) const { p[0] = v[0]; p[1] = v[1]; p[2] = v[2]; p[3] = v[3]; }
+
+#define FARSH_FLOAT4_OP(op) \
+	friend float4 operator op(const float4& a, const float4& b) { return float4(a.v[0] op b.v[0], a.v[1] op b.v[1], a.v[2] op b.v[2], a.v[3] op b.v[3]); }
+	FARSH_FLOAT4_OP(+)
+	FARSH_FLOAT4_OP(-)
+	FARSH_FLOAT4_OP(*)
+	FARSH_FLOAT4_OP(/)
+#undef FARSH_FLOAT4_OP
+	friend float4 operator-(const float4& a) { return float4(-a.v[0], -a.v[1], -a.v[2], -a.v[3]); }
+	friend float4 sqrt(const float4& a) { return float4(sqrtf(a.v[0]), sqrtf(a.v[1]), sqrtf(a.v[2]), sqrtf(a.v[3])); }
+	friend float4 abs(const float4& a) { return float4(fabsf(a.v[0]), fabsf(a.v[1]), fabsf(a.v[2]), fabsf(a.v[3])); }
+	friend float4 mulsign(const float4& a, const float4& s)
+	{
+		return float4(
+			s.v[0] < 0 ? -a.v[0] : a.v[0],
+			s.v[1] < 0 ? -a.v[1] : a.v[1],
+			s.v[2] < 0 ? -a.v[2] : a.v[2],
+			s.v[3] < 0 ? -a.v[3] : a.v[3]);
+	}
+	friend int lessmask(const float4& a, const float4& b)
+	{
+		return (a.v[0] < b.v[0]) | ((a.v[1] < b.v[1]) << 1) | ((a.v[2] < b.v[2]) << 2) | ((a.v[3] < b.v[3]) << 3);
+	}
+#endif
+};
+
+/// Массив кватернионов в SoA-раскладке (x, y, z, w отдельными массивами).
+struct SoaQuats
+{
+	std::vector<float> x, y, z, w;
+
+	void Resize(int count)
+	{
+		x.assign(count, 0);
+		y.assign(count, 0);
+		z.assign(count, 0);
+		w.assign(count, 1);
+	}
+	quat Get(int i) const
+	{
+		return quat(x[i], y[i], z[i], w[i]);
+	}
+	void Set(int i, const quat& q)
+	{
+		x[i] = q.x;
+		y[i] = q.y;
+		z[i] = q.z;
+		w[i] = q.w;
+	}
+};
+
+/// Массив векторов в SoA-раскладке (x, y, z отдельными массивами).
+struct SoaVecs
+{
+	std::vector<float> x, y, z;
+
+	void Resize(int count)
+	{
+		x.assign(count, 0);
+		y.assign(count, 0);
+		z.assign(count, 0);
+	}
+	vec3 Get(int i) const
+	{
+		return vec3(x[i], y[i], z[i]);
+	}
+	void Set(int i, const vec3& v)
+	{
+		x[i] = v.x;
+		y[i] = v.y;
+		z[i] = v.z;
+	}
+};
+
+#endif
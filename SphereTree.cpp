@@ -0,0 +1,172 @@
+#include "SphereTree.hpp"
+#include "Frustum.hpp"
+
+const float SphereTree::maxRefitGrowth = 0.5f;
+
+SphereTree::SphereTree() : builtRadiiSum(0), refitGrowth(0) {}
+
+void SphereTree::Build(const std::vector<vec3>& centers, const std::vector<float>& radii)
+{
+	nodes.clear();
+	items.clear();
+	unboundedItems.clear();
+	itemCenters = centers;
+	itemRadii = radii;
+	itemLeaves.assign(centers.size(), -1);
+
+	for(int i = 0; i < (int)centers.size(); ++i)
+		(radii[i] < 0 ? unboundedItems : items).push_back(i);
+
+	if(!items.empty())
+		BuildNode(centers, radii, 0, (int)items.size(), -1);
+
+	builtRadiiSum = 0;
+	for(size_t i = 0; i < nodes.size(); ++i)
+		builtRadiiSum += nodes[i].radius;
+	refitGrowth = 0;
+}
+
+int SphereTree::BuildNode(const std::vector<vec3>& centers, const std::vector<float>& radii, int first, int count, int parent)
+{
+	int node = (int)nodes.size();
+	nodes.push_back(Node());
+	nodes[node].first = first;
+	nodes[node].count = count;
+	nodes[node].right = -1;
+	nodes[node].parent = parent;
+	FitLeaf(node);
+
+	if(count <= maxLeafItemsCount)
+	{
+		for(int i = first; i < first + count; ++i)
+			itemLeaves[items[i]] = node;
+		return node;
+	}
+
+	// разделить по медиане центров вдоль самой длинной оси
+	vec3 minPosition = centers[items[first]], maxPosition = minPosition;
+	for(int i = first + 1; i < first + count; ++i)
+	{
+		const vec3& c = centers[items[i]];
+		minPosition = vec3(std::min(minPosition.x, c.x), std::min(minPosition.y, c.y), std::min(minPosition.z, c.z));
+		maxPosition = vec3(std::max(maxPosition.x, c.x), std::max(maxPosition.y, c.y), std::max(maxPosition.z, c.z));
+	}
+	vec3 size = maxPosition - minPosition;
+	int axis = size.x >= size.y && size.x >= size.z ? 0 : size.y >= size.z ? 1 : 2;
+	struct Sorter
+	{
+		const std::vector<vec3>& centers;
+		int axis;
+		bool operator()(int a, int b) const
+		{
+			const vec3& ca = centers[a];
+			const vec3& cb = centers[b];
+			return (axis == 0 ? ca.x : axis == 1 ? ca.y : ca.z) < (axis == 0 ? cb.x : axis == 1 ? cb.y : cb.z);
+		}
+	} sorter = { centers, axis };
+	int half = count / 2;
+	std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count, sorter);
+
+	BuildNode(centers, radii, first, half, node);
+	int right = BuildNode(centers, radii, first + half, count - half, node);
+	nodes[node].right = right;
+
+	return node;
+}
+
+void SphereTree::FitLeaf(int node)
+{
+	Node& n = nodes[node];
+
+	// центр - центр параллелепипеда, ограничивающего сферы элементов
+	const vec3& firstCenter = itemCenters[items[n.first]];
+	float firstRadius = itemRadii[items[n.first]];
+	vec3 minPosition = firstCenter - vec3(firstRadius, firstRadius, firstRadius);
+	vec3 maxPosition = firstCenter + vec3(firstRadius, firstRadius, firstRadius);
+	for(int i = n.first + 1; i < n.first + n.count; ++i)
+	{
+		const vec3& c = itemCenters[items[i]];
+		float r = itemRadii[items[i]];
+		minPosition = vec3(std::min(minPosition.x, c.x - r), std::min(minPosition.y, c.y - r), std::min(minPosition.z, c.z - r));
+		maxPosition = vec3(std::max(maxPosition.x, c.x + r), std::max(maxPosition.y, c.y + r), std::max(maxPosition.z, c.z + r));
+	}
+	n.center = (minPosition + maxPosition) * 0.5f;
+	n.radius = 0;
+	for(int i = n.first; i < n.first + n.count; ++i)
+		n.radius = std::max(n.radius, length(itemCenters[items[i]] - n.center) + itemRadii[items[i]]);
+}
+
+void SphereTree::Update(int item, const vec3& center, float radius)
+{
+	itemCenters[item] = center;
+	itemRadii[item] = radius;
+
+	int node = itemLeaves[item];
+	if(node < 0)
+		return;
+	float oldLeafRadius = nodes[node].radius;
+	FitLeaf(node);
+	refitGrowth += std::max(nodes[node].radius - oldLeafRadius, 0.0f);
+
+	// расширить сферы предков, пока новая сфера в них не помещается
+	const Node* child = &nodes[node];
+	for(node = child->parent; node >= 0; node = nodes[node].parent)
+	{
+		Node& n = nodes[node];
+		float distance = length(child->center - n.center);
+		if(distance + child->radius <= n.radius)
+			break;
+		float oldRadius = n.radius;
+		if(distance + n.radius <= child->radius)
+		{
+			n.center = child->center;
+			n.radius = child->radius;
+		}
+		else
+		{
+			// наименьшая сфера, содержащая обе
+			float newRadius = (distance + child->radius + n.radius) * 0.5f;
+			n.center = n.center + (child->center - n.center) * ((newRadius - n.radius) / distance);
+			n.radius = newRadius;
+		}
+		refitGrowth += n.radius - oldRadius;
+		child = &n;
+	}
+}
+
+bool SphereTree::NeedsRebuild() const
+{
+	return refitGrowth > builtRadiiSum * maxRefitGrowth;
+}
+
+void SphereTree::QueryNode(int node, const Frustum& frustum, bool inside, std::vector<int>& result) const
+{
+	const Node& n = nodes[node];
+	if(!inside)
+	{
+		if(!frustum.Intersects(n.center, n.radius))
+			return;
+		inside = frustum.Contains(n.center, n.radius);
+	}
+
+	if(n.right < 0)
+	{
+		for(int i = n.first; i < n.first + n.count; ++i)
+		{
+			int item = items[i];
+			if(inside || frustum.Intersects(itemCenters[item], itemRadii[item]))
+				result.push_back(item);
+		}
+		return;
+	}
+
+	QueryNode(node + 1, frustum, inside, result);
+	QueryNode(n.right, frustum, inside, result);
+}
+
+void SphereTree::Query(const Frustum& frustum, std::vector<int>& result) const
+{
+	result.insert(result.end(), unboundedItems.begin(), unboundedItems.end());
+	if(!nodes.empty())
+		QueryNode(0, frustum, false, result);
+}
@@ -0,0 +1,70 @@
+#ifndef ___FARSH_SPHERE_TREE_HPP___
+#define ___FARSH_SPHERE_TREE_HPP___
+
+#include "general.hpp"
+
+class Frustum;
+
+/// Иерархия ограничивающих сфер.
+/** Строится один раз по сферам элементов (делением пополам
+по самой длинной оси) и позволяет быстро отобрать элементы,
+пересекающие пирамиду видимости: поддеревья вне пирамиды
+отбрасываются целиком, а лежащие внутри добавляются без проверок.
+Элементы с неизвестными границами (отрицательный радиус) видны всегда. */
+class SphereTree
+{
+private:
+	/// Узел дерева.
+	struct Node
+	{
+		vec3 center;
+		float radius;
+		/// Диапазон элементов в items.
+		int first, count;
+		/// Правый потомок (левый идёт сразу за узлом); -1 у листа.
+		int right;
+		/// Родитель; -1 у корня.
+		int parent;
+	};
+	std::vector<Node> nodes;
+	/// Номера элементов, упорядоченные по листьям.
+	std::vector<int> items;
+	/// Сферы элементов.
+	std::vector<vec3> itemCenters;
+	std::vector<float> itemRadii;
+	/// Элементы, видимые всегда.
+	std::vector<int> unboundedItems;
+	/// Листья элементов; -1 у видимых всегда.
+	std::vector<int> itemLeaves;
+
+	/// Максимальное количество элементов в листе.
+	static const int maxLeafItemsCount = 4;
+	/// Сумма радиусов узлов после построения.
+	float builtRadiiSum;
+	/// Суммарный рост радиусов узлов при обновлениях с момента построения.
+	float refitGrowth;
+	/// Допустимый рост радиусов относительно builtRadiiSum.
+	static const float maxRefitGrowth;
+
+	int BuildNode(const std::vector<vec3>& centers, const std::vector<float>& radii, int first, int count, int parent);
+	/// Пересчитать сферу листа по сферам элементов.
+	void FitLeaf(int node);
+	void QueryNode(int node, const Frustum& frustum, bool inside, std::vector<int>& result) const;
+
+public:
+	SphereTree();
+
+	/// Построить дерево.
+	void Build(const std::vector<vec3>& centers, const std::vector<float>& radii);
+	/// Добавить в result номера элементов, пересекающих пирамиду.
+	void Query(const Frustum& frustum, std::vector<int>& result) const;
+	/// Обновить сферу элемента.
+	/** Сферы узлов над элементом расширяются, структура дерева не меняется,
+	поэтому после больших перемещений дерево стоит перестроить, см. NeedsRebuild.
+	Элемент должен быть ограничен и до, и после обновления. */
+	void Update(int item, const vec3& center, float radius);
+	/// Разрослись ли сферы узлов при обновлениях настолько, что дерево пора перестроить.
+	bool NeedsRebuild() const;
+};
+
+#endif
@@ -4,6 +4,10 @@ Farsh.t = {}
 local t = Farsh.t
 
 game:SetAmbient(0.02, 0.02, 0.02)
+--game:SetDepthPrepass(true)
+--[[
+game:SetSun({-1, -0.5, -2}, {0.4, 0.4, 0.35})
+--]]
 
 -- материал кровищи
 local matBlood = Farsh.Material()
@@ -62,6 +66,19 @@ light2:SetPosition({30, -10, 20})
 light2:SetTarget({11, 11, 0})
 light2:SetProjection(45, 0.1, 100)
 light2:SetShadow(true)
+--[[
+-- россыпь простых источников над полом для кластерного (или отложенного) освещения
+game:SetClusteredLighting(true)
+--game:SetDeferredShading(true)
+for i = 1, 5 do
+	for j = 1, 5 do
+		local light = game:AddStaticLight()
+		light:SetPosition({i * 4, j * 4, 1})
+		light:SetColor({0.2 * i, 0.2 * j, 0.5})
+		light:SetRange(5)
+	end
+end
+--]]
 
 -- установка параметров
 
@@ -73,20 +90,43 @@ zombieMaterial:SetDiffuseTexture(zhDiffuse)
 zombieMaterial:SetSpecularTexture(zhSpecular)
 local zombieGeometry = game:LoadSkinnedGeometry("/zombie.geo")
 local zombieSkeleton = game:LoadSkeleton("/zombie.skeleton")
+-- дальше ~10 м анимация реже, дальше ~20 м без листовых костей
+zombieSkeleton:SetLod(0.25, 0.12)
 game:SetZombieParams(zombieMaterial, zombieGeometry, zombieSkeleton, game:LoadBoneAnimation("/zombie.ba", zombieSkeleton))
 
 game:SetHeroParams(zombieMaterial, zombieGeometry, zombieSkeleton, game:LoadBoneAnimation("/hero.ba", zombieSkeleton))
+--[[
+-- запечённые анимации: выборка с фиксированной частотой вместо поиска ключей
+game:SetZombieParams(zombieMaterial, zombieGeometry, zombieSkeleton, game:LoadBakedBoneAnimation("/zombie.ba", zombieSkeleton, 30, 0.001))
+game:SetHeroParams(zombieMaterial, zombieGeometry, zombieSkeleton, game:LoadBakedBoneAnimation("/hero.ba", zombieSkeleton, 30, 0.001))
+--]]
 
 local axeMaterial = Farsh.Material()
 axeMaterial:SetDiffuseTexture(game:LoadTexture("/axe_d.png"))
 --axeMaterial:SetSpecularTexture(game:LoadTexture("axe_s.png"))
 axeMaterial:SetSpecular({0.5, 0, 0, 0})
 game:SetAxeParams(axeMaterial, game:LoadGeometry("/axe.geo"), game:LoadBoneAnimation("/axe.ba", nil))
+--game:SetAxeParams(axeMaterial, game:LoadGeometry("/axe.geo"), game:LoadCompressedBoneAnimation("/axe.ba", nil, 0.001, 0.001))
 
 local circularMaterial = Farsh.Material()
 circularMaterial:SetDiffuseTexture(game:LoadTexture("/circular_d.png"))
 circularMaterial:SetSpecularTexture(game:LoadTexture("/circular_s.png"))
 game:SetCircularParams(circularMaterial, game:LoadGeometry("/circular.geo"), game:LoadBoneAnimation("/circular.ba", nil))
+--game:SetCircularParams(circularMaterial, game:LoadGeometry("/circular.geo"), game:LoadCompressedBoneAnimation("/circular.ba", nil, 0.001, 0.001))
 
 game:PlaceHero(10, 10, 10)
+--[[
+-- толпа зомби вокруг героя (рисуется инстансингом)
+for i = 0, 11 do
+	local a = i * math.pi / 6
+	game:PlaceZombie(10 + math.cos(a) * 4, 10 + math.sin(a) * 4, 10)
+end
+--]]
+--[[
+-- дальние зомби анимируются целиком на GPU
+for i = 0, 23 do
+	local a = i * math.pi / 12
+	game:PlaceBackgroundZombie(10 + math.cos(a) * 12, 10 + math.sin(a) * 12, 10)
+end
+--]]
 game:PlaceCamera({ 20.0, 0.0, 10.0 }, 2.315, -0.625);
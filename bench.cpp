@@ -0,0 +1,122 @@
+#include "general.hpp"
+#include "Game.hpp"
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+/*
+Бенчмарк кадра игры.
+
+Загружает main.lua, выполняет заданное количество тиков с фиксированным
+шагом времени и выводит в stdout времена фаз кадра в JSON.
+По умолчанию работает без окна и графики (для CI без GPU), и тогда
+фазы регистрации и рисования не замеряются.
+
+Аргументы: [количество тиков] [шаг времени, сек] [--render] [--workers N] [--pyramid-bloom]
+--pyramid-bloom - bloom пирамидой, для сравнения с обычным.
+*/
+
+/// Статистика по одной фазе кадра.
+struct PhaseStats
+{
+	std::vector<float> times;
+
+	void Print(std::ostream& stream, const char* name, bool measured) const
+	{
+		stream << "\t\t\"" << name << "\": ";
+		if(!measured || times.empty())
+		{
+			stream << "null";
+			return;
+		}
+
+		std::vector<float> sorted(times);
+		std::sort(sorted.begin(), sorted.end());
+		double total = 0;
+		for(size_t i = 0; i < sorted.size(); ++i)
+			total += sorted[i];
+
+		// времена в миллисекундах
+		stream
+			<< "{ \"total\": " << total * 1000
+			<< ", \"mean\": " << total * 1000 / sorted.size()
+			<< ", \"min\": " << sorted.front() * 1000
+			<< ", \"median\": " << sorted[sorted.size() / 2] * 1000
+			<< ", \"p95\": " << sorted[sorted.size() * 95 / 100] * 1000
+			<< ", \"max\": " << sorted.back() * 1000
+			<< " }";
+	}
+};
+
+int main(int argc, char** argv)
+{
+	int ticksCount = 1000;
+	float frameTime = 1.0f / 60;
+	bool render = false;
+	int workersCount = -1;
+	bool pyramidBloom = false;
+
+	for(int i = 1, positional = 0; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--render") == 0)
+			render = true;
+		else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+			workersCount = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--pyramid-bloom") == 0)
+			pyramidBloom = true;
+		else if(positional++ == 0)
+			ticksCount = atoi(argv[i]);
+		else
+			frameTime = (float)atof(argv[i]);
+	}
+
+	try
+	{
+		ptr<Game> game = NEW(Game(!render));
+		game->SetJobWorkersCount(workersCount);
+		game->Initialize();
+		game->SetFixedFrameTime(frameTime);
+		game->SetPyramidBloom(pyramidBloom);
+
+		PhaseStats input, physics, animation, registration, draw;
+		for(int i = 0; i < ticksCount; ++i)
+		{
+			game->Tick();
+
+			const Game::FrameStats& frameStats = game->GetFrameStats();
+			input.times.push_back(frameStats.input);
+			physics.times.push_back(frameStats.physics);
+			animation.times.push_back(frameStats.animation);
+			registration.times.push_back(frameStats.registration);
+			draw.times.push_back(frameStats.draw);
+		}
+
+		std::cout << "{\n";
+		std::cout << "\t\"ticks\": " << ticksCount << ",\n";
+		std::cout << "\t\"frameTime\": " << frameTime << ",\n";
+		std::cout << "\t\"headless\": " << (render ? "false" : "true") << ",\n";
+		std::cout << "\t\"pyramidBloom\": " << (pyramidBloom ? "true" : "false") << ",\n";
+		std::cout << "\t\"phases\": {\n";
+		input.Print(std::cout, "input", true);
+		std::cout << ",\n";
+		physics.Print(std::cout, "physics", true);
+		std::cout << ",\n";
+		animation.Print(std::cout, "animation", true);
+		std::cout << ",\n";
+		registration.Print(std::cout, "registration", render);
+		std::cout << ",\n";
+		draw.Print(std::cout, "draw", render);
+		std::cout << "\n\t}\n}\n";
+	}
+	catch(Exception* exception)
+	{
+		std::ostringstream s;
+		MakePointer(exception)->PrintStack(s);
+		std::cerr << s.str() << '\n';
+		return 1;
+	}
+
+	return 0;
+}
@@ -64,11 +64,17 @@ var dynamicLibraries = {
 	]
 };
 
+// исполняемые файлы: <conf>/F.A.R.S.H - игра, <conf>/F.A.R.S.H-bench - бенчмарк
+var mainObjects = {
+	'F.A.R.S.H': 'main',
+	'F.A.R.S.H-bench': 'bench'
+};
+
 exports.configureLinker = function(executableFile, linker) {
-	var a = /^(([^\/]+)\/)[^\/]+$/.exec(executableFile);
+	var a = /^(([^\/]+)\/)([^\/]+)$/.exec(executableFile);
 	linker.configuration = a[2];
 
-	var objects = ['main', 'meta', 'Geometry', 'GeometryFormats', 'Material', 'Painter', 'Game', 'Skeleton', 'BoneAnimation'];
+	var objects = [mainObjects[a[3]] || 'main', 'meta', 'Geometry', 'GeometryFormats', 'Material', 'Painter', 'Frustum', 'SphereTree', 'Game', 'Skeleton', 'BoneAnimation', 'BakedBoneAnimation', 'CompressedBoneAnimation', 'BoneAnimationTexture', 'JobSystem'];
 	for ( var i = 0; i < objects.length; ++i)
 		linker.addObjectFile(a[1] + objects[i]);
 
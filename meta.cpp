@@ -5,12 +5,46 @@
 #include "../inanity/inanity-math-script.ipp"
 
 #include "BoneAnimation.hpp"
+#include "BakedBoneAnimation.hpp"
+#include "CompressedBoneAnimation.hpp"
 #include "Game.hpp"
 #include "Material.hpp"
 #include "Skeleton.hpp"
 #include "Geometry.hpp"
 
+META_CLASS(BoneAnimationClip, Farsh.BoneAnimationClip);
+META_CLASS_END();
+
 META_CLASS(BoneAnimation, Farsh.BoneAnimation);
+	META_CLASS_PARENT(BoneAnimationClip);
+META_CLASS_END();
+
+META_CLASS(BakedBoneAnimation, Farsh.BakedBoneAnimation);
+	META_CLASS_PARENT(BoneAnimationClip);
+	META_METHOD(GetFrameRate);
+	META_METHOD(GetMaxAngularError);
+META_CLASS_END();
+
+META_CLASS(CompressedBoneAnimation, Farsh.CompressedBoneAnimation);
+	META_CLASS_PARENT(BoneAnimationClip);
+	META_METHOD(GetKeysCount);
+	META_METHOD(GetDataSize);
+META_CLASS_END();
+
+META_CLASS(BoneAnimationFrame, Farsh.BoneAnimationFrame);
+	META_CONSTRUCTOR(ptr<BoneAnimationClip>);
+	META_METHOD(AddLayer);
+	META_METHOD(GetLayersCount);
+	META_METHOD(SetLayerClip);
+	META_METHOD(SetLayerTime);
+	META_METHOD(GetLayerTime);
+	META_METHOD(SetLayerLoop);
+	META_METHOD(SetLayerWeight);
+	META_METHOD(SetLayerBoneWeight);
+	META_METHOD(SetLayerBranchWeight);
+	META_METHOD(Advance);
+	META_METHOD(SetScreenSize);
+	META_METHOD(GetUpdatePeriod);
 META_CLASS_END();
 
 META_CLASS(Game, Farsh.Game);
@@ -20,6 +54,8 @@ META_CLASS(Game, Farsh.Game);
 	META_METHOD(LoadSkinnedGeometry);
 	META_METHOD(LoadSkeleton);
 	META_METHOD(LoadBoneAnimation);
+	META_METHOD(LoadBakedBoneAnimation);
+	META_METHOD(LoadCompressedBoneAnimation);
 	META_METHOD(CreatePhysicsBoxShape);
 	META_METHOD(CreatePhysicsRigidBody);
 	META_METHOD(AddStaticModel);
@@ -28,11 +64,19 @@ META_CLASS(Game, Farsh.Game);
 	META_METHOD(AddStaticLight);
 	META_METHOD(SetDecalMaterial);
 	META_METHOD(SetAmbient);
+	META_METHOD(SetSun);
+	META_METHOD(SetDepthPrepass);
+	META_METHOD(SetClusteredLighting);
+	META_METHOD(SetDeferredShading);
+	META_METHOD(SetPyramidBloom);
 	META_METHOD(SetZombieParams);
 	META_METHOD(SetHeroParams);
 	META_METHOD(SetAxeParams);
 	META_METHOD(SetCircularParams);
 	META_METHOD(PlaceHero);
+	META_METHOD(PlaceZombie);
+	META_METHOD(PlaceBackgroundZombie);
+	META_METHOD(GetHeroAnimationFrame);
 	META_METHOD(PlaceCamera);
 META_CLASS_END();
 
@@ -42,6 +86,7 @@ META_CLASS(StaticLight, Farsh.StaticLight);
 	META_METHOD(SetProjection);
 	META_METHOD(SetColor);
 	META_METHOD(SetShadow);
+	META_METHOD(SetRange);
 META_CLASS_END();
 
 META_CLASS(Material, Farsh.Material);
@@ -56,6 +101,7 @@ META_CLASS(Material, Farsh.Material);
 META_CLASS_END();
 
 META_CLASS(Skeleton, Farsh.Skeleton);
+	META_METHOD(SetLod);
 META_CLASS_END();
 
 META_CLASS(Geometry, Farsh.Geometry);